@@ -2,4 +2,43 @@
 
 #pragma once
 
+#ifndef MAX_INVERTERS
 #define MAX_INVERTERS 8
+#endif
+// history slots are large (several 100kB in psram each) and thus limited independently of the inverter count
+#ifndef MAX_HISTORY_INVERTERS
+#define MAX_HISTORY_INVERTERS (MAX_INVERTERS < 8 ? MAX_INVERTERS: 8)
+#endif
+// named series of the history registry (history_data.h), the psram arena all of them take their blocks from is
+// HISTORY_ARENA_KB large, registrations which do not fit any more fail at startup
+#ifndef MAX_HISTORY_SERIES
+#define MAX_HISTORY_SERIES 8
+#endif
+#ifndef HISTORY_ARENA_KB
+#define HISTORY_ARENA_KB 7600
+#endif
+// psram of the control trace ring (control_trace.h), the frames grow with MAX_INVERTERS so fewer cycles fit
+#ifndef TRACE_KB
+#define TRACE_KB 256
+#endif
+
+// 1 to store the history uncompressed with implicit timestamps (dense.h) instead of the gorilla compression,
+// scans are faster but the same psram holds about a quarter of the time span (see tools/scan_bench)
+#ifndef HISTORY_DENSE
+#define HISTORY_DENSE 0
+#endif
+
+// controllable loads (wallboxes, heat pumps) the emm can feed with surplus power
+#ifndef MAX_LOADS
+#define MAX_LOADS 4
+#endif
+
+// 1 to run the emm allocation in fixed point, which makes traces replay bit exact on the host
+#ifndef EMM_FIXED_POINT
+#define EMM_FIXED_POINT 0
+#endif
+
+// task notification indices used by the modbus task to wait for the device state machines
+#define INVERTER_NOTIFY_INDEX 0
+#define METER_NOTIFY_INDEX 1
+#define LOAD_NOTIFY_INDEX 2
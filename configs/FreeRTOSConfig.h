@@ -65,7 +65,7 @@
 #define configUSE_QUEUE_SETS                    1
 #define configUSE_TIME_SLICING                  1
 #define configUSE_NEWLIB_REENTRANT              0
-#define configTASK_NOTIFICATION_ARRAY_ENTRIES   (MAX_INVERTERS + 1) // is used for power synchronization, so as many entries are needed as inverters are supported + 1 for meter
+#define configTASK_NOTIFICATION_ARRAY_ENTRIES   3 // is used for power synchronization, one counting notification each for all inverters, the meter and all loads
 // todo need this for lwip FreeRTOS sys_arch to compile
 #define configENABLE_BACKWARD_COMPATIBILITY     1
 #define configNUM_THREAD_LOCAL_STORAGE_POINTERS 5
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <span>
+
+#include "emm.h"
+
+/**
+ * @brief Identifies the control loop of an installation with a power step on one inverter.
+ * The request of the inverter is held, raised by a small step and lowered again while the inverter power and the
+ * derived home power are sampled each control cycle. From the step responses the dead time and the time constant
+ * of the inverter and the disturbance of the home power (meter and inverter are not read at the same time)
+ * are determined, which give the emm filter_alpha and loop_gain.
+ */
+struct auto_tune {
+	enum struct state: uint8_t { IDLE, SETTLE, STEP_UP, STEP_DOWN, DONE, FAILED };
+	static constexpr int SETTLE_CYCLES{10};
+	static constexpr int STEP_CYCLES{20};
+	static constexpr float MAX_STEP_W{500};
+	static constexpr float CYCLE_S{1};	// control cycle of the modbus task
+
+	std::atomic<int> requested_inverter{-1}; // set from other tasks to start a tuning run
+	state cur_state{state::IDLE};
+	int inverter{-1};
+	int cycle{};
+	float base_request{};
+	float step_w{};
+	float inverter_base_w{};
+	float home_base_w{};
+	std::array<float, STEP_CYCLES> up_inverter_w{}, up_home_w{}, down_inverter_w{}, down_home_w{};
+	// results of the last run
+	float dead_time_s{};
+	float time_constant_s{};
+	float disturbance{};	// max home power deviation relative to the step
+	float filter_alpha{};
+	float loop_gain{};
+	const char *error{};
+
+	static auto_tune& Default() {
+		static auto_tune t{};
+		return t;
+	}
+	void request(int inverter_idx) { requested_inverter = inverter_idx; }
+	bool running() const { return cur_state == state::SETTLE || cur_state == state::STEP_UP || cur_state == state::STEP_DOWN; }
+	// has to be called every control cycle after EMM::update_power, overrides the request of the tuned inverter.
+	// home_w is the unfiltered home power. Returns true in the cycle a run finished (see cur_state for the result)
+	bool update(std::span<const InverterGroup> inverter_groups, std::span<ControlPowerInfo> control_infos, float home_w);
+};
+
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+/**
+ * @brief Throughput and cycle counters of a single battery.
+ * Equivalent full cycles are integrated from the soc changes (200 % soc change is one cycle), so no capacity
+ * is needed. A half cycle ends when the soc direction turns by more than TURN_HYSTERESIS, its depth is
+ * sorted into the depth of discharge histogram.
+ */
+struct battery_wear {
+	static constexpr float TURN_HYSTERESIS{1};	// soc change in % before a direction change counts
+	static constexpr std::array<float, 4> DOD_EDGES{5, 20, 50, 80}; // upper bounds of the histogram bins in %
+
+	double charge_wh{};
+	double discharge_wh{};
+	float cycles{};		// equivalent full cycles
+	uint32_t half_cycles{};
+	std::array<uint32_t, DOD_EDGES.size() + 1> dod_histogram{}; // half cycles per depth bin
+	float last_soc{-1};	// -1 if the battery was not seen in the last update
+	float turn_soc{-1};	// soc at the last turning point
+	float extreme_soc{-1};	// soc furthest away from turn_soc in the current direction
+	int8_t direction{};	// 1 charging, -1 discharging, 0 unknown
+
+	void update(float charge_w, float discharge_w, float soc, float dt_h) {
+		charge_wh += charge_w * dt_h;
+		discharge_wh += discharge_w * dt_h;
+		if (last_soc >= 0)
+			cycles += std::abs(soc - last_soc) / 200;
+		last_soc = soc;
+		if (turn_soc < 0) {
+			turn_soc = extreme_soc = soc;
+			return;
+		}
+		if (direction == 0) {
+			if (std::abs(soc - turn_soc) >= TURN_HYSTERESIS) {
+				direction = soc > turn_soc ? 1: -1;
+				extreme_soc = soc;
+			}
+			return;
+		}
+		if ((soc - extreme_soc) * direction > 0) { // still going in the same direction
+			extreme_soc = soc;
+			return;
+		}
+		if (std::abs(soc - extreme_soc) < TURN_HYSTERESIS)
+			return;
+		// direction changed, the half cycle went from turn_soc to extreme_soc
+		float dod = std::abs(extreme_soc - turn_soc);
+		int bin{};
+		while (bin < int(DOD_EDGES.size()) && dod > DOD_EDGES[bin])
+			++bin;
+		++dod_histogram[bin];
+		++half_cycles;
+		turn_soc = extreme_soc;
+		extreme_soc = soc;
+		direction = -direction;
+	}
+	// call when the battery is not available to not count the soc jump at reconnect as cycle
+	void pause() { last_soc = -1; }
+};
+
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <string_view>
+
+#include "hardware/timer.h"
+#include "seqlock.h"
+
+/**
+ * @brief Deadline monitor of the control loop in the modbus task.
+ * Each cycle is split into phases whose durations are accumulated, the start of each cycle is compared to the
+ * start of the previous one to get the period jitter, and cycles which take longer than the period are counted as overrun.
+ * The working copy is only touched by the modbus task, readers get the snapshot published at the end of each cycle.
+ */
+struct control_timing {
+	static constexpr uint32_t PERIOD_MS{1000};
+	enum phase: uint8_t { DISCOVER, RETRIEVE, WAIT, EMM, HISTORY, STALE, PHASE_COUNT };
+	static constexpr std::array<std::string_view, PHASE_COUNT> PHASE_NAMES{"discover", "retrieve", "wait", "emm", "history", "stale"};
+	struct duration_stats {
+		uint32_t last_us{};
+		uint32_t max_us{};
+		uint64_t total_us{};
+		void add(uint32_t us) { last_us = us; max_us = std::max(max_us, us); total_us += us; }
+	};
+	struct stats {
+		uint32_t cycles{};
+		uint32_t overruns{};		// cycles which took longer than the period
+		uint32_t missed_periods{};	// periods skipped because of overruns
+		int32_t last_jitter_us{};	// start of the cycle relative to one period after the previous start
+		uint32_t max_jitter_us{};	// absolute
+		uint64_t total_jitter_us{};	// absolute
+		duration_stats cycle{};
+		std::array<duration_stats, PHASE_COUNT> phases{};
+	};
+
+	stats cur{};
+	seqlock<stats> published{};
+	uint64_t cycle_start_us{};
+	uint64_t phase_start_us{};
+	uint64_t prev_start_us{};	// 0 if the loop was paused and the next start has no reference
+
+	static control_timing& Default() {
+		static control_timing t{};
+		return t;
+	}
+	void begin_cycle() {
+		cycle_start_us = phase_start_us = time_us_64();
+		if (prev_start_us) {
+			int32_t jitter_us = int32_t(cycle_start_us - prev_start_us) - int32_t(PERIOD_MS * 1000);
+			cur.last_jitter_us = jitter_us;
+			cur.max_jitter_us = std::max(cur.max_jitter_us, uint32_t(std::abs(jitter_us)));
+			cur.total_jitter_us += std::abs(jitter_us);
+		}
+		prev_start_us = cycle_start_us;
+	}
+	// ends phase p, the next phase starts now
+	void phase_done(phase p) {
+		uint64_t now_us = time_us_64();
+		cur.phases[p].add(uint32_t(now_us - phase_start_us));
+		phase_start_us = now_us;
+	}
+	void end_cycle() {
+		uint32_t cycle_us = uint32_t(time_us_64() - cycle_start_us);
+		cur.cycle.add(cycle_us);
+		++cur.cycles;
+		if (cycle_us > PERIOD_MS * 1000) {
+			++cur.overruns;
+			cur.missed_periods += cycle_us / (PERIOD_MS * 1000);
+		}
+		published.write(cur);
+	}
+	// the loop was paused (eg. no wifi), the next cycle start is not a period after the last one
+	void pause() { prev_start_us = 0; }
+};
+
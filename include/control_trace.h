@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+
+#include "trace_format.h"
+#include "history_data.h"
+
+constexpr int TRACE_FRAMES{TRACE_KB * 1024 / sizeof(trace::frame)}; // ~11 minutes of control cycles with 8 inverters
+
+namespace t {
+using trace_frames = static_ring_buffer<trace::frame, TRACE_FRAMES>;
+}
+
+namespace g {
+inline t::trace_frames trace_frames_psram PSRAM;
+inline t::thread_safe<t::trace_frames> trace_frames{trace_frames_psram};
+}
+
+/**
+ * @brief Recorder for the inputs and outputs of each control cycle.
+ * The current cycle is assembled in cur and only copied to the psram ring on commit().
+ * While traces are read out (readers > 0) recording is paused and clear() is rejected to keep the snapshot consistent.
+ * The recorded trace can be replayed on the host with tools/emm_replay.
+ */
+struct control_trace {
+	std::atomic<bool> enabled{};
+	std::atomic<int> readers{};
+	trace::frame cur{};
+
+	static control_trace& Default() {
+		static control_trace trace{};
+		return trace;
+	}
+	// returns false if a read out is running, the frames are kept then
+	bool clear() {
+		auto frames = g::trace_frames.access();
+		if (readers > 0)
+			return false;
+		frames.data.clear();
+		return true;
+	}
+	void commit() {
+		auto frames = g::trace_frames.access();
+		if (readers == 0)
+			frames.data.push(cur);
+	}
+	// pauses recording and returns the amount of frames available for read out, has to be followed by end_read()
+	int begin_read() {
+		auto frames = g::trace_frames.access();
+		++readers;
+		return frames.data.size();
+	}
+	void end_read() { --readers; }
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+
+#include "ranges_util.h"
+#include "static_types.h"
+
+/**
+ * @brief Uncompressed time series with implicit timestamps, the alternative layout to gorilla.h (HISTORY_DENSE).
+ * A block covers SLOTS consecutive steps from its start time, a bitmap marks the steps which have a sample and the
+ * values of each channel are stored contiguously at the index of their step (structure of arrays), so a scan reads
+ * the floats directly instead of decoding bit by bit. Gaps inside a block leave their slots unused, a gap longer than
+ * the rest of the block starts a new block at the next sample. Same interface as gorilla::series.
+ */
+namespace dense {
+
+template<typename Sample, uint32_t STEP>
+struct block {
+	static constexpr int BYTES{256};
+	static constexpr int HEADER_BYTES{8};
+	static constexpr int SLOTS{(BYTES - HEADER_BYTES) * 8 / (32 * Sample::CHANNELS + 1)}; // a float per channel and a bitmap bit
+	uint32_t start_time;
+	uint16_t count;
+	uint16_t last;		// slot of the newest sample
+	std::array<uint8_t, (SLOTS + 7) / 8> present;
+	std::array<std::array<float, SLOTS>, Sample::CHANNELS> values;
+
+	uint32_t end_time() const { return start_time + last * STEP; }
+	uint32_t time(int slot) const { return start_time + slot * STEP; }
+	// calls f(slot) for the present slots from first on until f returns false, returns false if f did
+	template<typename F>
+	bool for_each(int first, F &&f) const {
+		for (int byte = first >> 3; byte <= last >> 3; ++byte) {
+			uint32_t bits = present[byte] & (0xffu << (byte == first >> 3 ? first & 7: 0));
+			for (; bits; bits &= bits - 1)
+				if (!f(byte * 8 + std::countr_zero(bits)))
+					return false;
+		}
+		return true;
+	}
+	Sample sample(int slot) const {
+		Sample v{};
+		v.time = time(slot);
+		for (int c: range(Sample::CHANNELS))
+			v.set_channel(c, values[c][slot]);
+		return v;
+	}
+};
+
+// with BLOCKS 0 the blocks are handed in at runtime by assign()
+template<typename Sample, int BLOCKS, uint32_t STEP>
+struct series {
+	using block_t = block<Sample, STEP>;
+	static_assert(sizeof(block_t) <= block_t::BYTES);
+	std::conditional_t<BLOCKS == 0, span_ring_buffer<block_t>, static_ring_buffer<block_t, BLOCKS>> blocks{};
+	int samples{};
+	Sample newest{};
+
+	void assign(std::span<block_t> storage) requires (BLOCKS == 0) { blocks = {.storage = storage}; samples = 0; }
+	void clear() { blocks.clear(); samples = 0; }
+	int size() const { return samples; }
+	bool empty() const { return samples == 0; }
+	const Sample& back() const { return newest; }
+	void push(const Sample &v) {
+		if (!blocks.capacity())
+			return;
+		// samples which are not after the newest slot, behind the block or off the step grid start a new block
+		uint32_t offset = blocks.empty() || v.time < blocks[-1].start_time ? UINT32_MAX: v.time - blocks[-1].start_time;
+		uint32_t slot = offset % STEP ? UINT32_MAX: offset / STEP;
+		if (slot >= uint32_t(block_t::SLOTS) || (blocks[-1].count && slot <= blocks[-1].last)) {
+			if (blocks.size() == blocks.capacity())
+				samples -= blocks[0].count;
+			block_t *b = blocks.push();
+			b->start_time = v.time;
+			b->count = 0;
+			b->present = {};
+			slot = 0;
+		}
+		block_t &b = blocks[-1];
+		b.present[slot >> 3] |= 1 << (slot & 7);
+		for (int c: range(Sample::CHANNELS))
+			b.values[c][slot] = v.channel(c);
+		b.last = slot;
+		++b.count;
+		++samples;
+		newest = v;
+	}
+	uint32_t front_time() const { return blocks.empty() ? UINT32_MAX: blocks[0].start_time; }
+	// calls f with the samples in [t_begin, t_end) oldest first until f returns false
+	template<typename F>
+	void visit(uint32_t t_begin, uint32_t t_end, F &&f) const {
+		int lo = 0, hi = blocks.size();
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (blocks[mid].end_time() < t_begin) lo = mid + 1;
+			else hi = mid;
+		}
+		for (int bi = lo; bi < blocks.size(); ++bi) {
+			const block_t &b = blocks[bi];
+			if (b.start_time >= t_end)
+				return;
+			int first = t_begin > b.start_time ? (t_begin - b.start_time + STEP - 1) / STEP: 0; // no search inside the block
+			bool more = b.for_each(first, [&](int slot) {
+				if (b.time(slot) >= t_end)
+					return false;
+				return bool(f(b.sample(slot)));
+			});
+			if (!more)
+				return;
+		}
+	}
+	int read(uint32_t t_begin, uint32_t t_end, std::span<Sample> out) const {
+		int n{};
+		if (out.size())
+			visit(t_begin, t_end, [&](const Sample &v) { out[n++] = v; return n < int(out.size()); });
+		return n;
+	}
+	// the out.size() samples before the skip newest samples oldest first, returns the amount written
+	int read_last(int skip, std::span<Sample> out) const {
+		int first = std::max(samples - skip - int(out.size()), 0);
+		int last = samples - skip;
+		if (last <= first)
+			return 0;
+		int bi = blocks.size(), block_first = samples;
+		while (bi > 0 && block_first > first)
+			block_first -= blocks[--bi].count;
+		int n{};
+		for (int idx = block_first; bi < blocks.size() && idx < last; ++bi) {
+			const block_t &b = blocks[bi];
+			b.for_each(0, [&](int slot) {
+				if (idx >= first)
+					out[n++] = b.sample(slot);
+				return ++idx < last;
+			});
+		}
+		return n;
+	}
+};
+
+}
+
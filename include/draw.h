@@ -5,6 +5,7 @@
 #include "libraries/pico_vector/pico_vector.hpp"
 #include "emm_structs.h"
 #include "emm.h"
+#include "power_flow.h"
 
 using Point = pimoroni::Point;
 using Rect = pimoroni::Rect;
@@ -64,13 +65,6 @@ struct TimeInfo {
 	uint32_t ms;
 	uint32_t delta_ms;
 };
-struct EnergyInfo {
-	int device_id;
-	bool is_inverter;
-	float imp_ws;
-	float exp_ws;
-};
-enum struct SelectedHistory {SECOND = 0, MINUTE, HOUR, COUNT};
 struct OverviewPage {
 	float base_offset{};
 	float target_y_offset{};
@@ -78,16 +72,15 @@ struct OverviewPage {
 	bool drag_ig_view{};
 	float y_offset{};
 	uint32_t d_last_spawn_ms{};
-	EnergyInfo home_energy_info{.device_id = HOME_ID};
-	EnergyInfo meter_energy_info{.device_id = METER_ID};
-	static_vector<EnergyInfo, 32> energy_infos{};
+	uint32_t spawned_flow_ms{};	// power flow cycle whose bus energy was spawned as dots
+	// energy of the dc and grid flows accumulated until the next dot spawn (in Ws)
+	static_vector<DcFlow, MAX_INVERTERS> dc_ws{};
+	float grid_imp_ws{};
+	float grid_exp_ws{};
 	static_vector<EnergyBlobInfo, 256> energy_blobs{};
 	static_vector<uint8_t, 256> blobs_sorted{};
-	double tot_imp_wh{};
-	double tot_exp_wh{};
 
-	void draw(Draw &display, TimeInfo time_info, float x_offset, 
-	   std::span<InverterGroup> inverter_groups, PowerInfo home, PowerInfo meter);
+	void draw(Draw &display, TimeInfo time_info, float x_offset, const PowerFlow &flow);
 	bool handle_touch_input(TouchInfo &touch_info, int x_offset);
 };
 
@@ -110,17 +103,22 @@ struct CurveScale {
 };
 struct HistoryPage {
 	float base_offset{240};
-	float x_history_offseŧ{0};
+	float pan_s{0}; // seconds the right end of the plot lies before the newest sample, kept until the now button resets it
 	HistoryPageType history_page{DAILY};
 	VisType vis_type{POWER_PER_COMPONENT};
 	static_vector<CurveScale, 12> curve_scales{};
 	CurveInfo derived_curve{}; // used eg. for net import/export
 
-	SelectedHistory selected_history{SelectedHistory::SECOND};
-	Button second_button{{10, 30, 50, 15}, "Sekündlich", ButtonStyle::BORDER};
-	Button minute_button{{65, 30, 50, 15}, "Minütlich"};
-	Button hour_button{{120, 30, 50, 15}, "Stündlich"};
-	std::array<Button*, 3> time_buttons{&second_button, &minute_button, &hour_button};
+	// visible time span, the history level is chosen to match it (at most one bucket per pixel)
+	static constexpr std::array<uint32_t, 15> SPANS_S{180, 900, 3600, 7200, 21600, 43200, 86400, 3 * 86400, 7 * 86400,
+		14 * 86400, 30 * 86400, 91 * 86400, 182 * 86400, 365 * 86400, 3 * 365 * 86400};
+	static constexpr std::array<std::string_view, 15> SPAN_NAMES{"3min", "15min", "1h", "2h", "6h", "12h", "1T", "3T", "1W",
+		"2W", "1M", "3M", "6M", "1J", "3J"};
+	int span_idx{};
+	Button zoom_out_button{{10, 30, 20, 15}, "-"};
+	Button zoom_in_button{{35, 30, 20, 15}, "+"};
+	Button now_button{{60, 30, 30, 15}, "Jetzt"};
+	std::array<Button*, 3> time_buttons{&zoom_out_button, &zoom_in_button, &now_button};
 	Button net_power_button{{190, 30, 30, 15}, "Net W"};
 
 	bool drag_history_view{};
@@ -179,7 +177,7 @@ struct SettingsPage {
 	Button i0{{190, 210, 15, 15}, "0"};
 	Button ix{{210, 210, 15, 15}, "<-"};
 	std::array<Button*, 11> number_inputs{&i1, &i2, &i3, &i4, &i5, &i6, &i7, &i8, &i9, &i0, &ix};
-	static_vector<Button, 32> delete_buttons{};
+	static_vector<Button, MAX_INVERTERS * 2> delete_buttons{}; // found and configured inverters
 
 	void draw(Draw &display, TimeInfo time_info, float x_offset, settings &settings, runtime_state &runtime_state);
 	bool handle_touch_input(TouchInfo &touch_info, int x_offset);
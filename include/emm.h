@@ -1,6 +1,15 @@
 #pragma once
+#include "AppConfig.h"
 #include "emm_structs.h"
 #include "settings.h"
+#include "fixed_point.h"
+
+// number type used for the allocation, fixed point gives bit exact results on the device and on the host
+#if EMM_FIXED_POINT
+using emm_number = fixed;
+#else
+using emm_number = float;
+#endif
 
 struct InverterPower {
 	int device_id;
@@ -8,14 +17,33 @@ struct InverterPower {
 };
 
 struct EMM {
+	static constexpr float LOAD_HYSTERESIS_W{200}; // surplus margin for switching loads on/off to avoid toggling on noise
+	static constexpr float WEAR_MIN_SOC_MARGIN{2}; // wear aware allocation stops discharging this far above min_soc to avoid grid charge ping-pong
+	struct cost_counters {
+		uint32_t calls{};
+		uint32_t last_us{};
+		uint32_t max_us{};
+		uint64_t total_us{};
+	};
 	float filter_alpha{.1f}; // fraction of history power used to filter the incoming home_power (0 is using only home power, 1 is only using history home power)
+	float loop_gain{}; // lead on the filtered home power change to compensate the inverter lag (0 is off), set by auto_tune
 	float home_power{}; // this is the value that is approximated. Positive means power is consumed
-	static_vector<InverterPower, 32> inverter_target_power{};
+	std::array<float, PHASES> home_phase_power{}; // filtered per phase home power, same sign as home_power
+	static_vector<InverterPower, MAX_INVERTERS> inverter_target_power{};
 	bool invert_home{};
+	cost_counters cost{}; // runtime of update_power
 
 	// update the control infos of all inverters with a new home power usage
 	// home_new should be given as positive for power consumed from home, negative for power gotten from home
-	void update_power(float home_new, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, const settings &s);
+	// home_phases_new is the same split up per phase and only used if phase balancing is enabled in the settings
+	// loads get the surplus which is left after charging the batteries before anything is exported to the grid,
+	// now_s is used to keep the min switch times of the loads
+	void update_power(float home_new, const std::array<float, PHASES> &home_phases_new, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, const settings &s,
+			  std::span<LoadInfo> loads = {}, uint32_t now_s = 0);
+	// update_power with all intermediate values in T (float or fixed), update_power uses emm_number and counts the cost
+	template<typename T>
+	void update_power_t(float home_new, const std::array<float, PHASES> &home_phases_new, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, const settings &s,
+			    std::span<LoadInfo> loads = {}, uint32_t now_s = 0);
 };
 
 inline EMM& emm() {
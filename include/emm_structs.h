@@ -11,15 +11,21 @@ struct ModbusTcpAddr {
     bool operator<=>(const ModbusTcpAddr &o) const = default;
 };
 
+constexpr int PHASES = 3;
+// phase an inverter feeds into, ALL is used for symmetric three phase inverters
+enum struct Phase: uint8_t { ALL = 0, L1, L2, L3 };
+
 struct PowerInfo {
 	int device_id;
 	float imp_w;
 	float exp_w;
+	std::array<float, PHASES> phase_w{}; // signed power per phase, positive means import (only filled for meter and home)
 };
 
 struct InverterGroup {
 	PowerInfo inverter, pv, battery;
 	float bat_soc;
+	Phase phase{Phase::ALL};
 };
 
 struct ControlPowerInfo {
@@ -33,6 +39,20 @@ struct ControlPowerInfo {
 	bool is_active() const { return (time_us_64() / 1000000) - last_connection_s < 10; }
 };
 
+enum struct LoadType: uint8_t { WALLBOX = 0, SG_READY };
+// controllable consumer, fed by the emm with surplus power that would otherwise be exported
+struct LoadInfo {
+	PowerInfo power;		// measured consumption in imp_w
+	float power_min;		// smallest power the load runs with when switched on (eg. 6A for a wallbox)
+	float power_max;
+	float power_step;		// granularity of the setpoint
+	float requested_power;		// requested by the emm, 0 switches the load off (normal operation for sg ready)
+	uint32_t min_switch_s;		// min time between switching the load on or off
+	uint32_t last_switch_s;
+	uint32_t last_connection_s;
+	bool is_active() const { return (time_us_64() / 1000000) - last_connection_s < 10; }
+};
+
 constexpr inline float max_exp_pow_avail(const InverterGroup &ig, const ControlPowerInfo &pi) {
 	float bat_avail = ig.bat_soc > pi.min_soc ? pi.power_max_discha: 0;
 	return std::min(ig.pv.exp_w + bat_avail, pi.power_max);
@@ -44,6 +64,11 @@ constexpr inline bool requires_charge(const InverterGroup &ig, const ControlPowe
 	return ig.bat_soc < pi.min_soc;
 }
 
+// fraction of the inverter power which goes over phase p (p in [0, PHASES))
+constexpr inline float phase_share(Phase phase, int p) {
+	return phase == Phase::ALL ? 1.f / PHASES: float(int(phase) - 1 == p);
+}
+
 constexpr int HOME_ID = 0;
 constexpr int GRID_ID = 1;
 constexpr int METER_ID = 2;
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <ctime>
+#include <string_view>
+
+#include "battery_wear.h"
+#include "mutex.h"
+#include "power_flow.h"
+#include "ranges_util.h"
+#include "static_types.h"
+
+inline bool request_counters_store{};
+
+// energy of the plant per day, month and year (utc), gets persisted to flash
+struct energy_counters_data {
+	static constexpr uint32_t MAGIC{0x33544e43};
+	// the *_FROM_* channels are the attributed bus energy of the power flow (PowerFlow::bus_wh)
+	enum channel: uint8_t { GRID_IMPORT, GRID_EXPORT, PV, BATTERY_CHARGE, BATTERY_DISCHARGE, HOME,
+				HOME_FROM_GRID, HOME_FROM_INVERTERS, GRID_FROM_INVERTERS, INVERTERS_FROM_GRID, CHANNELS };
+	static constexpr std::array<std::string_view, CHANNELS> CHANNEL_NAMES{"grid_import", "grid_export", "pv", "battery_charge", "battery_discharge", "home",
+									       "home_from_grid", "home_from_inverters", "grid_from_inverters", "inverters_from_grid"};
+	template<typename T>
+	struct period {
+		uint32_t start;			// epoch seconds, 0 if the period never had a time
+		std::array<T, CHANNELS> wh;
+	};
+	using running = period<double>;		// small increments on large sums need double
+	using closed = period<float>;
+	// device ids are given out in discovery order, so the stored wear is keyed by the modbus address of the inverter
+	struct battery {
+		ModbusTcpAddr addr;
+		battery_wear wear;
+	};
+
+	uint32_t magic{MAGIC};
+	std::array<double, CHANNELS> total_wh{};	// since the counters were created
+	running day{};
+	running month{};
+	running year{};
+	static_ring_buffer<closed, 31> days{};
+	static_ring_buffer<closed, 24> months{};
+	static_ring_buffer<closed, 10> years{};
+	static_vector<battery, MAX_INVERTERS> batteries{};	// wear since each battery was first seen
+
+	constexpr void sanitize() {
+		const auto valid = [](const auto &wh) {
+			for (auto v: wh)
+				if (!std::isfinite(v) || v < 0 || v > 1e12)
+					return false;
+			return true;
+		};
+		const auto valid_ring = [&](const auto &r) {
+			if (r.cur_start < 0 || r.cur_start >= int(r.storage.size()) || r.cur_write < 0 || r.cur_write >= int(r.storage.size()))
+				return false;
+			for (const closed &p: r)
+				if (!valid(p.wh))
+					return false;
+			return true;
+		};
+		const auto valid_batteries = [&]() {
+			for (const battery &b: batteries)
+				if (!valid(std::array{b.wear.charge_wh, b.wear.discharge_wh, double(b.wear.cycles)}))
+					return false;
+			return true;
+		};
+		batteries.sanitize();
+		if (magic != MAGIC || !valid(total_wh) || !valid(day.wh) || !valid(month.wh) || !valid(year.wh) ||
+		    !valid_ring(days) || !valid_ring(months) || !valid_ring(years) || !valid_batteries())
+			*this = {};
+		for (battery &b: batteries) // the soc change while the device was off is no cycle
+			b.wear.pause();
+	}
+};
+
+/**
+ * @brief Energy counters of grid import/export, pv, battery charge/discharge and home consumption, and who supplied
+ * home and grid (attributed by the power flow).
+ * The powers of each control cycle are integrated with the trapezoidal rule, cycles more than MAX_GAP_MS apart
+ * (no wifi, modbus stalls) are not bridged. The grid energy is taken from the TotWhImp/TotWhExp registers of the meter
+ * when it provides them, the integrated energy is then only used to track the deviation between both.
+ * Closed days, months and years are kept as rollups, so dashboards read the energy without integrating the history.
+ * The wear counters of the batteries are kept and persisted with the energy.
+ * Written by the modbus task, readers copy what they need under the lock.
+ */
+struct energy_counters {
+	using channel = energy_counters_data::channel;
+	static constexpr uint32_t MAX_GAP_MS{10000};
+	static constexpr float MAX_METER_STEP_WH{1000};	// larger register jumps (meter replaced or reset) are not taken
+	static constexpr int STORE_HOURS{6};		// the counters are written to flash every few hours and on each new day
+
+	energy_counters_data data{};
+	mutex m{};
+	// integration state, only used by the modbus task
+	uint32_t last_ms{};
+	std::array<float, energy_counters_data::CHANNELS> last_w{};
+	float meter_imp_wh{};		// last register values, 0 if unknown
+	float meter_exp_wh{};
+	uint32_t last_store_hour{};
+	std::array<int, MAX_INVERTERS> battery_ids{};	// battery device id of each entry of data.batteries, 0 if not seen since the start
+	// integrated minus metered grid energy over the cycles where the meter registers were used, guarded by m
+	double deviation_imp_wh{};
+	double deviation_exp_wh{};
+
+	static energy_counters& Default() {
+		static energy_counters c{};
+		return c;
+	}
+	// integrates the powers of flow, tot_imp_wh and tot_exp_wh are the meter registers (0 if the meter has none),
+	// epoch_s is 0 without time, then the periods are not closed. ids gives the addresses of the batteries
+	void update(const PowerFlow &flow, const DeviceIds &ids, float tot_imp_wh, float tot_exp_wh, time_t epoch_s);
+	// wear counters of the battery with the device id, empty if it was not seen yet
+	battery_wear wear(int battery_id) {
+		scoped_lock lock{m};
+		for (int i: range(data.batteries.size()))
+			if (battery_ids[i] == battery_id)
+				return data.batteries[i].wear;
+		return {};
+	}
+	energy_counters_data::running today() {
+		scoped_lock lock{m};
+		return data.day;
+	}
+};
+
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <ctime>
+#include <span>
+
+#include "emm_structs.h"
+#include "mutex.h"
+
+inline bool request_profile_store{};
+
+// typical home consumption and pv power for each hour of the week (utc), gets persisted to flash
+struct energy_profile_data {
+	static constexpr uint32_t MAGIC{0x464f5250};
+	static constexpr int DAYS{7};	// index 0 is monday, 5 and 6 is the weekend
+	static constexpr int HOURS{24};
+	struct slot {
+		float mean_w;
+		uint16_t samples;	// saturates at energy_profile::WINDOW
+	};
+	using week = std::array<std::array<slot, HOURS>, DAYS>;
+
+	uint32_t magic{MAGIC};
+	uint32_t last_hour{};	// epoch hour of the last bucket that was added
+	week home{};
+	week pv{};
+
+	constexpr void sanitize() {
+		const auto valid = [](const week &w) {
+			for (const auto &day: w)
+				for (const slot &s: day)
+					if (!std::isfinite(s.mean_w) || std::abs(s.mean_w) > 1e6f)
+						return false;
+			return true;
+		};
+		if (magic != MAGIC || !valid(home) || !valid(pv))
+			*this = {};
+	}
+};
+
+/**
+ * @brief Weekday x hour profile of the home consumption and the pv power.
+ * Each hourly history bucket is folded into its slot with a running mean over the last WINDOW weeks, so
+ * the profile follows seasonal changes and queries are a single array access.
+ */
+struct energy_profile {
+	static constexpr int WINDOW{6};		// weeks averaged per slot
+	static constexpr int STORE_HOUR{2};	// the profile is written to flash once a day after this hour (utc)
+
+	energy_profile_data data{};
+	mutex m{};
+
+	static energy_profile& Default() {
+		static energy_profile p{};
+		return p;
+	}
+	static constexpr int weekday(time_t epoch_s) { return (epoch_s / 86400 + 3) % 7; } // 1.1.1970 was a thursday
+	static constexpr int hour(time_t epoch_s) { return epoch_s / 3600 % 24; }
+
+	// checks for a new hourly history bucket and folds it into the profile, cheap if there is none
+	void update(std::span<const InverterGroup> inverter_groups);
+	// expected power for the hour containing epoch_s, nan if no data was collected for that hour yet
+	float home_w(time_t epoch_s) {
+		scoped_lock lock{m};
+		return value(data.home, epoch_s);
+	}
+	float pv_w(time_t epoch_s) {
+		scoped_lock lock{m};
+		return value(data.pv, epoch_s);
+	}
+
+	static float value(const energy_profile_data::week &w, time_t epoch_s) {
+		const energy_profile_data::slot &s = w[weekday(epoch_s)][hour(epoch_s)];
+		return s.samples ? s.mean_w: NAN;
+	}
+};
+
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <compare>
+#include <cstdint>
+#include <limits>
+
+/**
+ * @brief Signed Q19.12 fixed point number for power values in watt.
+ * Range is +-524 kW with a resolution of 1/4096 W. All arithmetic is done on integers and saturates,
+ * so results are bit exact on every platform. Conversions from and to float are single correctly
+ * rounded ieee operations and thus deterministic as well.
+ */
+struct fixed {
+	static constexpr int FRAC_BITS{12};
+	static constexpr int64_t ONE{int64_t(1) << FRAC_BITS};
+	int32_t raw{};
+
+	static constexpr fixed from_raw(int64_t r) {
+		fixed f;
+		f.raw = int32_t(std::clamp<int64_t>(r, std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max()));
+		return f;
+	}
+	constexpr fixed() = default;
+	constexpr fixed(int v): raw{from_raw(int64_t(v) * ONE).raw} {}
+	fixed(float v) {
+		v *= float(ONE);
+		if (!(v > -2147483648.f)) // also catches nan
+			raw = v < 0 ? std::numeric_limits<int32_t>::min(): 0;
+		else
+			raw = v < 2147483520.f ? int32_t(v + (v < 0 ? -.5f: .5f)): std::numeric_limits<int32_t>::max();
+	}
+	constexpr explicit operator float() const { return float(raw) / float(ONE); }
+
+	constexpr fixed operator-() const { return from_raw(-int64_t(raw)); }
+	constexpr fixed& operator+=(fixed o) { return *this = from_raw(int64_t(raw) + o.raw); }
+	constexpr fixed& operator-=(fixed o) { return *this = from_raw(int64_t(raw) - o.raw); }
+	constexpr fixed& operator*=(fixed o) { return *this = from_raw((int64_t(raw) * o.raw + ONE / 2) >> FRAC_BITS); }
+	constexpr fixed& operator/=(fixed o) {
+		if (o.raw == 0)
+			return *this = from_raw(raw < 0 ? std::numeric_limits<int64_t>::min(): std::numeric_limits<int64_t>::max());
+		return *this = from_raw((int64_t(raw) << FRAC_BITS) / o.raw);
+	}
+	friend constexpr fixed operator+(fixed a, fixed b) { return a += b; }
+	friend constexpr fixed operator-(fixed a, fixed b) { return a -= b; }
+	friend constexpr fixed operator*(fixed a, fixed b) { return a *= b; }
+	friend constexpr fixed operator/(fixed a, fixed b) { return a /= b; }
+	constexpr auto operator<=>(const fixed &o) const = default;
+};
+
+// found via adl in code templated on the number type, the float versions come from <cmath>
+constexpr fixed abs(fixed v) { return v.raw < 0 ? -v: v; }
+constexpr fixed floor(fixed v) { return fixed::from_raw(int64_t(v.raw) & ~(fixed::ONE - 1)); }
+constexpr fixed lerp(fixed a, fixed b, fixed t) { return a + t * (b - a); }
+
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+
+#include "ranges_util.h"
+#include "static_types.h"
+
+/**
+ * @brief Compressed time series in the style of facebooks gorilla.
+ * Timestamps are stored as delta of delta (mostly a single 0 bit for samples one bucket apart) and each float channel
+ * xor encoded against its previous value (only the changed bits in the middle are stored). The samples are stored
+ * in fixed size blocks whose first sample is xor encoded against 0, so each block can be decoded on its own and a range
+ * is found by a binary search over the block times. When the ring of blocks is full the oldest block is dropped.
+ * Sample is any type with a uint32_t time member, a static CHANNELS count and channel(c)/set_channel(c, v) accessors
+ * for its float values (t::data_time, t::data_bucket). With BLOCKS 0 the blocks are handed in at runtime by assign().
+ */
+namespace gorilla {
+
+struct block {
+	static constexpr int BYTES{256};
+	static constexpr int HEADER_BYTES{12};
+	uint32_t start_time;	// times of the first and last sample for the binary search
+	uint32_t end_time;
+	uint16_t count;
+	uint16_t bits;		// used bits of the payload
+	std::array<uint8_t, BYTES - HEADER_BYTES> payload;
+};
+static_assert(sizeof(block) == block::BYTES);
+
+struct bit_writer {
+	uint8_t *bytes;
+	uint32_t pos;
+	void write(uint32_t v, int n) { // msb first, n <= 32, the payload has to be zeroed
+		while (n) {
+			int free = 8 - (pos & 7);
+			int k = std::min(n, free);
+			uint32_t chunk = (v >> (n - k)) & ((1u << k) - 1);
+			bytes[pos >> 3] |= uint8_t(chunk << (free - k));
+			pos += k;
+			n -= k;
+		}
+	}
+};
+// reads past end return 0 and set pos behind end, so torn blocks of a concurrent write can not be read out of bounds
+struct bit_reader {
+	const uint8_t *bytes;
+	uint32_t pos;
+	uint32_t end;
+	bool overrun() const { return pos > end; }
+	void fail() { pos = end + 1; }
+	uint32_t read(int n) {
+		if (pos + n > end) {
+			fail();
+			return 0;
+		}
+		uint32_t v{};
+		while (n) {
+			int avail = 8 - (pos & 7);
+			int k = std::min(n, avail);
+			v = (v << k) | ((bytes[pos >> 3] >> (avail - k)) & ((1u << k) - 1));
+			pos += k;
+			n -= k;
+		}
+		return v;
+	}
+};
+
+struct channel_state {
+	static constexpr uint8_t NO_WINDOW{0xff};
+	uint32_t value_bits;
+	uint8_t leading;
+	uint8_t trailing;
+};
+// state to continue the last block, the decoder rebuilds the same state while reading
+template<int CHANNELS>
+struct codec_state {
+	uint32_t time;
+	int32_t delta;
+	std::array<channel_state, CHANNELS> channels;
+	void start(uint32_t t) {
+		time = t;
+		delta = 0;
+		channels.fill({.value_bits = 0, .leading = channel_state::NO_WINDOW, .trailing = 0});
+	}
+	// the window of the first sample (xor against 0) is too wide for the following ones
+	void reset_windows() {
+		for (channel_state &c: channels)
+			c.leading = channel_state::NO_WINDOW;
+	}
+};
+
+// delta of delta ranges: '0', '10'+7 bits, '110'+9 bits, '1110'+12 bits, '1111'+32 bits
+constexpr int time_bits(int32_t dod) {
+	if (dod == 0) return 1;
+	if (dod >= -63 && dod <= 64) return 2 + 7;
+	if (dod >= -255 && dod <= 256) return 3 + 9;
+	if (dod >= -2047 && dod <= 2048) return 4 + 12;
+	return 4 + 32;
+}
+inline void write_time(bit_writer &w, int32_t dod) {
+	if (dod == 0) w.write(0b0, 1);
+	else if (dod >= -63 && dod <= 64) { w.write(0b10, 2); w.write(dod + 63, 7); }
+	else if (dod >= -255 && dod <= 256) { w.write(0b110, 3); w.write(dod + 255, 9); }
+	else if (dod >= -2047 && dod <= 2048) { w.write(0b1110, 4); w.write(dod + 2047, 12); }
+	else { w.write(0b1111, 4); w.write(uint32_t(dod), 32); }
+}
+inline int32_t read_time(bit_reader &r) {
+	if (!r.read(1)) return 0;
+	if (!r.read(1)) return int32_t(r.read(7)) - 63;
+	if (!r.read(1)) return int32_t(r.read(9)) - 255;
+	if (!r.read(1)) return int32_t(r.read(12)) - 2047;
+	return int32_t(r.read(32));
+}
+
+// value xor ranges: '0' unchanged, '10'+bits in the previous window, '11'+5 bits leading+5 bits length+bits
+struct value_code {
+	uint32_t x;
+	int leading;
+	int trailing;
+	bool in_window;
+	int bits;
+};
+inline value_code value_encoding(const channel_state &s, float value) {
+	uint32_t x = std::bit_cast<uint32_t>(value) ^ s.value_bits;
+	int leading = x ? std::min(std::countl_zero(x), 31): 0;
+	int trailing = x ? std::countr_zero(x): 0;
+	bool in_window = x && s.leading != channel_state::NO_WINDOW && leading >= s.leading && trailing >= s.trailing;
+	int bits = !x ? 1: in_window ? 2 + 32 - s.leading - s.trailing: 2 + 5 + 5 + 32 - leading - trailing;
+	return {x, leading, trailing, in_window, bits};
+}
+inline void write_value(bit_writer &w, channel_state &s, const value_code &c) {
+	if (!c.x) {
+		w.write(0b0, 1);
+		return;
+	}
+	if (c.in_window) {
+		w.write(0b10, 2);
+		w.write(c.x >> s.trailing, 32 - s.leading - s.trailing);
+	} else {
+		w.write(0b11, 2);
+		w.write(c.leading, 5);
+		w.write(32 - c.leading - c.trailing - 1, 5);
+		w.write(c.x >> c.trailing, 32 - c.leading - c.trailing);
+		s.leading = c.leading;
+		s.trailing = c.trailing;
+	}
+	s.value_bits ^= c.x;
+}
+inline float read_value(bit_reader &r, channel_state &s) {
+	if (r.read(1)) {
+		int leading{s.leading};
+		int len{32 - s.leading - s.trailing};
+		if (r.read(1)) {
+			leading = r.read(5);
+			len = r.read(5) + 1;
+		}
+		// a torn block of a concurrent write can give a window outside of the 32 bits or none at all
+		if (leading == channel_state::NO_WINDOW || leading + len > 32) {
+			r.fail();
+			return std::bit_cast<float>(s.value_bits);
+		}
+		s.leading = leading;
+		s.trailing = 32 - leading - len;
+		s.value_bits ^= r.read(len) << s.trailing;
+	}
+	return std::bit_cast<float>(s.value_bits);
+}
+
+// appends a sample to b, returns false if it does not fit anymore
+template<typename Sample>
+bool append(block &b, codec_state<Sample::CHANNELS> &s, const Sample &v) {
+	int32_t delta = int32_t(v.time - s.time);
+	int32_t dod = delta - s.delta;
+	std::array<value_code, Sample::CHANNELS> codes;
+	int bits = b.count ? time_bits(dod): 0; // the first time is in the header
+	for (int c: range(Sample::CHANNELS)) {
+		codes[c] = value_encoding(s.channels[c], v.channel(c));
+		bits += codes[c].bits;
+	}
+	if (b.count == UINT16_MAX || b.bits + bits > int(b.payload.size() * 8))
+		return false;
+
+	bit_writer w{b.payload.data(), b.bits};
+	if (b.count) {
+		write_time(w, dod);
+		s.delta = delta;
+	}
+	for (int c: range(Sample::CHANNELS))
+		write_value(w, s.channels[c], codes[c]);
+	if (!b.count)
+		s.reset_windows();
+	b.bits = w.pos;
+	b.end_time = v.time;
+	++b.count;
+	s.time = v.time;
+	return true;
+}
+
+template<typename Sample>
+struct block_decoder {
+	const block &b;
+	bit_reader r{b.payload.data(), 0, std::min<uint32_t>(b.bits, sizeof(b.payload) * 8)};
+	codec_state<Sample::CHANNELS> s{};
+	int i{};
+	bool next(Sample &out) {
+		if (i >= b.count || r.overrun())
+			return false;
+		if (i++ == 0) {
+			s.start(b.start_time);
+		} else {
+			s.delta = int32_t(uint32_t(s.delta) + uint32_t(read_time(r))); // wraps instead of overflowing on a torn block
+			s.time += s.delta;
+		}
+		out.time = s.time;
+		for (int c: range(Sample::CHANNELS))
+			out.set_channel(c, read_value(r, s.channels[c]));
+		if (i == 1)
+			s.reset_windows();
+		return !r.overrun(); // the last sample of a torn block is not complete
+	}
+};
+
+template<typename Sample, int BLOCKS>
+struct series {
+	// worst case of a sample: 36 time bits and 44 bits per channel
+	static_assert(36 + 44 * Sample::CHANNELS <= int(sizeof(block::payload) * 8));
+	std::conditional_t<BLOCKS == 0, span_ring_buffer<block>, static_ring_buffer<block, BLOCKS>> blocks{};
+	codec_state<Sample::CHANNELS> state{};
+	int samples{};
+	Sample newest{};
+
+	void assign(std::span<block> storage) requires (BLOCKS == 0) { blocks = {.storage = storage}; samples = 0; }
+	void clear() { blocks.clear(); samples = 0; }
+	int size() const { return samples; }
+	bool empty() const { return samples == 0; }
+	const Sample& back() const { return newest; }
+	void push(const Sample &v) {
+		if (!blocks.capacity())
+			return;
+		if (blocks.empty() || !append(blocks[-1], state, v)) {
+			if (blocks.size() == blocks.capacity())
+				samples -= blocks[0].count;
+			block *b = blocks.push();
+			*b = block{.start_time = v.time, .end_time = v.time, .count = 0, .bits = 0, .payload = {}};
+			state.start(v.time);
+			append(*b, state, v);
+		}
+		++samples;
+		newest = v;
+	}
+	uint32_t front_time() const { return blocks.empty() ? UINT32_MAX: blocks[0].start_time; }
+	// calls f with the samples in [t_begin, t_end) oldest first until f returns false
+	template<typename F>
+	void visit(uint32_t t_begin, uint32_t t_end, F &&f) const {
+		// first block which ends at or after t_begin
+		int lo = 0, hi = blocks.size();
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (blocks[mid].end_time < t_begin) lo = mid + 1;
+			else hi = mid;
+		}
+		for (int bi = lo; bi < blocks.size(); ++bi) {
+			if (blocks[bi].start_time >= t_end)
+				return;
+			block_decoder<Sample> d{blocks[bi]};
+			for (Sample v{}; d.next(v);) {
+				if (v.time >= t_end)
+					return;
+				if (v.time >= t_begin && !f(v))
+					return;
+			}
+		}
+	}
+	// decodes the samples in [t_begin, t_end) oldest first into out, returns the amount of samples written
+	int read(uint32_t t_begin, uint32_t t_end, std::span<Sample> out) const {
+		int n{};
+		if (out.size())
+			visit(t_begin, t_end, [&](const Sample &v) { out[n++] = v; return n < int(out.size()); });
+		return n;
+	}
+	// decodes the out.size() samples before the skip newest samples oldest first, returns the amount written
+	int read_last(int skip, std::span<Sample> out) const {
+		int first = std::max(samples - skip - int(out.size()), 0); // index of the first wanted sample
+		int last = samples - skip;
+		if (last <= first)
+			return 0;
+		int bi = blocks.size(), block_first = samples;
+		while (bi > 0 && block_first > first)
+			block_first -= blocks[--bi].count;
+		int n{};
+		for (int idx = block_first; bi < blocks.size() && idx < last; ++bi) {
+			block_decoder<Sample> d{blocks[bi]};
+			for (Sample v{}; idx < last && d.next(v); ++idx)
+				if (idx >= first)
+					out[n++] = v;
+		}
+		return n;
+	}
+};
+
+}
@@ -1,65 +1,342 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <span>
+#include <string_view>
+#include <utility>
+
 #include "AppConfig.h"
 #include "static_types.h"
 #include "psram.h"
 #include "mutex.h"
+#include "gorilla.h"
+#include "dense.h"
 
 namespace t {
-struct data_time {float data; uint32_t time;}; // note that time is alwasys in seconds
-using per_second = static_ring_buffer<data_time, 3600 * 2>; // last 2 hours are available as per_second
-using per_minute = static_ring_buffer<data_time, 60 * 24 * 7>; // last 2 days are available as per minute
-using per_hour = static_ring_buffer<data_time, 24 * 366 * 2>; // last 4 years are available as per hour;
+struct data_time {
+	static constexpr int CHANNELS{1};
+	float data;
+	uint32_t time; // note that time is alwasys in seconds
+	float channel(int) const { return data; }
+	void set_channel(int, float v) { data = v; }
+};
+// aggregate of a level of the resolution pyramid, min and max keep the peaks which vanish in the mean
+struct data_bucket {
+	static constexpr int CHANNELS{4};
+	float data;	// mean
+	float min;
+	float max;
+	uint32_t time;	// start of the bucket
+	uint16_t n;	// aggregated samples (seconds of 10 s and a minute, minutes of 15 minutes and an hour, hours of a day)
+	float channel(int c) const { return c == 0 ? data: c == 1 ? min: c == 2 ? max: n; }
+	void set_channel(int c, float v) {
+		switch (c) {
+			case 0: data = v; break;
+			case 1: min = v; break;
+			case 2: max = v; break;
+			default: n = uint16_t(v); break;
+		}
+	}
+};
+// Resolution pyramid of second, 10 s, minute, 15 minute, hour and day buckets, each level is aggregated at write time
+// so a plot of any span reads a few hundred buckets of the matching level. All levels are compressed
+// (see tools/gorilla_bench), their blocks are taken from the history arena when a series is registered, sized from
+// the retention of each level (see history_data::series_config).
+// The dense layout in the same blocks holds a quarter to a third of the time span of the gorilla compression
+#if HISTORY_DENSE
+using per_second = dense::series<data_time, 0, 1>;
+using per_ten_seconds = dense::series<data_bucket, 0, 10>;
+using per_minute = dense::series<data_bucket, 0, 60>;
+using per_quarter_hour = dense::series<data_bucket, 0, 900>;
+using per_hour = dense::series<data_bucket, 0, 3600>;
+using per_day = dense::series<data_bucket, 0, 86400>;
+#else
+using per_second = gorilla::series<data_time, 0>;
+using per_ten_seconds = gorilla::series<data_bucket, 0>;
+using per_minute = gorilla::series<data_bucket, 0>;
+using per_quarter_hour = gorilla::series<data_bucket, 0>;
+using per_hour = gorilla::series<data_bucket, 0>;
+using per_day = gorilla::series<data_bucket, 0>;
+#endif
 
 template<typename T>
 struct locked_data {
 	T& data;
 	scoped_lock lock;
+	std::atomic<uint32_t> *seq{};	// odd while the data is locked for writing
+	~locked_data() { if (seq) seq->store(seq->load(std::memory_order_relaxed) + 1, std::memory_order_release); }
 };
+/**
+ * @brief History data with a single writer (the modbus task) and lock free readers.
+ * The writer takes the lock via access() and makes the sequence odd while it holds it, readers run on the data
+ * without the lock and retry if the sequence was odd or changed meanwhile (same scheme as seqlock.h, but without
+ * copying the whole data). So drawing or serving the history never delays the control loop, the counters show
+ * whether the writer had to wait for the lock and how often readers collided with a write.
+ */
 template<typename T>
 struct thread_safe {
+	static constexpr int MAX_READ_TRIES{16};
 	T& data;
 	mutex m{};
-	locked_data<T> access() { return locked_data<T>{data, scoped_lock{m}}; }
+	std::atomic<uint32_t> seq{};
+	std::atomic<uint32_t> lock_waits{};	// access() found the lock taken
+	std::atomic<uint32_t> read_retries{};
+	std::atomic<uint32_t> read_failures{};	// reads which gave up after MAX_READ_TRIES
+	// takes the lock for writing, history readers use read() instead
+	locked_data<T> access() {
+		if (uxSemaphoreGetCount(m.handle) == 0)
+			lock_waits.fetch_add(1, std::memory_order_relaxed);
+		return locked_data<T>{data, scoped_lock{m}, begin_write()};
+	}
+	// calls f(const T&) until it ran without a concurrent write, returns false if that did not succeed.
+	// f may see partially written data, its results are only to be used if read returns true
+	template<typename F>
+	bool read(F &&f) {
+		for (int i = 0; i < MAX_READ_TRIES; ++i) {
+			uint32_t start = seq.load(std::memory_order_acquire);
+			if (!(start & 1)) {
+				f(std::as_const(data));
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (seq.load(std::memory_order_relaxed) == start)
+					return true;
+			}
+			read_retries.fetch_add(1, std::memory_order_relaxed);
+		}
+		read_failures.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+private:
+	std::atomic<uint32_t>* begin_write() {
+		seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		return &seq;
+	}
 };
 
+// running aggregate of the bucket that is currently filled, start is the bucket start time in seconds
+struct accumulator {
+	float sum;
+	float min;
+	float max;
+	uint32_t n;
+	uint32_t start;
+	void add(float v, float lo, float hi) {
+		min = n ? std::min(min, lo): lo;
+		max = n ? std::max(max, hi): hi;
+		sum += v;
+		++n;
+	}
+	data_bucket bucket() const { return {.data = mean(), .min = min, .max = max, .time = start, .n = uint16_t(n)}; }
+	void add(float v) { add(v, v, v); }
+	float mean() const { return sum / n; }
+	void reset(uint32_t bucket_start) { *this = {.start = bucket_start}; }
+};
 struct device_data {
 	t::per_second per_second;
+	t::per_ten_seconds per_ten_seconds;
 	t::per_minute per_minute;
+	t::per_quarter_hour per_quarter_hour;
 	t::per_hour per_hour;
+	t::per_day per_day;
+	accumulator ten_seconds;	// fed with the seconds, added to per_ten_seconds when the next 10 s start
+	accumulator minute;		// the running minute is added to per_minute when the next minute starts
+	accumulator quarter_hour;	// fed with the minute means, added to per_quarter_hour when the next 15 minutes start
+	accumulator hour;		// fed with the minute means, added to per_hour when the next hour starts
+	accumulator day;		// fed with the hour means, added to per_day when the next day starts
+	void clear() { // without a temporary of several 100kB
+		per_second.clear();
+		per_ten_seconds.clear();
+		per_minute.clear();
+		per_quarter_hour.clear();
+		per_hour.clear();
+		per_day.clear();
+		ten_seconds = {};
+		minute = {};
+		quarter_hour = {};
+		hour = {};
+		day = {};
+	}
 };
-struct id_data { 
-	int device_id;
-	t::device_data data;
+/**
+ * @brief Device id to slot of a keyed series, kept in sram so finding the slot of a sample does not touch psram.
+ * Device ids are increasing and never reused, they are hashed into a linear probing table with at most half of the
+ * buckets used. Only changed by the writer while it holds the lock of the histories, readers use it within read().
+ */
+template<size_t SLOTS>
+struct slot_index {
+	static constexpr uint32_t BUCKETS{std::bit_ceil(uint32_t(2 * SLOTS))};
+	struct bucket {
+		int device_id{-1};
+		int slot{-1};
+	};
+	std::array<bucket, BUCKETS> buckets{};
+	std::array<int, SLOTS> slot_ids{};	// device id of each slot, -1 if free
+
+	slot_index() { clear(); }
+	void clear() { buckets.fill({}); slot_ids.fill(-1); }
+	static uint32_t hash(int device_id) { return uint32_t(device_id) & (BUCKETS - 1); }
+	// returns -1 if the device has no slot, bounded for readers which see a table in the middle of a change
+	int find(int device_id) const {
+		for (uint32_t i = 0, b = hash(device_id); i < BUCKETS && buckets[b].device_id != -1; ++i, b = (b + 1) & (BUCKETS - 1))
+			if (buckets[b].device_id == device_id)
+				return buckets[b].slot;
+		return -1;
+	}
+	// returns the slot for a device which has none yet, -1 if the first slots slots are used
+	int insert(int device_id, int slots = SLOTS) {
+		int slot = std::find(slot_ids.begin(), slot_ids.begin() + std::min(slots, int(SLOTS)), -1) - slot_ids.begin();
+		if (slot == std::min(slots, int(SLOTS)))
+			return -1;
+		slot_ids[slot] = device_id;
+		uint32_t b = hash(device_id);
+		while (buckets[b].device_id != -1)
+			b = (b + 1) & (BUCKETS - 1);
+		buckets[b] = {device_id, slot};
+		return slot;
+	}
+	void remove(int device_id) {
+		uint32_t b = hash(device_id);
+		while (buckets[b].device_id != device_id) {
+			if (buckets[b].device_id == -1)
+				return;
+			b = (b + 1) & (BUCKETS - 1);
+		}
+		slot_ids[buckets[b].slot] = -1;
+		// backward shift of the following entries, so no lookup stops early at the freed bucket
+		for (uint32_t next = (b + 1) & (BUCKETS - 1); buckets[next].device_id != -1; next = (next + 1) & (BUCKETS - 1)) {
+			uint32_t home = hash(buckets[next].device_id);
+			if (((next - home) & (BUCKETS - 1)) >= ((next - b) & (BUCKETS - 1))) {
+				buckets[b] = buckets[next];
+				b = next;
+			}
+		}
+		buckets[b] = {};
+	}
 };
 
 }
 
+namespace history_data {
+enum struct resolution: uint8_t { SECOND, TEN_SECONDS, MINUTE, QUARTER_HOUR, HOUR, DAY, COUNT };
+constexpr int LEVELS{int(resolution::COUNT)};
+constexpr std::array<uint32_t, LEVELS> RESOLUTION_S{1, 10, 60, 900, 3600, 86400};
+// nominal samples per block of the gorilla compression for whole watt values (tools/gorilla_bench), noisy
+// fractional values and the dense layout hold less
+constexpr std::array<uint32_t, LEVELS> SAMPLES_PER_BLOCK{224, 40, 40, 40, 40, 40};
+// retention of the device series (meter, inverter, soc): 14 hours of seconds, 16 hours of 10 s, 6 days of minute,
+// 50 days of 15 minute, 500 days of hour and 9 years of day buckets, ~280 kB per device. Weeks of seconds (~680 kB per
+// device and week) or years of minutes (~2.8 MB per device and year) do not fit the psram for 25 device slots
+constexpr std::array<uint32_t, LEVELS> DEVICE_RETENTION_S{14 * 3600, 16 * 3600, 6 * 86400, 50 * 86400, 500 * 86400, 9 * 365 * 86400};
+constexpr int MAX_SERIES_SLOTS{MAX_HISTORY_INVERTERS * 2};
+
+// blocks of a level which hold retention_s nominally, one more as the oldest block is dropped when a new one starts
+constexpr int level_blocks(uint32_t retention_s, resolution res) {
+	uint32_t samples = retention_s / RESOLUTION_S[int(res)];
+	return samples ? (samples + SAMPLES_PER_BLOCK[int(res)] - 1) / SAMPLES_PER_BLOCK[int(res)] + 1: 0;
+}
+
+struct series_config {
+	std::string_view name;		// used by the webserver, has to outlive the registry
+	std::string_view unit;
+	std::array<uint32_t, LEVELS> retention_s;	// time span each level holds, 0 leaves the level out
+	int slots{1};			// devices (keyed) or fixed sub series like phases
+	bool keyed{};			// slots are assigned to device ids on their first write, otherwise the id is the slot
+};
+struct series_id {
+	enum builtin: int { METER, INVERTER, SOC };	// registered first by init(), in this order
+	int series;	// handle returned by register_series()
+	int id;		// device id for keyed series, slot otherwise
+};
+}
+
+namespace t {
+/**
+ * @brief A registered series, the history of its slots lies in the history arena (psram), the rest in sram.
+ * The writer takes the lock via history.access(), readers use history.read() (see history_data::read_series).
+ */
+struct registered_series {
+	history_data::series_config config{};
+	std::span<device_data> slots{};
+	slot_index<history_data::MAX_SERIES_SLOTS> index{};	// only used by keyed series
+	uint32_t bytes{};					// arena bytes of the series
+	int unslotted_id{};					// first device without a free slot (MAX_HISTORY_INVERTERS), 0 if none
+	thread_safe<std::span<device_data>> history{slots};
+};
+}
+
 namespace g {
 /*
- * @brief Global history data, all located in psram
+ * @brief Registry of the history series with a single arena in psram from which the registrations take their memory.
  *
- * to accesss the data (both reading or writing) simply choose your field and do eg.
- * int16_t value = meter_data.access().data.daily[-1][-1]; // this is essentially the last written value
+ * The modbus task writes via hd::write(), all other tasks read via hd::read_series(series, [&](const t::device_data *d) {
+ * if (d) value = d->per_second.back().data; }); // the last written value
  */
-// storage
-inline t::device_data meter_data_psram PSRAM;
-inline std::array<t::id_data, MAX_INVERTERS * 2> inverter_data_psram PSRAM;
-inline std::array<t::id_data, MAX_INVERTERS> soc_data_psram PSRAM;
-inline static_vector<t::device_data, 4> any_data_psram PSRAM;
-// access
-inline t::thread_safe<t::device_data> meter_data{meter_data_psram};
-inline t::thread_safe<std::array<t::id_data, MAX_INVERTERS * 2>> inverter_data{inverter_data_psram};
-inline t::thread_safe<std::array<t::id_data, MAX_INVERTERS>> soc_data{soc_data_psram};
-inline t::thread_safe<static_vector<t::device_data, 4>> any_data{any_data_psram};
+alignas(8) inline std::array<uint8_t, HISTORY_ARENA_KB * 1024> history_arena PSRAM;
+inline uint32_t history_arena_used{};
+inline std::array<t::registered_series, MAX_HISTORY_SERIES> history_series{};	// in sram
+inline int history_series_count{};
 }
 
 namespace history_data {
+struct query_result {
+	resolution res;
+	int count;	// buckets written including the gap markers
+};
+
+// resets the registry and registers the device series
 void init();
-void write_meter_data(float value, time_t epoch_hours);
-void write_inverter_data(int id, float value, time_t epoch_hours);
-void write_soc_data(int id, float value, time_t epoch_hours);
-void write_any_data(int i, float value, time_t epoch_hours);
+// registers a series at startup (before the tasks run) and takes the blocks of its levels from the arena.
+// Returns the handle for series_id::series, -1 if the registry or the arena is full
+int register_series(const series_config &config);
+// handle of the series with the name, -1 if there is none
+int find_series(std::string_view name);
+// slot of id in the series, -1 if it has none. Readers call it within history.read()
+int slot_of(const t::registered_series &s, int id);
+// calls f(const t::device_data*) on the series without lock, nullptr if the series has no history for the id.
+// Returns false if the series is not registered or was written during every try
+template<typename F>
+bool read_series(series_id series, F &&f) {
+	if (series.series < 0 || series.series >= g::history_series_count)
+		return false;
+	t::registered_series &s = g::history_series[series.series];
+	return s.history.read([&](const std::span<t::device_data> &slots) {
+		int slot = slot_of(s, series.id);
+		f(slot >= 0 && slot < int(slots.size()) ? &slots[slot]: nullptr);
+	});
+}
+// writes the device ids which have a slot in the keyed series to out, returns the amount
+int device_ids(int series, std::span<int> out);
+// Writes the buckets in [t_begin, t_end) oldest first to out, per second samples become buckets with n = 1.
+// Uses the finest resolution with at most max_buckets (0: out.size()) buckets in the range which still reaches back
+// to t_begin (or the finest fitting one if none does). Missing buckets are marked by a single bucket with n = 0 and
+// NAN values at the start of the gap. The series is read without lock, count is 0 if it was written during every try
+query_result query(series_id series, uint32_t t_begin, uint32_t t_end, std::span<t::data_bucket> out, uint32_t max_buckets = 0);
+// same as query on a series which the caller already reads consistently (within read() or in the writer)
+query_result query_data(const t::device_data &locked_data, uint32_t t_begin, uint32_t t_end, std::span<t::data_bucket> out, uint32_t max_buckets = 0);
+// buckets of a single resolution in [t_begin, t_end) oldest first without gap markers, -1 if the series has no
+// history or was written during every try
+int read(series_id series, resolution res, uint32_t t_begin, uint32_t t_end, std::span<t::data_bucket> out);
+// puts older hours (eg. from the flash log) in front of the hour that is currently aggregated, hours which are not
+// newer than the newest stored hour are skipped. The days are rebuilt from the restored hours.
+// Returns the amount of restored hours, -1 if the series has no history
+int restore_hours(series_id series, std::span<const t::data_bucket> hours);
+// true if the series has a history for the device (created with its first sample), does not take the lock
+bool has_history(series_id series);
+struct contention_stats {
+	std::string_view name;
+	uint32_t lock_waits;
+	uint32_t read_retries;
+	uint32_t read_failures;
+};
+// collisions of the writer and the readers of each registered series
+static_vector<contention_stats, MAX_HISTORY_SERIES> contention();
+// frees the slots of all devices which are not in device_ids, called when the device ids of the inverters changed
+void retain(int series, std::span<const int> device_ids);
+// adds a sample, a keyed series takes a free slot for a new device id and drops the sample if there is none
+void write(series_id series, float value, time_t epoch_s);
 }
 namespace hd = history_data;
-
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "AppConfig.h"
+#include "emm_structs.h"
+#include "history_data.h"
+#include "persistent_storage.h"
+
+/**
+ * @brief Log of the hour buckets in flash, so the hour history survives reboots and firmware updates.
+ * The log is a ring of flash sectors between the firmware and the persistent storage. The sector with the highest
+ * sequence is the head, when it is full the next sector is erased and overwritten, so all sectors wear evenly (each
+ * is erased once per round of the ring, which takes years). The head sector is collected in sram and each page is
+ * programmed as soon as it is full, a reboot loses at most the hours of the last page and the log continues in a
+ * new sector.
+ * Device ids change with every discovery and removing an inverter moves another one to its index, so the records are
+ * keyed by the modbus address of the device and the role of the series.
+ * The hours of a series are restored into the psram history as soon as its device is known (after boot and after a
+ * reconnect), all later hours of the series are appended to the log.
+ * Only used by the history log task (lowest priority), erasing and programming pauses the other core shortly.
+ */
+struct history_log {
+	static constexpr uint32_t MAGIC{0x324f4c48};	// changes with the record layout, logs of older layouts are ignored
+	static constexpr uint32_t END_OFFSET{FLASH_SIZE - 1024 * 1024};	// room for the persistent storage which grows down from the flash end
+	static constexpr uint32_t BYTES{8 * 1024 * 1024};		// ~160 bytes per hour for meter and an inverter with pv and battery
+	static constexpr uint32_t BEGIN_OFFSET{END_OFFSET - BYTES};
+	static constexpr int SECTORS{BYTES / FLASH_SECTOR_SIZE};
+	static_assert(sizeof(persistent_storage_layout) <= FLASH_SIZE - END_OFFSET);
+	static_assert(BEGIN_OFFSET >= 4 * 1024 * 1024, "the log has to be behind the FLASH region of memmap_mp_rp2350_psram.ld");
+
+	enum role: uint8_t { METER, INVERTER, PV, BATTERY, SOC };
+	static constexpr int ROLES{4};					// series per configured inverter
+	static constexpr int SERIES{1 + MAX_INVERTERS * ROLES};	// meter and the roles of each configured inverter
+	static constexpr int series_index(int inverter, role r) { return 1 + inverter * ROLES + r - INVERTER; }
+	struct key {
+		ModbusTcpAddr addr;
+		role r;
+		bool operator==(const key &o) const { return addr == o.addr && r == o.r; }
+	};
+
+	struct sector_header {
+		uint32_t magic;
+		uint32_t sequence;	// increases with each started sector
+		uint32_t reserved[6];	// fills the header to the size of a record
+	};
+	struct record {
+		uint32_t time;		// UINT32_MAX behind the last record of a sector (erased flash)
+		float data;
+		float min;
+		float max;
+		uint16_t n;
+		role r;
+		uint8_t modbus_id;
+		uint32_t ip;
+		uint16_t port;
+		uint16_t reserved;
+		uint32_t check;		// torn records of a power loss while programming are skipped
+		key series() const { return {.addr = {.ip = ip, .port = port, .modbus_id = modbus_id}, .r = r}; }
+		uint32_t checksum() const;
+	};
+	static constexpr int RECORDS{(FLASH_SECTOR_SIZE - sizeof(sector_header)) / sizeof(record)};
+	struct sector {
+		sector_header header;
+		std::array<record, RECORDS> records;
+	};
+	static_assert(sizeof(sector) == FLASH_SECTOR_SIZE);
+
+	bool valid{};			// false if the firmware reaches into the log region
+	int head{};
+	uint32_t sequence{};
+	bool head_in_buffer{};		// the head sector was started since boot and is in buffer
+	int records{};			// records in the head sector
+	int programmed_pages{};		// pages of the head sector which are in flash
+	sector buffer{};
+	std::array<int, SERIES> restored_ids{};		// device id the series was restored for
+	std::array<key, SERIES> restored_keys{};	// device address the series was restored for
+	std::array<uint32_t, SERIES> logged_time{};	// newest hour of the series in the log
+	std::atomic<uint32_t> erased_sectors{};		// since boot
+	std::atomic<uint32_t> appended_records{};
+	std::atomic<uint32_t> restored_hours{};
+	std::atomic<uint32_t> flash_errors{};
+
+	static history_log& Default() {
+		static history_log l{};
+		return l;
+	}
+	// finds the head of the log, called once at startup before the history log task runs
+	void init();
+	// restores the hours of newly known devices and appends the new hours of all series, called periodically
+	void update();
+
+private:
+	const sector& flash_sector(int i) const;
+	void restore(std::span<const hd::series_id> ids, std::span<const key> keys);
+	void append(int series, const key &k, const t::data_bucket &hour);
+	bool start_sector();
+	void program_full_pages();
+};
+
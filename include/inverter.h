@@ -1,24 +1,32 @@
 #pragma once
 
+#include <atomic>
 #include <span>
 
 #include "AppConfig.h"
 #include "emm_structs.h"
+#include "seqlock.h"
+#include "soc_estimator.h"
 
 // used to retrieve and set power information for all inverters
 struct inverter_infos {
     // general inverter information
     static_vector<ModbusTcpAddr, MAX_INVERTERS> *configured_inverters{}; // is set by the first call to initiate_discover_inverters
-    static_vector<static_string<MAX_INVERTERS>, MAX_INVERTERS> connected_names{}; // if empty the inverter is not configured
+    static_vector<static_string<32>, MAX_INVERTERS> connected_names{}; // if empty the inverter is not configured
 
     static_vector<InverterGroup, MAX_INVERTERS> read_power;    // reported current power values
     static_vector<ControlPowerInfo, MAX_INVERTERS> control_infos;   // except soc of course, which is also a read quantity
+    static_vector<soc_estimator, MAX_INVERTERS> soc_estimators;     // keep bat_soc up to date between the storage reads
+    std::array<std::atomic<float>, MAX_INVERTERS> storage_soc{};     // soc read by the tcp callback, applied to the estimator in wait_all, -1 if none
+    std::atomic<uint32_t> device_generation{};  // incremented whenever a device id in read_power is assigned or dropped
 
     // only does discovery of new inverters and checks for sunspec conformity. Inverters getting lost are handled in
     // retrieve_infos
     void initiate_discover_inverters(static_vector<ModbusTcpAddr, MAX_INVERTERS> *ivs);
     void initiate_retrieve_infos_all();
     void initiate_send_power_requests_all();
+    // sends requested_power to a single inverter, used by auto_tune while the emm requests are not sent
+    void initiate_send_power_request(int i, float requested_power);
     // can be used to wait for initiated requests for both, retrieving and sending
     void wait_all(uint32_t timeout_ms);
 };
@@ -28,5 +36,7 @@ inline inverter_infos& inverters() {
     static inverter_infos i{};
     return i;
 }
+// limits and priorities of the last control cycle for the other tasks (what if), written by the modbus task
+inline seqlock<static_vector<ControlPowerInfo, MAX_INVERTERS>> control_snapshot{};
 }
 
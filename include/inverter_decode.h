@@ -0,0 +1,51 @@
+#pragma once
+
+#include "emm_structs.h"
+#include "inverter_sunspec.h"
+
+#include <array>
+
+// register mirror of an inverter, the sunspec models are found at runtime and can lie anywhere in it
+struct generic_halfs_registers {
+	constexpr static int OFFSET = 40000;
+	std::array<uint16_t, suns_sizeof(inverter_layout{}) + 100> data;
+};
+struct generic_modbus_layout {
+	generic_halfs_registers halfs_registers{};
+
+	template <typename T>
+	T* get_addr_as(int addr) {
+		if (addr < generic_halfs_registers::OFFSET || addr + suns_sizeof(T{}) > generic_halfs_registers::OFFSET + halfs_registers.data.size())
+			return {};
+		return (T*)(halfs_registers.data.data() + (addr - generic_halfs_registers::OFFSET));
+	};
+};
+
+/**
+ * @brief Conversion of the sunspec models the inverter poller reads each cycle into the powers of an inverter group.
+ * Used by the poller (inverter.cpp) and by tools/scale_bench, which measures it for many devices on the host.
+ */
+namespace inverter_decode {
+// ac power of the inverter, positive register values are exported
+inline void ac_power(const model_inverter &inverter, PowerInfo &ac) {
+	float w = modbus_swap_f(inverter.W);
+	ac.imp_w = w < 0 ? -w: 0;
+	ac.exp_w = w < 0 ? 0: w;
+}
+// pv power of the mppt modules, with a battery the last 2 modules are its charge and discharge power
+inline void dc_power(const model_mppt &mppt, bool has_battery, PowerInfo &pv, PowerInfo &battery) {
+	constexpr uint16_t mppt_hdr_size = suns_sizeof(model_mppt{}) - 4 * suns_sizeof(mppt_infos{});
+	static_assert(mppt_hdr_size == 10);
+	int mppt_count = modbus_swap(mppt.N);
+	const mppt_infos *mppts = (const mppt_infos*)(((const uint16_t*)&mppt) + mppt_hdr_size);
+	int bat_count = has_battery ? 2: 0;
+	int16_t pf = modbus_swap_i16(mppt.DCW_SF);
+	pv.exp_w = 0;
+	for (int j = 0; j < mppt_count - bat_count; ++j)
+		pv.exp_w += to_float(modbus_swap(mppts[j].module_DCW), pf);
+	if (bat_count > 0) {
+		battery.imp_w = to_float(modbus_swap(mppts[mppt_count - 2].module_DCW), pf); // charging
+		battery.exp_w = to_float(modbus_swap(mppts[mppt_count - 1].module_DCW), pf); // discharging
+	}
+}
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <span>
+
+#include "AppConfig.h"
+#include "emm_structs.h"
+#include "settings.h"
+
+// used to retrieve the power of and send setpoints to controllable loads (wallboxes, sg ready heat pumps)
+// in contrast to the inverters the loads are no sunspec devices, the registers are taken from the LoadConfig
+struct load_infos {
+	static constexpr float WALLBOX_VOLTAGE{230};
+	static constexpr float WALLBOX_MIN_CURRENT{6};	// iec 61851 minimum charge current
+	static constexpr uint32_t WALLBOX_SWITCH_S{5 * 60};	// min time between starting/stopping a charge
+	static constexpr uint32_t SG_READY_SWITCH_S{15 * 60};	// heat pumps should not cycle too often
+	static constexpr uint32_t SETPOINT_REFRESH_S{30};	// setpoints are rewritten regularly for devices with a watchdog
+
+	const static_vector<LoadConfig, MAX_LOADS> *configured_loads{}; // is set by the first call to initiate_discover_loads
+	static_vector<static_string<32>, MAX_LOADS> connected_names{}; // if empty the load is not connected
+	static_vector<LoadInfo, MAX_LOADS> loads{};
+
+	// connects to new loads and updates the load constraints from the config
+	void initiate_discover_loads(const static_vector<LoadConfig, MAX_LOADS> *ls);
+	// reads the power of all loads and writes the setpoint if it changed since the last write
+	void initiate_update_all();
+	void wait_all(uint32_t timeout_ms);
+};
+
+namespace g {
+inline load_infos& loads() {
+	static load_infos l{};
+	return l;
+}
+}
+
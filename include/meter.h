@@ -8,6 +8,8 @@ struct meter_info {
 	ModbusTcpAddr addr{};
 	static_string<32> name{NOT_CONNECTED}; // check for equality with NOT_CONNECTED and CONNECTING to get the current status
 	PowerInfo power_info{}; 	// used for external processing
+	float tot_imp_wh{};		// energy registers of the meter, 0 if it does not provide them
+	float tot_exp_wh{};
 
 	void initiate_discover(ModbusTcpAddr address);
 	void initiate_retrieve_infos();	      // will do nothing if meter not yet found, will do minimal read out except every 10th iteration when a full information readout is done
@@ -5,14 +5,14 @@
 
 #include "log_storage.h"
 
+// freertos mutex with priority inheritance: a low priority holder (eg. the history log task) is raised to the
+// priority of a waiting control task until it gives the lock
 struct mutex {
 	SemaphoreHandle_t handle{};
-	mutex(): handle{xSemaphoreCreateBinary()} { if (!handle || pdTRUE != xSemaphoreGive(handle)) LogError("Failed creating the semaphore");}
+	mutex(): handle{xSemaphoreCreateMutex()} { if (!handle) LogError("Failed creating the semaphore");}
 	~mutex() {
-		if (handle) {
-			xSemaphoreGive(handle); // safety give to unblock waiting thread
+		if (handle)
 			vSemaphoreDelete(handle);
-		}
 	}
 };
 
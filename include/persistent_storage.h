@@ -10,6 +10,8 @@
 #include "log_storage.h"
 #include "mutex.h"
 #include "settings.h"
+#include "energy_profile.h"
+#include "energy_counters.h"
 
 constexpr uint32_t FLASH_SIZE{PICO_FLASH_SIZE_BYTES};
 
@@ -18,6 +20,8 @@ constexpr uint32_t FLASH_SIZE{PICO_FLASH_SIZE_BYTES};
  * as the elements at the back of the layout always stay in the same position
  */
 struct persistent_storage_layout {
+	energy_counters_data persistent_counters;
+	energy_profile_data persistent_profile;
 	settings persistent_settings;
 	static_string<64> user_pwd;
 	static_string<64> hostname;
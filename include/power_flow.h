@@ -0,0 +1,66 @@
+#pragma once
+
+#include <span>
+
+#include "AppConfig.h"
+#include "emm_structs.h"
+#include "seqlock.h"
+
+/**
+ * @brief Attribution of who supplies whom, computed once per control cycle in the modbus task.
+ * All devices on the ac side (home, grid and the inverters) are nodes of the bus matrix, each node is either
+ * a source or a sink in a cycle. The power of each source is shared among the sinks proportionally to their demand.
+ * Pv and battery flows are only between the device and its own inverter and thus stored per inverter group.
+ * bus_wh() is the attributed energy of the cycle, the overview dots and the energy counters take it from there.
+ */
+constexpr int BUS_HOME{0};
+constexpr int BUS_GRID{1};
+constexpr int BUS_NODES{2 + MAX_INVERTERS};
+constexpr inline int bus_inverter(int group) { return 2 + group; }
+constexpr uint32_t FLOW_MAX_GAP_MS{10000}; // longer gaps between cycles (no wifi, modbus stalls) carry no energy
+
+struct DcFlow {
+	float pv_w;		// pv -> inverter
+	float discharge_w;	// battery -> inverter
+	float charge_w;		// inverter -> battery
+};
+
+struct PowerFlow {
+	uint32_t time_ms{};
+	float cycle_h{};	// duration of the cycle since the previous update, 0 after a gap
+	PowerInfo home{.device_id = HOME_ID};
+	PowerInfo meter{.device_id = METER_ID};
+	static_vector<InverterGroup, MAX_INVERTERS> inverter_groups{};
+	static_vector<DcFlow, MAX_INVERTERS> dc{};
+	std::array<float, BUS_NODES> source_w{};
+	std::array<float, BUS_NODES> sink_w{};
+	float sink_sum{};
+
+	// device id used for the bus node (the meter represents the grid)
+	int device_id(int node) const { return node == BUS_HOME ? HOME_ID: node == BUS_GRID ? METER_ID: inverter_groups[node - 2].inverter.device_id; }
+	int nodes() const { return 2 + inverter_groups.size(); }
+	// power from source to sink, the matrix is not stored as each source is shared proportionally among the sinks
+	float bus_w(int source, int sink) const { return source != sink && sink_sum > 0 ? source_w[source] * sink_w[sink] / sink_sum: 0; }
+	// energy from source to sink over the cycle
+	float bus_wh(int source, int sink) const { return bus_w(source, sink) * cycle_h; }
+};
+
+// device ids of the cycle for the tasks which only look up the histories of the devices (history log, what if)
+struct DeviceIds {
+	struct group {
+		int inverter, pv, battery;
+		ModbusTcpAddr addr;	// empty if the inverter was removed from the settings during the cycle
+	};
+	int meter{METER_ID};
+	ModbusTcpAddr meter_addr{};
+	static_vector<group, MAX_INVERTERS> groups{};
+};
+
+// updates flow with the new measurements, the home power is derived from meter and inverters
+void update_power_flow(PowerFlow &flow, const PowerInfo &meter, std::span<const InverterGroup> inverter_groups, uint32_t time_ms);
+void update_device_ids(DeviceIds &ids, const PowerFlow &flow, const ModbusTcpAddr &meter_addr, std::span<const ModbusTcpAddr> inverter_addrs);
+
+namespace g {
+inline seqlock<PowerFlow> power_flow{};
+inline seqlock<DeviceIds> device_ids{};
+}
@@ -29,7 +29,13 @@
 
 #pragma once
 
+#ifndef PSRAM // the host tools define it empty
 #define PSRAM __attribute__((section (".psram")))
+#endif
+
+#include <cstddef>
+
+constexpr size_t PSRAM_SIZE{8 * 1024 * 1024}; // PSRAM region of memmap_mp_rp2350_psram.ld
 
 extern size_t ps_size;
 extern size_t ps_heap_size;
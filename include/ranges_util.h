@@ -26,7 +26,7 @@ struct Void{};
 template<typename T, typename V = Void>
 struct find {T f; V v{};};
 template<typename S, typename T, typename V = Void>
-S::value_type* operator|(S &l, find<T, V> r) {
+auto operator|(S &l, find<T, V> r) -> decltype(&*l.begin()) { // const element pointer for const containers
 	if constexpr (!std::is_same_v<V, Void>) {
 		for (auto &e: l)
 			if (e.*(r.f) == r.v)
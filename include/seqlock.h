@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+
+/**
+ * @brief Single writer snapshot which readers can copy without taking a lock.
+ * The writer makes the sequence odd while it writes, readers retry if the sequence was odd or changed during their copy.
+ * Readers never block the writer, so it is safe to read from any task priority.
+ */
+template<typename T>
+struct seqlock {
+	static constexpr int MAX_READ_TRIES{16};
+	std::atomic<uint32_t> seq{};
+	T data{};
+
+	// only to be called from a single task
+	void write(const T &v) {
+		seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		data = v;
+		std::atomic_thread_fence(std::memory_order_release);
+		seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	// returns false if no consistent copy could be made, out then contains garbage of a partial write
+	bool read(T &out) const {
+		for (int i = 0; i < MAX_READ_TRIES; ++i) {
+			uint32_t start = seq.load(std::memory_order_acquire);
+			if (start & 1)
+				continue;
+			out = data;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (seq.load(std::memory_order_relaxed) == start)
+				return true;
+		}
+		return false;
+	}
+	// sequence of the last completed write, can be used to detect new data
+	uint32_t version() const { return seq.load(std::memory_order_acquire) & ~1u; }
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <bit>
 #include <iostream>
 
 #include "AppConfig.h"
@@ -15,12 +16,29 @@ void print_ip(static_string<N>& s, uint32_t ip, uint16_t port, uint8_t m_id) {
 
 inline bool request_settings_store{};
 inline bool request_settings_load{};
+struct LoadConfig {
+	ModbusTcpAddr addr{};
+	LoadType type{};
+	uint8_t phases{3};
+	uint16_t power_reg{};		// holding register with the current power in W
+	uint16_t setpoint_reg{};	// holding register for the setpoint, current in A for wallboxes, 0/1 for sg ready
+	float power_max{};		// max current in A for wallboxes, nominal power in W for sg ready
+};
 struct settings {
+	static constexpr uint32_t MAGIC{0x32544553}; // "SET2", has to change with every layout change of the struct
+	uint32_t magic{MAGIC};
 	bool enable_emm{};
 	float max_export{}; // can be used to set maximum export limit of plant
 	static_vector<int, MAX_INVERTERS> inverter_bat_prio{}; // high prio means that the battery should be kept full
 	ModbusTcpAddr configured_meter{};
 	static_vector<ModbusTcpAddr, MAX_INVERTERS> configured_inverters{};
+	bool phase_balancing{}; // distribute power of single phase inverters to minimize per phase import/export
+	float max_export_phase{}; // export limit per phase, 0 means no limit
+	static_vector<uint8_t, MAX_INVERTERS> inverter_phase{}; // Phase of each inverter, 0 for three phase inverters
+	static_vector<LoadConfig, MAX_LOADS> configured_loads{};
+	bool wear_aware{}; // allocate the battery power such that the summed battery cycles are minimal
+	float filter_alpha{.1f}; // emm home power filter and loop gain, determined by the auto tune
+	float loop_gain{};
 
 	static settings& Default() {
 		static settings s{};
@@ -42,29 +60,73 @@ struct settings {
 	}
 
 	constexpr void sanitize() { 
+		// settings stored by a firmware with another layout (or erased flash) are not interpretable, start with defaults
+		if (magic != MAGIC)
+			*this = {};
+		// erased flash reads as 0xff, which is no valid bool
+		for (bool *b: {&enable_emm, &phase_balancing, &wear_aware})
+			*b = std::bit_cast<uint8_t>(*b) == 1;
+		if (!(max_export >= 0)) // also catches nan
+			max_export = 0;
 		configured_inverters.sanitize(); 
 		inverter_bat_prio.sanitize();
 		if (inverter_bat_prio.size() < configured_inverters.size())
 			for (int i: range(inverter_bat_prio.size(), configured_inverters.size()))
 				inverter_bat_prio[i] = 1;
 		inverter_bat_prio.resize(configured_inverters.size());
+		for (int &p: inverter_bat_prio)
+			p = std::max(p, 1);
+		inverter_phase.sanitize();
+		if (inverter_phase.size() < configured_inverters.size())
+			for (int i: range(inverter_phase.size(), configured_inverters.size()))
+				inverter_phase[i] = 0;
+		inverter_phase.resize(configured_inverters.size());
+		for (uint8_t &p: inverter_phase)
+			p = p > PHASES ? 0: p;
+		if (!(max_export_phase >= 0)) // also catches nan
+			max_export_phase = 0;
+		if (!(filter_alpha >= 0 && filter_alpha < 1))
+			filter_alpha = .1f;
+		if (!(loop_gain >= 0 && loop_gain <= 3))
+			loop_gain = 0;
+		configured_loads.sanitize();
+		for (LoadConfig &l: configured_loads) {
+			l.type = l.type == LoadType::SG_READY ? LoadType::SG_READY: LoadType::WALLBOX;
+			l.phases = std::clamp<uint8_t>(l.phases, 1, PHASES);
+			if (!(l.power_max >= 0))
+				l.power_max = 0;
+		}
 	}
 };
 
 /** @brief prints formatted for monospace output, eg. usb */
 inline std::ostream& operator<<(std::ostream &os, const settings &s) {
-	const auto ip_to_stream = [](std::ostream &os, const ModbusTcpAddr &a) {
+	const auto ip_to_stream = [&os](const ModbusTcpAddr &a) {
 		os << (a.ip >> 24) << '.' << ((a.ip >> 16) & 0xff) << '.' << ((a.ip >> 8) & 0xff) << '.' << (a.ip & 0xff) << ':' << a.port << '|' << (int)a.modbus_id;
 	};
 	os << "configured_inverters [" << s.configured_inverters.size() << "]:\n";
 	for (int i: range(s.configured_inverters.size())) {
 		os << "  ";
-		ip_to_stream(os, s.configured_inverters[i]);
+		ip_to_stream(s.configured_inverters[i]);
 		os << '\n';
 	}
 	os << "configured_meter: ";
-	ip_to_stream(os, s.configured_meter);
-	return os << '\n';
+	ip_to_stream(s.configured_meter);
+	os << "\nphase_balancing: " << (s.phase_balancing ? "true": "false");
+	os << "\nmax_export_phase: " << s.max_export_phase;
+	os << "\ninverter_phase: [";
+	for (int i: range(s.inverter_phase.size()))
+		os << (i ? ", ": "") << int(s.inverter_phase[i]);
+	os << "]\nwear_aware: " << (s.wear_aware ? "true": "false");
+	os << "\nfilter_alpha: " << s.filter_alpha << "\nloop_gain: " << s.loop_gain;
+	os << "\nconfigured_loads [" << s.configured_loads.size() << "]:\n";
+	for (const LoadConfig &l: s.configured_loads) {
+		os << "  ";
+		ip_to_stream(l.addr);
+		os << (l.type == LoadType::SG_READY ? " sg_ready": " wallbox") << " phases " << int(l.phases) << " power_reg " << l.power_reg
+			<< " setpoint_reg " << l.setpoint_reg << " power_max " << l.power_max << '\n';
+	}
+	return os;
 }
 
 /** @brief parses a single key, value pair from the istream */
@@ -93,6 +155,60 @@ inline std::istream& operator>>(std::istream &is, settings &s) {
 		is >> ip;
 		parse_ip(ip, s.configured_meter);
 
+	} else if (key == "phase_balancing") {
+		std::string v;
+		is >> v;
+		s.phase_balancing = v == "true" || v == "1";
+	} else if (key == "wear_aware") {
+		std::string v;
+		is >> v;
+		s.wear_aware = v == "true" || v == "1";
+	} else if (key == "filter_alpha") {
+		is >> s.filter_alpha;
+	} else if (key == "loop_gain") {
+		is >> s.loop_gain;
+	} else if (key == "max_export") {
+		is >> s.max_export;
+	} else if (key == "max_export_phase") {
+		is >> s.max_export_phase;
+	} else if (key == "inverter_bat_prio") {
+		int i{}, p{};
+		is >> i >> p;
+		if (i < 0 || i >= s.inverter_bat_prio.size() || p < 1)
+			is.setstate(std::ios::failbit);
+		else
+			s.inverter_bat_prio[i] = p;
+	} else if (key == "configure_load") {
+		// ${ip}:${port}|${modbus_id} (wallbox|sg_ready) ${phases} ${power_reg} ${setpoint_reg} ${power_max}
+		std::string type;
+		int phases{}, power_reg{}, setpoint_reg{};
+		float power_max{};
+		is >> ip >> type >> phases >> power_reg >> setpoint_reg >> power_max;
+		LoadConfig *l = is && (type == "wallbox" || type == "sg_ready") ? s.configured_loads.push(): nullptr;
+		if (!l)
+			is.setstate(std::ios::failbit);
+		else {
+			*l = LoadConfig{.type = type == "sg_ready" ? LoadType::SG_READY: LoadType::WALLBOX, .phases = uint8_t(std::clamp(phases, 1, PHASES)),
+				.power_reg = uint16_t(power_reg), .setpoint_reg = uint16_t(setpoint_reg), .power_max = power_max};
+			parse_ip(ip, l->addr);
+		}
+	} else if (key == "remove_load") {
+		int i{-1};
+		is >> i;
+		if (i < 0 || i >= s.configured_loads.size())
+			is.setstate(std::ios::failbit);
+		else {
+			for (int j: range(i, s.configured_loads.size() - 1))
+				s.configured_loads[j] = s.configured_loads[j + 1];
+			s.configured_loads.pop();
+		}
+	} else if (key == "inverter_phase") {
+		int i{}, p{};
+		is >> i >> p;
+		if (i < 0 || i >= s.inverter_phase.size() || p < 0 || p > PHASES)
+			is.setstate(std::ios::failbit);
+		else
+			s.inverter_phase[i] = p;
 	} else
 		is.fail();
 	return is;
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+/**
+ * @brief Estimates the battery soc between the (slow) storage reads.
+ * The battery power from the mppt infos is integrated every cycle and converted to soc with a capacity
+ * that is learned from the soc changes between storage reads. Each storage read pulls the estimate back into the
+ * resolution of the read value.
+ * Only used by the modbus task. The learned capacity is not persisted, after a reboot the estimate follows the
+ * storage reads until the soc changed by LEARN_SOC_DELTA and a new capacity sample was taken.
+ */
+struct soc_estimator {
+	static constexpr float READ_RESOLUTION{1};	// soc resolution of the storage model (most report whole percent)
+	static constexpr float LEARN_SOC_DELTA{5};	// min soc change in % before a capacity sample is taken
+	static constexpr float LEARN_RATE{.2f};		// weight of a new capacity sample
+	static constexpr float MAX_DT_S{5};		// larger gaps (eg. after reconnect) are not integrated
+
+	float soc{};		// current estimate in %
+	float read_soc{-1};	// soc of the last storage read, -1 if there was none yet
+	float read_energy_wh{};	// energy charged since the last storage read
+	float learn_soc{-1};	// soc at the start of the current capacity sample
+	float learn_energy_wh{}; // energy charged since learn_soc
+	float capacity_wh{};	// learned capacity, 0 while unknown
+	uint64_t last_us{};
+
+	// charge_w is positive for charging, returns the new estimate
+	float integrate(float charge_w, uint64_t now_us) {
+		float dt_s = last_us ? (now_us - last_us) / 1e6f: 0;
+		last_us = now_us;
+		if (read_soc < 0 || dt_s > MAX_DT_S || std::isnan(charge_w))
+			return soc;
+		float e = charge_w * dt_s / 3600;
+		read_energy_wh += e;
+		learn_energy_wh += e;
+		if (capacity_wh > 0)
+			soc = std::clamp(read_soc + read_energy_wh / capacity_wh * 100, 0.f, 100.f);
+		return soc;
+	}
+	// has to be called with every soc read from the storage, returns the new estimate
+	float correct(float storage_soc) {
+		if (learn_soc < 0 || std::abs(storage_soc - learn_soc) > 50) { // first read or implausible jump
+			learn_soc = storage_soc;
+			learn_energy_wh = 0;
+		} else if (std::abs(storage_soc - learn_soc) >= LEARN_SOC_DELTA) {
+			float sample = learn_energy_wh / (storage_soc - learn_soc) * 100;
+			if (sample > 0) // energy and soc change agree in sign
+				capacity_wh = capacity_wh > 0 ? std::lerp(capacity_wh, sample, LEARN_RATE): sample;
+			learn_soc = storage_soc;
+			learn_energy_wh = 0;
+		}
+		// keep the estimate if it lies within the read resolution, it is more precise than the read itself
+		if (read_soc >= 0 && capacity_wh > 0)
+			soc = std::clamp(soc, storage_soc - READ_RESOLUTION / 2, storage_soc + READ_RESOLUTION / 2);
+		else
+			soc = storage_soc;
+		read_soc = soc;
+		read_energy_wh = 0;
+		return soc;
+	}
+};
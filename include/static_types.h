@@ -108,6 +108,7 @@ struct static_ring_buffer {
 	constexpr void clear() { cur_start = 0; cur_write = 0; full = false; }
 	constexpr bool empty() const { return cur_start == cur_write  && !full; }
 	constexpr int size() const { return full? N: cur_write - cur_start + (cur_start > cur_write ? N: 0); }
+	static constexpr int capacity() { return N; }
 	template <typename SR>
 	struct iterator {
 		SR &_p;
@@ -123,6 +124,30 @@ struct static_ring_buffer {
 	const T& operator[](int i) const { if (i >= 0) return storage[(cur_start + i) % N]; return storage[(cur_write + i + N) % N]; }
 };
 
+// ring buffer over storage which is handed in at runtime (eg. taken from an arena), without storage nothing is pushed
+template<typename T>
+struct span_ring_buffer {
+	using value_type = T;
+	std::span<T> storage{};
+	int cur_start{};
+	int cur_write{};
+	bool full{false};
+	constexpr T* push() {
+		const int n = storage.size();
+		if (!n) return nullptr;
+		T* ret = storage.data() + cur_write;
+		if (cur_start == cur_write && full) cur_start = (cur_start + 1) % n;
+		cur_write = (cur_write + 1) % n;
+		full = cur_start == cur_write;
+		return ret; }
+	constexpr void clear() { cur_start = 0; cur_write = 0; full = false; }
+	constexpr bool empty() const { return cur_start == cur_write  && !full; }
+	constexpr int capacity() const { return storage.size(); }
+	constexpr int size() const { return full? capacity(): cur_write - cur_start + (cur_start > cur_write ? capacity(): 0); }
+	T& operator[](int i) { if (i >= 0) return storage[(cur_start + i) % capacity()]; return storage[(cur_write + i + capacity()) % capacity()]; }
+	const T& operator[](int i) const { if (i >= 0) return storage[(cur_start + i) % capacity()]; return storage[(cur_write + i + capacity()) % capacity()]; }
+};
+
 template<int N, typename... Args>
 static std::string_view static_format(std::format_string<Args...> fmt, Args&&... args) {
 	static static_string<N> string{};
@@ -62,3 +62,18 @@ inline std::optional<int> to_int(std::string_view num) {
 	}
 	return r;
 }
+
+/** @brief Value of key in the query part of a request path ("/path?key=value&other=1"), empty if the key is missing */
+inline std::string_view query_value(std::string_view path, std::string_view key) {
+	auto q = path.find('?');
+	if (q == std::string_view::npos)
+		return {};
+	for (std::string_view query = path.substr(q + 1); query.size();) {
+		auto end = query.find('&');
+		std::string_view param = query.substr(0, end);
+		query = end == std::string_view::npos ? std::string_view{}: query.substr(end + 1);
+		if (param.size() > key.size() && param.starts_with(key) && param[key.size()] == '=')
+			return param.substr(key.size() + 1);
+	}
+	return {};
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <functional>
+#include <utility>
 #include <atomic>
 
 #include "string_util.h"
@@ -24,6 +25,7 @@ constexpr std::string_view STATUS_BAD_REQUEST{"400 Bad Request"};
 constexpr std::string_view STATUS_UNAUTHORIZED{"401 Unauthorized"};
 constexpr std::string_view STATUS_FORBIDDEN{"403 Forbidden"};
 constexpr std::string_view STATUS_NOT_FOUND{"404 Not Found"};
+constexpr std::string_view STATUS_CONFLICT{"409 Conflict"};
 constexpr std::string_view STATUS_INTERNAL_SERVER_ERROR{"500 Internal Server Error"};
 
 struct EndpointFlags{
@@ -69,6 +71,15 @@ struct tcp_server {
 
 		struct tcp_pcb *tpcb{};
 		bool on_stream_out{};
+		/** @brief set by an endpoint for bodies of any size: called with the cleared buffer and the bytes it may append
+		  * whenever the client acknowledged data, returns false after the last chunk. An empty chunk with true means
+		  * no data is ready yet, it is asked again with the next acknowledge or poll (the connection is reset after
+		  * MAX_STREAM_WAITS polls without data, so the client does not take the body as complete).
+		  * The send buffer stays reserved until the end, the connection is closed afterwards (no Content-Length) */
+		std::function<bool(static_string<buf_size> &chunk, int max_size)> stream_body{};
+		std::function<void()> stream_end{}; // called once when the stream is done or its connection was dropped, eg. to release what it reads
+		bool stream_sent{}; // the client acknowledged stream data since the last poll
+		uint8_t stream_waits{}; // polls since the stream had no data ready, 0 while it delivers
 
 		tcp_server *parent_server{};
 
@@ -95,7 +106,7 @@ struct tcp_server {
 		/** @brief writes the string_view the end of the backing buffer directly after the header section
 		  * and sets the internal body variable to exactly this string */
 		void res_write_body(std::string_view body = {});
-		void clear() { used = {}; buffer.clear(); method = {}; path = {}; http_version = {}; status = {}; headers_view.headers.clear(); body = {}; tpcb = {}; on_stream_out = {}; }
+		void clear() { if (stream_end) std::exchange(stream_end, {})(); used = {}; buffer.clear(); method = {}; path = {}; http_version = {}; status = {}; headers_view.headers.clear(); body = {}; tpcb = {}; on_stream_out = {}; stream_body = {}; stream_sent = {}; stream_waits = {}; }
 	};
 	using endpoint_callback = std::function<void(const message_buffer &request, message_buffer& response)>;
 	struct endpoint {
@@ -111,6 +122,8 @@ struct tcp_server {
 	std::array<endpoint, put_size> put_endpoints{};
 	std::array<endpoint, delete_size> delete_endpoints{};
 	int poll_time_s{5};
+	static constexpr int STREAM_MIN_CHUNK{512}; // stream chunks wait for this much free tcp send buffer
+	static constexpr int MAX_STREAM_WAITS{3};
 
 	~tcp_server() { if(!closed) LogError("Tcp server not closed before destruction!"); };
 	err_t start();
@@ -127,6 +140,7 @@ struct tcp_server {
 
 	void process_request(uint32_t recieve_buffer_idx, struct tcp_pcb *client);
 	err_t send_data(std::string_view data, struct tcp_pcb *client);
+	void stream_out(message_buffer &send_buffer);
 };
 
 // ------------------------------------------------------------------------------
@@ -153,6 +167,17 @@ constexpr static err_t clear_client_pcb(std::atomic<struct tcp_pcb*> &pcb) {
 	return err;
 
 }
+// resets the connection instead of closing it, a stream that can not be completed is not taken as complete body
+constexpr static err_t abort_client_pcb(std::atomic<struct tcp_pcb*> &pcb) {
+	tcp_arg(pcb, NULL);
+	tcp_poll(pcb, NULL, 0);
+	tcp_sent(pcb, NULL);
+	tcp_recv(pcb, NULL);
+	tcp_err(pcb, NULL);
+	tcp_abort(pcb);
+	pcb = nullptr;
+	return ERR_ABRT;
+}
 
 template template_args
 constexpr static err_t tcp_server_result(void *arg, int status, struct tcp_pcb *client) {
@@ -166,6 +191,9 @@ constexpr static err_t tcp_server_result(void *arg, int status, struct tcp_pcb *
 	for (auto &pcb: server.client_pcbs) {
 		if (pcb == nullptr || (client && pcb != client))
 			continue;
+		for (auto &send_buffer: server.send_buffers)
+			if (send_buffer.tpcb == pcb)
+				send_buffer.clear(); // aborted stream
 		err = clear_client_pcb(pcb);
 	}
 	return err;
@@ -173,6 +201,17 @@ constexpr static err_t tcp_server_result(void *arg, int status, struct tcp_pcb *
 
 template template_args
 constexpr static err_t tcp_server_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+	if (!arg)
+		return ERR_OK;
+	tcp_server template_args_pure& server = reinterpret_cast<tcp_server template_args_pure&>(*(char*)arg);
+	// only streaming send buffers keep their client after the request was processed
+	for (auto &send_buffer: server.send_buffers) {
+		if (send_buffer.tpcb != tpcb)
+			continue;
+		send_buffer.stream_sent = true;
+		server.stream_out(send_buffer);
+		break;
+	}
 	return ERR_OK;
 }
 
@@ -208,8 +247,30 @@ constexpr static err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct p
 
 template template_args
 constexpr static err_t tcp_server_poll(void *arg, struct tcp_pcb *tpcb) {
-	// remove connections that are not anymore valid
+	// remove connections that are not anymore valid, streams are kept as long as the client acknowledges data
 	LogInfo("tcp_server_poll_fn");
+	tcp_server template_args_pure& server = reinterpret_cast<tcp_server template_args_pure&>(*(char*)arg);
+	for (auto &send_buffer: server.send_buffers) {
+		if (send_buffer.tpcb != tpcb)
+			continue;
+		if (send_buffer.stream_waits) {
+			// nothing might be in flight which would trigger tcp_server_sent, so the stream is asked again here
+			if (send_buffer.stream_waits++ > server.MAX_STREAM_WAITS) {
+				LogError("Stream had no data for {} polls, resetting the connection", server.MAX_STREAM_WAITS);
+				send_buffer.clear();
+				for (auto &pcb: server.client_pcbs)
+					if (pcb == tpcb)
+						return abort_client_pcb(pcb);
+				return ERR_OK;
+			}
+			server.stream_out(send_buffer);
+			return ERR_OK;
+		}
+		if (!send_buffer.stream_sent)
+			continue;
+		send_buffer.stream_sent = false;
+		return ERR_OK;
+	}
 	return tcp_server_result template_args_pure(arg, -1, tpcb); // on no response remove the client to free up space
 }
 
@@ -467,9 +528,56 @@ void tcp_server template_args_pure::process_request(uint32_t recieve_buffer_idx,
 	else
 		default_endpoint_cb(recieve_buffer, send_buffer);
 
-	send_data(send_buffer.buffer.sv(), client);
 	recieve_buffer.clear();
+	if (send_buffer.stream_body) {
+		stream_out(send_buffer); // starts with the headers in the buffer
+		return;
+	}
+	send_data(send_buffer.buffer.sv(), client);
+	send_buffer.clear();
+}
+
+template template_args
+void tcp_server template_args_pure::stream_out(message_buffer &send_buffer) {
+	// the buffer holds the chunk which is not yet written, lwip copies it so it can be refilled right away
+	struct tcp_pcb *client = send_buffer.tpcb;
+	while (send_buffer.buffer.size() || send_buffer.stream_body) {
+		if (send_buffer.buffer.empty()) {
+			int max_size = std::min<int>(tcp_sndbuf(client), send_buffer.buffer.storage.size());
+			if (max_size < STREAM_MIN_CHUNK)
+				break; // continued by tcp_server_sent
+			if (!send_buffer.stream_body(send_buffer.buffer, max_size))
+				send_buffer.stream_body = {};
+			else if (send_buffer.buffer.empty()) {
+				send_buffer.stream_waits = std::max<uint8_t>(send_buffer.stream_waits, 1);
+				break; // no data ready, asked again by tcp_server_sent or tcp_server_poll
+			}
+			if (send_buffer.buffer.empty())
+				continue;
+			send_buffer.stream_waits = 0;
+		}
+		if (send_buffer.buffer.size() > tcp_sndbuf(client))
+			break;
+		err_t err = tcp_write(client, send_buffer.buffer.data(), send_buffer.buffer.size(),
+				      TCP_WRITE_FLAG_COPY | (send_buffer.stream_body ? TCP_WRITE_FLAG_MORE: 0));
+		if (err == ERR_MEM)
+			break; // send queue full, retried when data was acknowledged
+		if (err != ERR_OK) {
+			LogError("Failed to write stream data {}", err);
+			tcp_server_internal::tcp_server_result template_args_pure(this, -1, client);
+			return;
+		}
+		send_buffer.buffer.clear();
+	}
+	if (err_t err = tcp_output(client); err != ERR_OK)
+		LogError("Failed to output stream data {}", err);
+	if (send_buffer.buffer.size() || send_buffer.stream_body)
+		return;
+	// the end of the body is marked by closing the connection, queued data is still sent
 	send_buffer.clear();
+	for (auto &pcb: client_pcbs)
+		if (pcb == client)
+			tcp_server_internal::clear_client_pcb(pcb);
 }
 
 template template_args
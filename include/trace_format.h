@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+
+#include "emm.h"
+#include "ranges_util.h"
+
+/**
+ * @brief Binary format of recorded control loop cycles.
+ * Shared between the firmware (recording, see control_trace.h) and the host replay tool in tools/.
+ * A downloaded trace is a file_header followed by frame_count frames, oldest first.
+ * All inputs are stored as the float values handed to the emm, so the replay computes on exactly the
+ * inputs of the device and a fixed point trace replays bit exact.
+ */
+namespace trace {
+constexpr uint32_t MAGIC{0x544d4d45}; // "EMMT" when read little endian
+constexpr uint16_t VERSION{4};
+
+constexpr uint8_t FLAG_ENABLE_EMM{1 << 0};
+constexpr uint8_t FLAG_INVERT_HOME{1 << 1};
+constexpr uint8_t FLAG_PHASE_BALANCING{1 << 2};
+constexpr uint8_t FLAG_WEAR_AWARE{1 << 3};
+constexpr uint8_t FLAG_FIXED_POINT{1 << 4};	// recorded with EMM_FIXED_POINT, replays bit exact with update_power_t<fixed>
+
+struct inverter_sample {
+	float inverter_w;	// export - import
+	float pv_w;
+	float battery_w;	// export - import
+	float bat_soc;
+	float requested_w;	// output of the emm in this cycle
+	float power_max;
+	float power_max_cha;
+	float power_max_discha;
+	float min_soc;
+	uint8_t bat_priority;
+	uint8_t phase;
+	uint8_t active;
+	uint8_t reserved;
+};
+
+struct load_sample {
+	float power_w;		// consumption, import - export
+	float power_min;
+	float power_max;
+	float power_step;
+	float prev_requested_w;	// request of the previous cycle, tells whether the load is switched on
+	float requested_w;	// output of the emm in this cycle
+	uint32_t min_switch_s;
+	uint32_t last_switch_s;	// before the update
+	uint8_t active;
+	uint8_t reserved[3];
+};
+
+struct frame {
+	uint32_t time_ms;
+	uint32_t epoch_s;
+	float filter_alpha;
+	float loop_gain;
+	float home_power_prev;	// emm filter state before the update
+	std::array<float, PHASES> home_phase_power_prev;
+	float home_w;		// unfiltered home power handed to the emm
+	std::array<float, PHASES> home_phase_w;
+	float meter_w;
+	std::array<float, PHASES> meter_phase_w;
+	float max_export;
+	float max_export_phase;
+	uint8_t flags;
+	uint8_t inverter_count;
+	uint8_t load_count;
+	std::array<inverter_sample, MAX_INVERTERS> inverters;
+	std::array<load_sample, MAX_LOADS> loads;
+};
+
+struct file_header {
+	uint32_t magic{MAGIC};
+	uint16_t version{VERSION};
+	uint16_t max_inverters{MAX_INVERTERS};
+	uint32_t frame_size{sizeof(frame)};
+	uint32_t frame_count{};
+};
+
+// fills all inputs of the frame, has to be called before EMM::update_power
+inline void encode_inputs(frame &f, uint32_t time_ms, uint32_t epoch_s, const EMM &emm, PowerInfo home, PowerInfo meter,
+			  std::span<const InverterGroup> groups, std::span<const ControlPowerInfo> controls, std::span<const LoadInfo> loads, const settings &s) {
+	f.time_ms = time_ms;
+	f.epoch_s = epoch_s;
+	f.filter_alpha = emm.filter_alpha;
+	f.loop_gain = emm.loop_gain;
+	f.home_power_prev = emm.home_power;
+	f.home_phase_power_prev = emm.home_phase_power;
+	f.home_w = home.imp_w - home.exp_w;
+	f.meter_w = meter.imp_w - meter.exp_w;
+	f.home_phase_w = home.phase_w;
+	f.meter_phase_w = meter.phase_w;
+	f.max_export = s.max_export;
+	f.max_export_phase = s.max_export_phase;
+	f.flags = (s.enable_emm ? FLAG_ENABLE_EMM: 0) | (emm.invert_home ? FLAG_INVERT_HOME: 0) | (s.phase_balancing ? FLAG_PHASE_BALANCING: 0) |
+		  (s.wear_aware ? FLAG_WEAR_AWARE: 0) | (EMM_FIXED_POINT ? FLAG_FIXED_POINT: 0);
+	f.inverter_count = std::min<int>(groups.size(), MAX_INVERTERS);
+	for (int i: range(f.inverter_count)) {
+		const InverterGroup &g = groups[i];
+		const ControlPowerInfo &c = controls[i];
+		f.inverters[i] = inverter_sample{
+			.inverter_w = g.inverter.exp_w - g.inverter.imp_w,
+			.pv_w = g.pv.exp_w - g.pv.imp_w,
+			.battery_w = g.battery.exp_w - g.battery.imp_w,
+			.bat_soc = g.bat_soc,
+			.requested_w = 0,
+			.power_max = c.power_max,
+			.power_max_cha = c.power_max_cha,
+			.power_max_discha = c.power_max_discha,
+			.min_soc = c.min_soc,
+			.bat_priority = uint8_t(std::clamp(c.bat_priority, 0, 255)),
+			.phase = uint8_t(g.phase),
+			.active = c.is_active(),
+			.reserved = 0,
+		};
+	}
+	f.load_count = std::min<int>(loads.size(), MAX_LOADS);
+	for (int i: range(f.load_count)) {
+		const LoadInfo &l = loads[i];
+		f.loads[i] = load_sample{
+			.power_w = l.power.imp_w - l.power.exp_w,
+			.power_min = l.power_min,
+			.power_max = l.power_max,
+			.power_step = l.power_step,
+			.prev_requested_w = l.requested_power,
+			.requested_w = 0,
+			.min_switch_s = l.min_switch_s,
+			.last_switch_s = l.last_switch_s,
+			.active = l.is_active(),
+			.reserved = {},
+		};
+	}
+}
+// stores the emm results into the frame, has to be called after EMM::update_power
+inline void encode_outputs(frame &f, std::span<const ControlPowerInfo> controls, std::span<const LoadInfo> loads) {
+	for (int i: range(std::min<int>(f.inverter_count, controls.size())))
+		f.inverters[i].requested_w = controls[i].requested_power;
+	for (int i: range(std::min<int>(f.load_count, loads.size())))
+		f.loads[i].requested_w = loads[i].requested_power;
+}
+
+// inverse of encode_inputs, restores everything needed to rerun EMM::update_power on the frame (with now_s = time_ms / 1000)
+inline void decode_inputs(const frame &f, EMM &emm, PowerInfo &home, static_vector<InverterGroup, MAX_INVERTERS> &groups,
+			  static_vector<ControlPowerInfo, MAX_INVERTERS> &controls, static_vector<LoadInfo, MAX_LOADS> &loads, settings &s) {
+	emm.filter_alpha = f.filter_alpha;
+	emm.loop_gain = f.loop_gain;
+	emm.home_power = f.home_power_prev;
+	emm.home_phase_power = f.home_phase_power_prev;
+	emm.invert_home = f.flags & FLAG_INVERT_HOME;
+	home = PowerInfo{.device_id = HOME_ID, .imp_w = std::max(f.home_w, 0.f), .exp_w = -std::min(f.home_w, 0.f)};
+	home.phase_w = f.home_phase_w;
+	s.enable_emm = f.flags & FLAG_ENABLE_EMM;
+	s.phase_balancing = f.flags & FLAG_PHASE_BALANCING;
+	s.wear_aware = f.flags & FLAG_WEAR_AWARE;
+	s.max_export = f.max_export;
+	s.max_export_phase = f.max_export_phase;
+	groups.resize(f.inverter_count);
+	controls.resize(f.inverter_count);
+	const auto to_power_info = [](int id, float w) { return PowerInfo{.device_id = id, .imp_w = std::max(-w, 0.f), .exp_w = std::max(w, 0.f)}; };
+	for (int i: range(f.inverter_count)) {
+		const inverter_sample &in = f.inverters[i];
+		groups[i] = InverterGroup{
+			.inverter = to_power_info(METER_ID + 1 + 3 * i, in.inverter_w),
+			.pv = to_power_info(METER_ID + 2 + 3 * i, in.pv_w),
+			.battery = to_power_info(METER_ID + 3 + 3 * i, in.battery_w),
+			.bat_soc = in.bat_soc,
+			.phase = Phase(in.phase),
+		};
+		controls[i] = ControlPowerInfo{
+			.min_soc = in.min_soc,
+			.power_max = in.power_max,
+			.power_max_cha = in.power_max_cha,
+			.power_max_discha = in.power_max_discha,
+			.requested_power = 0,
+			.bat_priority = in.bat_priority,
+			.last_connection_s = 0,
+		};
+	}
+	// is_active() compares against the time of the replaying machine
+	const uint32_t now_s = time_us_64() / 1000000;
+	loads.resize(f.load_count);
+	for (int i: range(f.load_count)) {
+		const load_sample &in = f.loads[i];
+		loads[i] = LoadInfo{
+			.power = {.device_id = 0, .imp_w = std::max(in.power_w, 0.f), .exp_w = -std::min(in.power_w, 0.f)},
+			.power_min = in.power_min,
+			.power_max = in.power_max,
+			.power_step = in.power_step,
+			.requested_power = in.prev_requested_w,
+			.min_switch_s = in.min_switch_s,
+			.last_switch_s = in.last_switch_s,
+			.last_connection_s = in.active ? now_s: now_s - 10,
+		};
+	}
+}
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iostream>
+#include <charconv>
 
 #include "log_storage.h"
 #include "settings.h"
@@ -9,6 +10,14 @@
 #include "access_point.h"
 #include "inverter.h"
 #include "meter.h"
+#include "load.h"
+#include "control_trace.h"
+#include "auto_tune.h"
+#include "control_timing.h"
+#include "history_data.h"
+#include "history_log.h"
+#include "energy_counters.h"
+#include "emm.h"
 
 // handle exactly one command from the input stream at a time (should be called in an endless loop)
 static constexpr inline void handle_usb_command(std::istream &in = std::cin, std::ostream &out = std::cout) {
@@ -35,9 +44,20 @@ static constexpr inline void handle_usb_command(std::istream &in = std::cin, std
 		out << "    Prints the status of the iot device, including measurement values, setting values, error state, wifi status\n\n";
 		out << "  set ${variable} ${value}\n";
 		out << "    Set the value of a variable. Available variables are:\n";
-		out << "      Variable1\n";
-		out << "      Variable2\n";
-		out << "      Variable3\n\n";
+		out << "      configure_inverter ${ip}:${port}|${modbus_id}\n";
+		out << "      configure_meter ${ip}:${port}|${modbus_id}\n";
+		out << "      max_export ${watts}\n";
+		out << "      inverter_bat_prio ${inverter_idx} ${prio}\n";
+		out << "      phase_balancing (true|false)\n";
+		out << "      max_export_phase ${watts}\n";
+		out << "      wear_aware (true|false)\n";
+		out << "      filter_alpha ${alpha}\n";
+		out << "      loop_gain ${gain}\n";
+		out << "      inverter_phase ${inverter_idx} (0|1|2|3)\n";
+		out << "      configure_load ${ip}:${port}|${modbus_id} (wallbox|sg_ready) ${phases} ${power_reg} ${setpoint_reg} ${power_max}\n";
+		out << "        power_reg holds the load power in W, setpoint_reg gets the current in A (wallbox) or 0/1 (sg_ready)\n";
+		out << "        power_max is the max current in A (wallbox) or the nominal power in W (sg_ready)\n";
+		out << "      remove_load ${load_idx}\n\n";
 		out << "  enable_wifi|ew\n";
 		out << "    Activate wifi on the device\n\n";
 		out << "  disable_wifi|dw\n";
@@ -54,6 +74,12 @@ static constexpr inline void handle_usb_command(std::istream &in = std::cin, std
 		out << "    Print the log storage to the console\n\n";
 		out << "  logs|ls\n";
 		out << "    Print the log storage with a separator line to the console\n\n";
+		out << "  trace (on|off|clear|status)\n";
+		out << "    Control the recording of the control loop, download the trace via http GET /trace\n\n";
+		out << "  autotune (${inverter_idx}|status)\n";
+		out << "    Identify the control loop with a power step on the inverter and store filter_alpha and loop_gain (takes ~50s)\n\n";
+		out << "  timing\n";
+		out << "    Print the phase durations, period jitter and overruns of the control loop\n\n";
 		out << "  s\n";
 		out << "    Print a separator line with dashes\n\n";
 	} else if (command == "status") {
@@ -65,11 +91,33 @@ static constexpr inline void handle_usb_command(std::istream &in = std::cin, std
 		out << settings::Default();
 		out << "-------------\n";
 		out << "Realtime data:\n";
-		out << "Meter " << g::meter().name.sv() << ": " << g::meter().power_info.imp_w - g::meter().power_info.exp_w << "W\n";
+		out << "Meter " << g::meter().name.sv() << ": " << g::meter().power_info.imp_w - g::meter().power_info.exp_w << "W";
+		out << " (L1 " << g::meter().power_info.phase_w[0] << "W, L2 " << g::meter().power_info.phase_w[1] << "W, L3 " << g::meter().power_info.phase_w[2] << "W)\n";
 		for (int i: range(g::inverters().read_power.size())) {
 			const InverterGroup &ig = g::inverters().read_power[i];
 			out << g::inverters().connected_names[i].sv() << ": Inverter(" << -ig.inverter.imp_w + ig.inverter.exp_w << "), PV(" << ig.pv.exp_w << "), Battery(" << -ig.battery.imp_w + ig.battery.exp_w << ", Soc " << ig.bat_soc << ")\n";
 		}
+		for (int i: range(g::loads().loads.size())) {
+			const LoadInfo &l = g::loads().loads[i];
+			out << "Load " << i << ' ' << g::loads().connected_names[i].sv() << ": " << l.power.imp_w - l.power.exp_w << "W, requested " << l.requested_power << "W\n";
+		}
+		const EMM::cost_counters &cost = emm().cost;
+		out << "EMM (" << (EMM_FIXED_POINT ? "fixed point": "float") << "): " << cost.calls << " calls, " << cost.last_us << "us last, "
+		    << (cost.calls ? cost.total_us / cost.calls: 0) << "us mean, " << cost.max_us << "us max\n";
+		out << "History arena: " << g::history_arena_used / 1024 << " of " << g::history_arena.size() / 1024 << "kB used\n";
+		for (const t::registered_series &s: std::span{g::history_series.data(), size_t(g::history_series_count)})
+			out << "  " << s.config.name << " (" << s.config.unit << "): " << s.slots.size() << (s.config.keyed ? " device": "")
+			    << " slots, " << s.bytes / 1024 << "kB" << (s.unslotted_id ? " (full)": "") << '\n';
+		const history_log &hl = history_log::Default();
+		out << "History log: " << hl.appended_records << " hours appended, " << hl.restored_hours << " restored, " << hl.erased_sectors
+		    << " sectors erased, " << hl.flash_errors << " flash errors" << (hl.valid ? "": " (disabled)") << '\n';
+		{
+			energy_counters &e = energy_counters::Default();
+			scoped_lock lock{e.m};
+			out << "Energy: import " << e.data.day.wh[energy_counters_data::GRID_IMPORT] << "Wh today, " << e.data.total_wh[energy_counters_data::GRID_IMPORT]
+			    << "Wh total, export " << e.data.day.wh[energy_counters_data::GRID_EXPORT] << "Wh today, " << e.data.total_wh[energy_counters_data::GRID_EXPORT]
+			    << "Wh total, deviation to the meter " << e.deviation_imp_wh << "Wh import, " << e.deviation_exp_wh << "Wh export\n";
+		}
 		out << "-------------\n";
 		out << "wifi:\n";
 		out << wifi_storage::Default();
@@ -113,6 +161,51 @@ static constexpr inline void handle_usb_command(std::istream &in = std::cin, std
 	} else if (command == "logs" || command == "ls") {
 		out << "--------------------------------------\n";
 		print_logs();
+	} else if (command == "trace") {
+		std::string action;
+		in >> action;
+		if      (action == "on") control_trace::Default().enabled = true;
+		else if (action == "off") control_trace::Default().enabled = false;
+		else if (action == "clear") { if (!control_trace::Default().clear()) out << "[ERROR] trace is being downloaded, try again later\n"; }
+		else if (action == "status") out << "Trace recording " << (control_trace::Default().enabled ? "on": "off") << ", " << g::trace_frames.access().data.size() << '/' << TRACE_FRAMES << " frames\n";
+		else out << "[ERROR] trace action " << action << " not allowed. Allowed values are: on|off|clear|status\n";
+	} else if (command == "autotune") {
+		std::string action;
+		in >> action;
+		const auto_tune &t = auto_tune::Default();
+		if (action == "status") {
+			switch (t.cur_state) {
+			case auto_tune::state::IDLE: out << "Auto tune not run\n"; break;
+			case auto_tune::state::DONE:
+				out << "Auto tune done: dead time " << t.dead_time_s << "s, time constant " << t.time_constant_s << "s, disturbance " << t.disturbance
+				    << ", filter_alpha " << t.filter_alpha << ", loop_gain " << t.loop_gain << '\n';
+				break;
+			case auto_tune::state::FAILED: out << "Auto tune failed: " << t.error << '\n'; break;
+			default: out << "Auto tune running on inverter " << t.inverter << '\n'; break;
+			}
+		} else {
+			int idx = -1;
+			std::from_chars(action.data(), action.data() + action.size(), idx);
+			if (idx < 0 || idx >= int(settings::Default().configured_inverters.size()))
+				out << "[ERROR] inverter index " << action << " not valid\n";
+			else
+				auto_tune::Default().request(idx);
+		}
+	} else if (command == "timing") {
+		control_timing::stats st;
+		if (!control_timing::Default().published.read(st)) {
+			out << "[ERROR] control timing busy, retry\n";
+			return;
+		}
+		const uint32_t n = std::max(st.cycles, uint32_t(1));
+		out << "Control loop: " << st.cycles << " cycles, " << st.overruns << " overruns, " << st.missed_periods << " missed periods\n";
+		out << "  jitter: " << st.last_jitter_us << "us last, " << st.total_jitter_us / n << "us mean, " << st.max_jitter_us << "us max\n";
+		out << "  cycle: " << st.cycle.last_us << "us last, " << st.cycle.total_us / n << "us mean, " << st.cycle.max_us << "us max\n";
+		for (int p: range(int(control_timing::PHASE_COUNT)))
+			out << "  " << control_timing::PHASE_NAMES[p] << ": " << st.phases[p].last_us << "us last, " << st.phases[p].total_us / n << "us mean, " << st.phases[p].max_us << "us max\n";
+		out << "History (lock waits of the writer, read retries, failed reads):\n";
+		for (const hd::contention_stats &c: hd::contention())
+			out << "  " << c.name << ": " << c.lock_waits << ", " << c.read_retries << ", " << c.read_failures << '\n';
 	} else if (command == "s") {
 		out << "--------------------------------------\n";
 	} else {
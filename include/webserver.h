@@ -1,6 +1,8 @@
 #pragma once
 
 #include <span>
+#include <charconv>
+#include <cstring>
 
 #include "static_types.h"
 #include "tcp_server/tcp_server.h"
@@ -10,8 +12,15 @@
 #include "persistent_storage.h"
 #include "crypto_storage.h"
 #include "ntp_client.h"
+#include "control_trace.h"
+#include "power_flow.h"
+#include "energy_profile.h"
+#include "energy_counters.h"
+#include "what_if.h"
+#include "control_timing.h"
+#include "history_data.h"
 
-using tcp_server_typed = tcp_server<12, 5, 2, 0>;
+using tcp_server_typed = tcp_server<20, 6, 3, 0>;
 tcp_server_typed& Webserver() {
 	const auto static_page_callback = [] (std::string_view page, std::string_view status, std::string_view type = "text/html") {
 		return [page, status, type](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res){
@@ -196,6 +205,345 @@ tcp_server_typed& Webserver() {
 		res.res_add_header("Content-Length", "0");
 		res.res_write_body();
 	};
+	const auto get_trace = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		// binary download of the recorded control cycles, format see trace_format.h
+		trace::file_header header{.frame_count = uint32_t(control_trace::Default().begin_read())};
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", "application/octet-stream");
+		res.res_add_header("Content-Disposition", "attachment; filename=\"emm_trace.bin\"");
+		res.res_add_header("Content-Length", static_format<12>("{}", sizeof(header) + header.frame_count * sizeof(trace::frame)));
+		res.res_add_header("Connection", "close");
+		res.res_write_body(std::string_view{reinterpret_cast<const char*>(&header), sizeof(header)});
+		// recording stays paused until the stream is done, each chunk continues at the byte the previous one ended
+		res.stream_end = [] { control_trace::Default().end_read(); };
+		res.stream_body = [offset = size_t(0), bytes = header.frame_count * sizeof(trace::frame)] (decltype(res.buffer) &chunk, int max_size) mutable {
+			while (offset < bytes && chunk.size() < max_size) {
+				const char *frame = reinterpret_cast<const char*>(&g::trace_frames_psram[offset / sizeof(trace::frame)]);
+				size_t in_frame = offset % sizeof(trace::frame);
+				size_t n = std::min(sizeof(trace::frame) - in_frame, size_t(max_size - chunk.size()));
+				chunk.append(std::string_view{frame + in_frame, n});
+				offset += n;
+			}
+			return offset < bytes;
+		};
+	};
+	const auto set_trace = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		// "true"/"false" starts/stops recording, "clear" drops all recorded frames (not while a download runs)
+		bool ok{true};
+		if (req.body == "clear")
+			ok = control_trace::Default().clear();
+		else
+			control_trace::Default().enabled = req.body == "true";
+		res.res_set_status_line(HTTP_VERSION, ok ? STATUS_OK: STATUS_CONFLICT);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Length", "0");
+		res.res_write_body();
+	};
+	const auto get_power_flow = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		static PowerFlow flow{};
+		if (!g::power_flow.read(flow)) {
+			res.res_set_status_line(HTTP_VERSION, STATUS_INTERNAL_SERVER_ERROR);
+			res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+			res.res_add_header("Content-Length", "0");
+			res.res_write_body();
+			return;
+		}
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", "application/json");
+		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
+		res.res_write_body(); // add header end sequence
+		int start_size = res.buffer.size();
+		res.buffer.append_formatted(R"({{"time_ms":{},"home_w":{:.0f},"grid_w":{:.0f},"inverters":[)",
+			flow.time_ms, flow.home.imp_w - flow.home.exp_w, flow.meter.imp_w - flow.meter.exp_w);
+		for (int i: range(flow.dc.size())) {
+			const battery_wear wear = energy_counters::Default().wear(flow.inverter_groups[i].battery.device_id);
+			res.buffer.append_formatted(R"({}{{"pv_w":{:.0f},"charge_w":{:.0f},"discharge_w":{:.0f},"soc":{:.1f},"cycles":{:.2f},"half_cycles":{}}})", i ? ",": "",
+				flow.dc[i].pv_w, flow.dc[i].charge_w, flow.dc[i].discharge_w, flow.inverter_groups[i].bat_soc, wear.cycles, wear.half_cycles);
+		}
+		res.buffer.append(R"(],"nodes":["home","grid")");
+		for (int i: range(flow.inverter_groups.size()))
+			res.buffer.append_formatted(R"(,"inverter_{}")", i);
+		res.buffer.append(R"(],"bus":[)"); // flows between the nodes, from and to are node indices
+		bool first{true};
+		for (int s: range(flow.nodes())) {
+			for (int d: range(flow.nodes())) {
+				if (flow.bus_w(s, d) < 1)
+					continue;
+				res.buffer.append_formatted(R"({}{{"from":{},"to":{},"w":{:.0f}}})", first ? "": ",", s, d, flow.bus_w(s, d));
+				first = false;
+			}
+		}
+		res.buffer.append("]}");
+		if (0 == format_to_sv(length_hdr, "{}", res.buffer.size() - start_size))
+			LogError("Failed to write header length");
+	};
+	const auto get_energy_profile = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		static energy_profile_data profile{};
+		{ scoped_lock lock{energy_profile::Default().m}; profile = energy_profile::Default().data; }
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", "application/json");
+		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
+		res.res_write_body(); // add header end sequence
+		int start_size = res.buffer.size();
+		// [day][hour] in W, day 0 is monday and the hours are utc, null for hours without data
+		const auto append_week = [&res](const energy_profile_data::week &w) {
+			for (int d: range(energy_profile_data::DAYS)) {
+				res.buffer.append(d ? ",[": "[");
+				for (int h: range(energy_profile_data::HOURS)) {
+					const energy_profile_data::slot &s = w[d][h];
+					if (s.samples)
+						res.buffer.append_formatted("{}{:.0f}", h ? ",": "", s.mean_w);
+					else
+						res.buffer.append(h ? ",null": "null");
+				}
+				res.buffer.append("]");
+			}
+		};
+		res.buffer.append(R"({"home":[)");
+		append_week(profile.home);
+		res.buffer.append(R"(],"pv":[)");
+		append_week(profile.pv);
+		res.buffer.append("]}");
+		if (0 == format_to_sv(length_hdr, "{}", res.buffer.size() - start_size))
+			LogError("Failed to write header length");
+	};
+	// running periods and totals, the closed periods are at /energy/days, /energy/months and /energy/years (all do not fit a buffer)
+	const auto get_energy = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		static energy_counters_data counters{};
+		double deviation_imp_wh{}, deviation_exp_wh{};
+		{
+			energy_counters &e = energy_counters::Default();
+			scoped_lock lock{e.m};
+			counters = e.data;
+			deviation_imp_wh = e.deviation_imp_wh;
+			deviation_exp_wh = e.deviation_exp_wh;
+		}
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", "application/json");
+		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
+		res.res_write_body(); // add header end sequence
+		int start_size = res.buffer.size();
+		const auto append_wh = [&res](const auto &wh) {
+			for (int c: range(energy_counters_data::CHANNELS))
+				res.buffer.append_formatted(R"({}"{}":{:.1f})", c ? ",": "", energy_counters_data::CHANNEL_NAMES[c], wh[c]);
+		};
+		res.buffer.append(R"({"total":{)");
+		append_wh(counters.total_wh);
+		const auto append_period = [&](std::string_view name, const energy_counters_data::running &p) {
+			res.buffer.append_formatted(R"(}},"{}":{{"start":{},)", name, p.start);
+			append_wh(p.wh);
+		};
+		append_period("day", counters.day);
+		append_period("month", counters.month);
+		append_period("year", counters.year);
+		res.buffer.append_formatted(R"(}},"deviation":{{"grid_import":{:.1f},"grid_export":{:.1f}}}}})", deviation_imp_wh, deviation_exp_wh);
+		if (0 == format_to_sv(length_hdr, "{}", res.buffer.size() - start_size))
+			LogError("Failed to write header length");
+	};
+	// closed periods oldest first as [start, wh of each channel in the order of "channels"]
+	const auto get_energy_rollup = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		static energy_counters_data counters{};
+		std::string_view name = req.path.substr(std::string_view{"/energy/"}.size());
+		if (name != "days" && name != "months" && name != "years") {
+			res.res_set_status_line(HTTP_VERSION, STATUS_NOT_FOUND);
+			res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+			res.res_add_header("Content-Length", "0");
+			res.res_write_body();
+			return;
+		}
+		{ scoped_lock lock{energy_counters::Default().m}; counters = energy_counters::Default().data; }
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", "application/json");
+		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
+		res.res_write_body(); // add header end sequence
+		int start_size = res.buffer.size();
+		res.buffer.append(R"({"channels":[)");
+		for (int c: range(energy_counters_data::CHANNELS))
+			res.buffer.append_formatted(R"({}"{}")", c ? ",": "", energy_counters_data::CHANNEL_NAMES[c]);
+		res.buffer.append_formatted(R"(],"{}":[)", name);
+		const auto append_rollup = [&res](const auto &rollup) {
+			bool first{true};
+			for (const energy_counters_data::closed &p: rollup) {
+				res.buffer.append_formatted("{}[{}", first ? "": ",", p.start);
+				for (float wh: p.wh)
+					res.buffer.append_formatted(",{:.0f}", wh);
+				res.buffer.append("]");
+				first = false;
+			}
+		};
+		if (name == "days")
+			append_rollup(counters.days);
+		else if (name == "months")
+			append_rollup(counters.months);
+		else
+			append_rollup(counters.years);
+		res.buffer.append("]}");
+		if (0 == format_to_sv(length_hdr, "{}", res.buffer.size() - start_size))
+			LogError("Failed to write header length");
+	};
+	const auto post_what_if = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		// body are "key value" lines as for the usb set command, the replay result is polled with GET /what_if
+		bool started = what_if::Default().request(req.body);
+		res.res_set_status_line(HTTP_VERSION, started ? STATUS_OK: STATUS_BAD_REQUEST);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Length", "0");
+		res.res_write_body();
+	};
+	const auto get_what_if = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		constexpr std::string_view STATES[]{"idle", "running", "done", "failed"};
+		what_if &w = what_if::Default();
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", "application/json");
+		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
+		res.res_write_body(); // add header end sequence
+		int start_size = res.buffer.size();
+		const auto append_kpis = [&res](std::string_view name, const what_if::kpis &k) {
+			res.buffer.append_formatted(R"(,"{}":{{"import_wh":{:.0f},"export_wh":{:.0f},"charge_wh":{:.0f},"discharge_wh":{:.0f}}})",
+				name, k.import_wh, k.export_wh, k.charge_wh, k.discharge_wh);
+		};
+		scoped_lock lock{w.m};
+		res.buffer.append_formatted(R"({{"state":"{}","minutes":{},"minutes_done":{},"minutes_valid":{})",
+			STATES[int(w.cur_state.load())], int(what_if::MINUTES), w.minutes_done, w.minutes_valid);
+		append_kpis("recorded", w.recorded);
+		append_kpis("current", w.current);
+		append_kpis("proposed", w.changed);
+		res.buffer.append(R"(,"capacity_wh":[)");
+		for (int i: range(w.capacity_wh.size()))
+			res.buffer.append_formatted("{}{:.0f}", i ? ",": "", w.capacity_wh[i]);
+		res.buffer.append_formatted(R"(],"error":"{}"}})", w.error ? w.error: "");
+		if (0 == format_to_sv(length_hdr, "{}", res.buffer.size() - start_size))
+			LogError("Failed to write header length");
+	};
+	// streams a history series straight from psram, sized only by the range:
+	// /history?series=NAME&id=N&res=second|10s|minute|15min|hour|day&from=EPOCH_S&to=EPOCH_S&format=csv|bin
+	// with the name of a registered series, id defaults to the first device (keyed series) or slot 0.
+	// csv has a header line and rows "time,mean,min,max,n", bin an 8 byte header ("EMMH", version 1, series handle,
+	// resolution, 0) followed by packed little endian records {u32 time, f32 mean, f32 min, f32 max, u16 n}
+	const auto get_history = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		constexpr std::array<std::string_view, int(hd::resolution::COUNT)> RESOLUTIONS{"second", "10s", "minute", "15min", "hour", "day"};
+		const auto index_of = [](const auto &names, std::string_view name, int fallback) {
+			if (name.empty())
+				return fallback;
+			auto i = std::ranges::find(names, name);
+			return i == names.end() ? -1: int(i - names.begin());
+		};
+		const auto number = [&req](std::string_view key, uint32_t fallback) -> std::optional<uint32_t> {
+			std::string_view v = query_value(req.path, key);
+			if (v.empty())
+				return fallback;
+			uint32_t n{};
+			if (std::from_chars(v.data(), v.data() + v.size(), n).ptr != v.data() + v.size())
+				return {};
+			return n;
+		};
+		std::string_view name = query_value(req.path, "series");
+		int handle = hd::find_series(name.empty() ? "meter": name);
+		int resolution = index_of(RESOLUTIONS, query_value(req.path, "res"), int(hd::resolution::MINUTE));
+		std::string_view format = query_value(req.path, "format");
+		std::optional<uint32_t> id = number("id", 0), from = number("from", 0), to = number("to", UINT32_MAX);
+		const bool csv = format.empty() || format == "csv";
+		const auto fail = [&res](std::string_view status) {
+			res.res_set_status_line(HTTP_VERSION, status);
+			res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+			res.res_add_header("Content-Length", "0");
+			res.res_write_body();
+		};
+		if (handle >= 0 && id && *id == 0 && g::history_series[handle].config.keyed) {
+			int first{};
+			hd::device_ids(handle, std::span{&first, 1});
+			id = first;
+		}
+		if (handle < 0 || resolution < 0 || !id || !from || !to || *from >= *to || (!csv && format != "bin")) {
+			fail(STATUS_BAD_REQUEST);
+			return;
+		}
+		const hd::series_id series{handle, int(*id)};
+		if (hd::read(series, hd::resolution(resolution), 0, 0, {}) < 0) {
+			fail(STATUS_NOT_FOUND);
+			return;
+		}
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", csv ? "text/csv": "application/octet-stream");
+		res.res_add_header("Connection", "close");
+		res.res_write_body(); // add header end sequence
+		if (csv)
+			res.buffer.append("time,mean,min,max,n\n");
+		else
+			res.buffer.append(std::string_view{std::array<char, 8>{'E', 'M', 'M', 'H', 1, char(handle), char(resolution), 0}.data(), 8});
+		// the chunks are read from where the previous one ended, each at most a tcp send buffer
+		res.stream_body = [series, resolution, csv, cursor = *from, t_end = *to] (decltype(res.buffer) &chunk, int max_size) mutable {
+			constexpr int CSV_ROW{72}, BIN_ROW{18}; // upper bounds of a row
+			static std::array<t::data_bucket, 64> buckets{};
+			int count = std::min(max_size / (csv ? CSV_ROW: BIN_ROW), int(buckets.size()));
+			int n = hd::read(series, hd::resolution(resolution), cursor, t_end, std::span{buckets.data(), size_t(count)});
+			if (n < 0)
+				return true; // the writer held the series, the same chunk is read again with the next acknowledge or poll
+			for (int i: range(n)) {
+				const t::data_bucket &b = buckets[i];
+				if (csv) {
+					chunk.append_formatted("{},{},{},{},{}\n", b.time, b.data, b.min, b.max, b.n);
+					continue;
+				}
+				std::array<char, BIN_ROW> row{};
+				std::memcpy(row.data(), &b.time, 4);
+				std::memcpy(row.data() + 4, &b.data, 4);
+				std::memcpy(row.data() + 8, &b.min, 4);
+				std::memcpy(row.data() + 12, &b.max, 4);
+				std::memcpy(row.data() + 16, &b.n, 2);
+				chunk.append(std::string_view{row.data(), row.size()});
+			}
+			if (n > 0)
+				cursor = buckets[n - 1].time + 1;
+			return n == count && cursor < t_end;
+		};
+	};
+	const auto get_control_timing = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		static control_timing::stats st{};
+		if (!control_timing::Default().published.read(st)) {
+			res.res_set_status_line(HTTP_VERSION, STATUS_INTERNAL_SERVER_ERROR);
+			res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+			res.res_add_header("Content-Length", "0");
+			res.res_write_body();
+			return;
+		}
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", "application/json");
+		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
+		res.res_write_body(); // add header end sequence
+		int start_size = res.buffer.size();
+		const uint32_t n = std::max(st.cycles, uint32_t(1));
+		const auto append_duration = [&res, n](std::string_view name, const control_timing::duration_stats &d) {
+			res.buffer.append_formatted(R"("{}":{{"last_us":{},"mean_us":{},"max_us":{}}})", name, d.last_us, d.total_us / n, d.max_us);
+		};
+		res.buffer.append_formatted(R"({{"period_ms":{},"cycles":{},"overruns":{},"missed_periods":{},"jitter":{{"last_us":{},"mean_us":{},"max_us":{}}},)",
+			control_timing::PERIOD_MS, st.cycles, st.overruns, st.missed_periods, st.last_jitter_us, st.total_jitter_us / n, st.max_jitter_us);
+		append_duration("cycle", st.cycle);
+		res.buffer.append(R"(,"phases":{)");
+		for (int p: range(int(control_timing::PHASE_COUNT))) {
+			if (p)
+				res.buffer.append(",");
+			append_duration(control_timing::PHASE_NAMES[p], st.phases[p]);
+		}
+		res.buffer.append(R"(},"history":{)");
+		const static_vector<hd::contention_stats, MAX_HISTORY_SERIES> contention = hd::contention();
+		for (int i: range(contention.size())) {
+			if (i)
+				res.buffer.append(",");
+			const hd::contention_stats &c = contention[i];
+			res.buffer.append_formatted(R"("{}":{{"lock_waits":{},"read_retries":{},"read_failures":{}}})", c.name, c.lock_waits, c.read_retries, c.read_failures);
+		}
+		res.buffer.append("}}");
+		if (0 == format_to_sv(length_hdr, "{}", res.buffer.size() - start_size))
+			LogError("Failed to write header length");
+	};
 	static tcp_server_typed webserver{
 		.port = 80,
 		.default_endpoint_cb = static_page_callback(_404_HTML, STATUS_NOT_FOUND),
@@ -209,6 +557,15 @@ tcp_server_typed& Webserver() {
 			tcp_server_typed::endpoint{{.path_match = true}, "/user", get_user},
 			// time endpoint
 			tcp_server_typed::endpoint{{.path_match = true}, "/time", get_time},
+			// control loop trace
+			tcp_server_typed::endpoint{{.path_match = true}, "/trace", get_trace},
+			tcp_server_typed::endpoint{{.path_match = true}, "/power_flow", get_power_flow},
+			tcp_server_typed::endpoint{{.path_match = true}, "/energy_profile", get_energy_profile},
+			tcp_server_typed::endpoint{{.path_match = true}, "/energy", get_energy},
+			tcp_server_typed::endpoint{{.path_match = false}, "/energy/", get_energy_rollup},
+			tcp_server_typed::endpoint{{.path_match = true}, "/what_if", get_what_if},
+			tcp_server_typed::endpoint{{.path_match = true}, "/control_timing", get_control_timing},
+			tcp_server_typed::endpoint{{.path_match = false}, "/history", get_history},
 			// static file serve endpoints
 			tcp_server_typed::endpoint{{.path_match = true}, "/", static_page_callback(INDEX_HTML, STATUS_OK)},
 			tcp_server_typed::endpoint{{.path_match = true}, "/index.html", static_page_callback(INDEX_HTML, STATUS_OK)},
@@ -223,10 +580,12 @@ tcp_server_typed& Webserver() {
 			tcp_server_typed::endpoint{{.path_match = true}, "/ap_active", set_ap_active},
 			tcp_server_typed::endpoint{{.path_match = true}, "/wifi_connect", connect_to_wifi},
 			tcp_server_typed::endpoint{{.path_match = true}, "/login", post_login},
+			tcp_server_typed::endpoint{{.path_match = true}, "/what_if", post_what_if},
 		},
 		.put_endpoints = {
 			tcp_server_typed::endpoint{{.path_match = true}, "/set_password", set_password},
 			tcp_server_typed::endpoint{{.path_match = true}, "/time", set_time},
+			tcp_server_typed::endpoint{{.path_match = true}, "/trace", set_trace},
 		}
 	};
 	return webserver;
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <string_view>
+
+#include "emm.h"
+#include "mutex.h"
+
+/**
+ * @brief Replays the per minute history of the last 24 hours through sandboxed emms to estimate how changed settings
+ * would have performed. One emm runs with the current and one with the proposed settings on the same simulated plant,
+ * so the difference between both is not biased by the simplifications of the plant (instant inverters, home power
+ * split evenly over the phases, battery capacity estimated from the recorded soc).
+ * The replay runs in a low priority task which reads the history minute by minute (the per minute history keeps more
+ * than the replayed window), the kpis are updated after each simulated minute and can be polled while the replay is running.
+ */
+struct what_if {
+	static constexpr int MINUTES{24 * 60};
+	static constexpr int STEPS_PER_MINUTE{60};	// the emm runs each second like in the control loop, the minute values are held
+	static constexpr float DEFAULT_CAPACITY_WH{10000}; // if the capacity can not be estimated from the history
+	enum struct state: uint8_t { IDLE, RUNNING, DONE, FAILED };
+	struct kpis {
+		double import_wh{};
+		double export_wh{};
+		double charge_wh{};
+		double discharge_wh{};
+	};
+
+	std::atomic<bool> requested{};
+	std::atomic<state> cur_state{state::IDLE};
+	settings proposed{};	// only written while no replay is requested or running
+	// progress and results, guarded by m
+	mutex m{};
+	int minutes_done{};
+	int minutes_valid{};	// minutes with complete history, only those are counted in the kpis
+	kpis recorded{};	// from the history
+	kpis current{};		// simulated with the current settings
+	kpis changed{};		// simulated with the proposed settings
+	static_vector<float, MAX_INVERTERS> capacity_wh{}; // 0 if the default capacity was used
+	const char *error{};
+
+	static what_if& Default() {
+		static what_if w{};
+		return w;
+	}
+	// changes are "key value" lines in the syntax of the usb set command applied on top of the current settings.
+	// Returns false if a replay is already running or a line could not be parsed
+	bool request(std::string_view changes);
+	// runs a requested replay, called periodically from the what if task
+	void run();
+};
+
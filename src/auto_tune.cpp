@@ -0,0 +1,113 @@
+#include "auto_tune.h"
+#include "ranges_util.h"
+
+#include <algorithm>
+#include <cmath>
+
+// interpolated time in cycles at which the normalized response y first reaches level, -1 if never
+static float crossing(std::span<const float> y, float level) {
+	for (int k: range(y.size())) {
+		if (y[k] < level)
+			continue;
+		if (k == 0)
+			return 0;
+		return k - 1 + (level - y[k - 1]) / std::max(y[k] - y[k - 1], 1e-3f);
+	}
+	return -1;
+}
+
+bool auto_tune::update(std::span<const InverterGroup> inverter_groups, std::span<ControlPowerInfo> control_infos, float home_w) {
+	const auto fail = [this](const char *e) {
+		error = e;
+		cur_state = state::FAILED;
+		return true;
+	};
+
+	int req = requested_inverter.exchange(-1);
+	if (req >= 0 && !running()) {
+		if (req >= int(control_infos.size()) || !control_infos[req].is_active())
+			return fail("Wechselrichter nicht verbunden");
+		const InverterGroup &ig = inverter_groups[req];
+		const ControlPowerInfo &c = control_infos[req];
+		// step into the direction with more headroom, the emm request stays the operating point
+		float up = max_exp_pow_avail(ig, c) - c.requested_power;
+		float down = c.requested_power + max_imp_pow_avail(ig, c);
+		step_w = up >= down ? std::min(up, MAX_STEP_W): -std::min(down, MAX_STEP_W);
+		if (std::abs(step_w) < 100)
+			return fail("Keine Leistungsreserve für den Sprung");
+		inverter = req;
+		base_request = c.requested_power;
+		cycle = 0;
+		error = nullptr;
+		cur_state = state::SETTLE;
+	}
+	if (!running())
+		return false;
+	if (inverter >= int(control_infos.size()) || !control_infos[inverter].is_active())
+		return fail("Verbindung verloren");
+
+	ControlPowerInfo &c = control_infos[inverter];
+	float inverter_w = inverter_groups[inverter].inverter.exp_w - inverter_groups[inverter].inverter.imp_w;
+	// the samples of a cycle are read before the request of that cycle is sent,
+	// so sample k is the response after the step was active for k cycles
+	switch (cur_state) {
+	case state::SETTLE:
+		c.requested_power = base_request;
+		if (++cycle < SETTLE_CYCLES)
+			break;
+		inverter_base_w = inverter_w;
+		home_base_w = home_w;
+		cycle = 0;
+		cur_state = state::STEP_UP;
+		[[fallthrough]];
+	case state::STEP_UP:
+		up_inverter_w[cycle] = inverter_w;
+		up_home_w[cycle] = home_w;
+		c.requested_power = base_request + step_w;
+		if (++cycle < STEP_CYCLES)
+			break;
+		cycle = 0;
+		cur_state = state::STEP_DOWN;
+		break;
+	case state::STEP_DOWN:
+		down_inverter_w[cycle] = inverter_w;
+		down_home_w[cycle] = home_w;
+		c.requested_power = base_request;
+		if (++cycle < STEP_CYCLES)
+			break;
+		c.requested_power = base_request;
+		{
+			// normalized responses, 0 is the level before and 1 the level after the step
+			float top_w = (up_inverter_w[STEP_CYCLES - 1] + up_inverter_w[STEP_CYCLES - 2] + up_inverter_w[STEP_CYCLES - 3]) / 3;
+			if ((top_w - inverter_base_w) / step_w < .5f)
+				return fail("Wechselrichter folgt dem Sprung nicht");
+			std::array<float, STEP_CYCLES> y_up, y_down;
+			for (int k: range(STEP_CYCLES)) {
+				y_up[k] = (up_inverter_w[k] - inverter_base_w) / (top_w - inverter_base_w);
+				y_down[k] = (top_w - down_inverter_w[k]) / (top_w - inverter_base_w);
+			}
+			float l_up = crossing(y_up, .1f), t_up = crossing(y_up, .63f);
+			float l_down = crossing(y_down, .1f), t_down = crossing(y_down, .63f);
+			if (l_up < 0 || t_up < 0 || l_down < 0 || t_down < 0)
+				return fail("Sprungantwort nicht auswertbar");
+			dead_time_s = (l_up + l_down) / 2 * CYCLE_S;
+			time_constant_s = std::max((t_up - l_up + t_down - l_down) / 2, 0.f) * CYCLE_S;
+			disturbance = 0;
+			for (int k: range(STEP_CYCLES))
+				disturbance = std::max({disturbance, std::abs(up_home_w[k] - home_base_w), std::abs(down_home_w[k] - home_base_w)});
+			disturbance = std::min(disturbance / std::abs(step_w), 1.f);
+
+			// the filter only has to cover the home power disturbance while an inverter changes its power
+			float filter_s = disturbance * (dead_time_s + time_constant_s);
+			filter_alpha = std::clamp(filter_s / (filter_s + CYCLE_S), 0.f, .9f);
+			// the lead compensates the inverter time constant, it can not look past the dead time though
+			loop_gain = std::clamp(time_constant_s / (CYCLE_S + dead_time_s), 0.f, 2.f);
+		}
+		cur_state = state::DONE;
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
+
@@ -6,6 +6,7 @@
 #include "settings.h"
 #include "wifi_storage.h"
 #include "history_data.h"
+#include "energy_counters.h"
 
 #define RECTE(x, y, width, height, e) Line{{x,y}, {x + width, y}}, \
 				  Line{{x + width,y}, {x + width, y + height + e}}, \
@@ -203,140 +204,91 @@ constexpr int X_INV_CONN = 80;
 constexpr int BUBBLE_SPAWN_MS = 1000;
 static const Rect IG_VIEW_BOX = {0, 40, X_INV_CONN + 2, 200};
 static const Rect BUBBLE_VIEW_BOX = {0, 40, 240, 200};
-void OverviewPage::draw(Draw &draw, TimeInfo time_info, float x_off, 
-	   std::span<InverterGroup> inverter_groups, PowerInfo home, PowerInfo meter) {
+void OverviewPage::draw(Draw &draw, TimeInfo time_info, float x_off, const PowerFlow &flow) {
+	const auto &inverter_groups = flow.inverter_groups;
+	const PowerInfo &home = flow.home;
+	const PowerInfo &meter = flow.meter;
 	y_offset = .8 * y_offset + .2 * target_y_offset;
 
-	// integrate power and generate new dots
+	// integrate the dc and grid flows and generate new dots
 	d_last_spawn_ms += time_info.delta_ms;
 	bool spawn_bubbles = d_last_spawn_ms > BUBBLE_SPAWN_MS;
 	if (spawn_bubbles)
 		d_last_spawn_ms -= BUBBLE_SPAWN_MS;
 	float ds = time_info.delta_ms / 1000.f;
 
-
-	tot_imp_wh += meter.imp_w * ds / 60 / 60;
-	tot_exp_wh += meter.exp_w * ds / 60 / 60;
-	home_energy_info.imp_ws += home.imp_w * ds;
-	home_energy_info.exp_ws += home.exp_w * ds;
-	meter_energy_info.imp_ws += meter.exp_w * ds; // is swapped on purpose
-	meter_energy_info.exp_ws += meter.imp_w * ds;
-	if (spawn_bubbles && meter_energy_info.imp_ws > 5) {
-		energy_blobs.push({.energy = meter_energy_info.imp_ws, .x = X_METER, .y = Y_METER, .end_device_id = GRID_ID, .col = COL_METER, .dir = Direction::DOWN});
-	}
-	if (spawn_bubbles && meter_energy_info.exp_ws > 5) {
-		energy_blobs.push({.energy = meter_energy_info.exp_ws, .x = X_GRID, .y = Y_GRID, .end_device_id = METER_ID, .col = COL_POLE, .dir = Direction::UP});
+	const int nodes = flow.nodes();
+	grid_imp_ws += meter.imp_w * ds;
+	grid_exp_ws += meter.exp_w * ds;
+	dc_ws.resize(flow.dc.size());
+	for (int i: range(flow.dc.size())) {
+		dc_ws[i].pv_w += flow.dc[i].pv_w * ds;
+		dc_ws[i].discharge_w += flow.dc[i].discharge_w * ds;
+		dc_ws[i].charge_w += flow.dc[i].charge_w * ds;
 	}
-	const auto generate_bubbles = [&] (EnergyInfo &ei, float x_start, float y_start, uint16_t col) {
-		// first distribute to meter and home, then to a inverter
-		float rest = ei.exp_ws;
-		ei.exp_ws = 0;
-		float cur_e = std::min(rest, home_energy_info.imp_ws);
-		if (cur_e > 5) {
-			rest -= cur_e;
-			home_energy_info.imp_ws -= cur_e;
-			energy_blobs.push({.energy = cur_e, .x = x_start - 1, .y = y_start, .end_device_id = HOME_ID, .col = col, .dir = Direction::LEFT});
+	if (spawn_bubbles) {
+		if (grid_exp_ws > 5) {
+			energy_blobs.push({.energy = grid_exp_ws, .x = X_METER, .y = Y_METER, .end_device_id = GRID_ID, .col = COL_METER, .dir = Direction::DOWN});
+			grid_exp_ws = 0;
 		}
-		cur_e = std::min(rest, meter_energy_info.imp_ws);
-		if (cur_e > 5) {
-			rest -= cur_e;
-			meter_energy_info.imp_ws -= cur_e;
-			energy_blobs.push({.energy = cur_e, .x = x_start - 1, .y = y_start, .end_device_id = METER_ID, .col = col, .dir = Direction::LEFT});
+		if (grid_imp_ws > 5) {
+			energy_blobs.push({.energy = grid_imp_ws, .x = X_GRID, .y = Y_GRID, .end_device_id = METER_ID, .col = COL_POLE, .dir = Direction::UP});
+			grid_imp_ws = 0;
 		}
-		for (EnergyInfo &ei: energy_infos) {
-			if (!ei.is_inverter)
-				continue;
-			if (rest <= 5)
-				return;
-			cur_e = std::min(rest, ei.imp_ws);
-			if (cur_e <= 5)
-				continue;
-			rest -= cur_e;
-			ei.imp_ws -= cur_e;
-			energy_blobs.push({.energy = cur_e, .x = x_start - 1, .y = y_start, .end_device_id = ei.device_id, .col = col, .dir = Direction::LEFT});
+		float y_base_f = Y_BUS + inverter_groups.size() * IG_HEIGHT / 2.;
+		for (int i: range(dc_ws.size())) {
+			const InverterGroup &ig = inverter_groups[i];
+			DcFlow &e = dc_ws[i];
+			if (e.pv_w > 5) {
+				energy_blobs.push({.energy = e.pv_w, .x = X_PV + 1, .y = y_base_f + Y_PV_OFF, .end_device_id = ig.inverter.device_id, .col = COL_PV, .dir = Direction::RIGHT});
+				e.pv_w = 0;
+			}
+			if (e.discharge_w > 5) {
+				energy_blobs.push({.energy = e.discharge_w, .x = X_BATTERY + 1, .y = y_base_f + Y_BATTERY_OFF, .end_device_id = ig.inverter.device_id, .col = COL_BATTERY, .dir = Direction::RIGHT});
+				e.discharge_w = 0;
+			}
+			if (e.charge_w > 5) {
+				energy_blobs.push({.energy = e.charge_w, .x = X_INVERTER, .y = y_base_f + Y_INVERTER_OFF + 1, .end_device_id = ig.battery.device_id, .col = COL_INVERTER, .dir = Direction::DOWN});
+				e.charge_w = 0;
+			}
+			y_base_f -= IG_HEIGHT;
 		}
-	};
-	if (spawn_bubbles) {
-		generate_bubbles(meter_energy_info, X_METER, Y_METER, COL_METER);
-		generate_bubbles(home_energy_info, X_HOME, Y_HOME, COL_HOME);
 	}
 
-	const auto integrate_power = [&] (const PowerInfo &pi, bool is_inverter = false) -> EnergyInfo* {
-		if (pi.device_id == -1)
-			return {};
-		EnergyInfo *ei = energy_infos | find{&EnergyInfo::device_id, pi.device_id};
-		if (!ei) {
-			ei = energy_infos.push();
-			if (!ei) {
-				LogError("Could not allocate new energy info");
-				return {};
-			}
-			*ei = {.device_id = pi.device_id, .is_inverter = is_inverter};
-		}
-		ei->imp_ws += pi.imp_w * ds;
-		ei->exp_ws += pi.exp_w * ds;
-		return ei;
-	};
-	{
-		float y_base_f = Y_BUS + inverter_groups.size() * IG_HEIGHT / 2.;
+	// the bus energy is attributed per control cycle, each new cycle spawns its dots
+	if (flow.time_ms != spawned_flow_ms) {
+		spawned_flow_ms = flow.time_ms;
 		int bubble_off = 1;
-		for (InverterGroup &ig: inverter_groups) {
-			EnergyInfo *e_inverter = integrate_power(ig.inverter, true);
-			EnergyInfo *e_pv = integrate_power(ig.pv);
-			EnergyInfo *e_battery = integrate_power(ig.battery);
-			if (spawn_bubbles) {
-				if (e_pv && e_pv->exp_ws > 5) {
-					energy_blobs.push({.energy = e_pv->exp_ws, .x = X_PV + 1, .y = y_base_f + Y_PV_OFF, .end_device_id = ig.inverter.device_id, .col = COL_PV, .dir = Direction::RIGHT});
-					e_pv->exp_ws = e_pv->imp_ws = 0;
-				}
-				if (e_battery && e_battery->exp_ws > 5) {
-					energy_blobs.push({.energy = e_battery->exp_ws, .x = X_BATTERY + 1, .y = y_base_f + Y_BATTERY_OFF, .end_device_id = ig.inverter.device_id, .col = COL_BATTERY, .dir = Direction::RIGHT});
-					e_battery->exp_ws = 0;
-				}
-				if (e_battery && e_battery->imp_ws > 5) {
-					energy_blobs.push({.energy = e_battery->imp_ws, .x = X_INVERTER, .y = y_base_f + Y_INVERTER_OFF + 1, .end_device_id = ig.battery.device_id, .col = COL_INVERTER, .dir = Direction::DOWN});
-					e_battery->imp_ws = 0;
-				}
-				// inverter has to match for another sink in the main loop
-				// 1. Search for other inverter which has imported stuff
-				// 2. Search home for import, search smart meter for export
-				if (e_inverter && e_inverter->exp_ws > 5) {
-					float x = X_INVERTER;
-					float y = y_base_f + Y_INVERTER_OFF;
-					float rest = e_inverter->exp_ws;
-					e_inverter->exp_ws = 0;
-					for (auto cur = energy_infos.begin(); rest > 5 && cur < energy_infos.end(); ++cur) {
-						if (!cur->is_inverter)
-							continue;
-						if (cur->imp_ws <= 5)
-							continue;
-						float cur_e = std::min(rest, cur->imp_ws);
-						rest -= cur_e;
-						cur->imp_ws -= cur_e;
-						energy_blobs.push({.energy = cur_e, .x = x + bubble_off, .y = y, .end_device_id = cur->device_id, .col = COL_INVERTER, .dir = Direction::RIGHT});
-					}
-					float cur_e = std::min(rest, home_energy_info.imp_ws);
-					if (cur_e > 5) {
-						rest -= cur_e;
-						home_energy_info.imp_ws -= cur_e;
-						energy_blobs.push({.energy = cur_e, .x = x + bubble_off, .y = y, .end_device_id = HOME_ID, .col = COL_INVERTER, .dir = Direction::RIGHT});
-					}
-					cur_e = std::min(rest, meter_energy_info.imp_ws);
-					if (cur_e > 5) {
-						rest -= cur_e;
-						meter_energy_info.imp_ws -= cur_e;
-						energy_blobs.push({.energy = cur_e, .x = x + bubble_off, .y = y, .end_device_id = METER_ID, .col = COL_INVERTER, .dir = Direction::RIGHT});
-					}
-					if (rest > 100)
-						LogWarning("Still got some juice: {}", rest);
-					bubble_off += 2;
-				}
+		for (int s: range(nodes)) {
+			EnergyBlobInfo start{.col = COL_METER, .dir = Direction::LEFT};
+			if (s == BUS_GRID) {
+				start.x = X_METER - 1;
+				start.y = Y_METER;
+			} else if (s == BUS_HOME) {
+				start.x = X_HOME - 1;
+				start.y = Y_HOME;
+				start.col = COL_HOME;
+			} else {
+				start.x = X_INVERTER + bubble_off;
+				start.y = Y_BUS + inverter_groups.size() * IG_HEIGHT / 2. - (s - bus_inverter(0)) * IG_HEIGHT + Y_INVERTER_OFF;
+				start.col = COL_INVERTER;
+				start.dir = Direction::RIGHT;
 			}
-			y_base_f -= IG_HEIGHT;
+			bool spawned{};
+			for (int d: range(nodes)) {
+				float ws = flow.bus_wh(s, d) * 3600;
+				if (ws <= 5)
+					continue;
+				EnergyBlobInfo blob = start;
+				blob.energy = ws;
+				blob.end_device_id = flow.device_id(d);
+				energy_blobs.push(blob);
+				spawned = true;
+			}
+			if (spawned && s >= bus_inverter(0))
+				bubble_off += 2;
 		}
 	}
-	if (spawn_bubbles)
-		meter_energy_info.imp_ws = 0;
 
 	// advancing energy dots
 	constexpr float SPEED = .03; // in pixels per miliseconds
@@ -476,10 +428,11 @@ void OverviewPage::draw(Draw &draw, TimeInfo time_info, float x_off,
 	    x_offset + 239 <= 0)
 		return;
 
-	// energy counts
-	std::string_view power = static_format<64>("Importzähler: {:.1f}Wh", tot_imp_wh);
+	// energy of today
+	const energy_counters_data::running today = energy_counters::Default().today();
+	std::string_view power = static_format<64>("Import heute: {:.2f}kWh", today.wh[energy_counters_data::GRID_IMPORT] / 1000);
 	draw.text(power.data(), {100 + x_offset, 40}, 80, 1);
-	power = static_format<64>("Exportzähler: {:.1f}Wh", tot_exp_wh);
+	power = static_format<64>("Export heute: {:.2f}kWh", today.wh[energy_counters_data::GRID_EXPORT] / 1000);
 	draw.text(power.data(), {170 + x_offset, 40}, 80, 1);
 
 	// draw paths
@@ -586,56 +539,43 @@ bool OverviewPage::handle_touch_input(TouchInfo &touch_info, int x_offset) {
 struct MinMax { float min, max; };
 struct UnitInfo {std::string_view name; MinMax bounds;};
 static const Rect PLOT_RECT{10, 60, 220, 170};
-template <int N>
-void draw_data(Draw &draw, const static_ring_buffer<t::data_time, N> &data, MinMax m, float x_offset, int x_page_offset) {
+// draws the buckets of [t_begin, t_end) over the plot width from the finest level with at most a bucket per pixel,
+// aggregated buckets additionally get their min max envelope drawn lighter behind the mean.
+// Gaps in the history interrupt the curve. Returns the level that was drawn
+static hd::resolution draw_data(Draw &draw, hd::series_id series, uint32_t t_begin, uint32_t t_end, MinMax m, int x_page_offset, RGB col) {
+	static std::array<t::data_bucket, 448> buckets{}; // 2 * PLOT_RECT.w, room for a gap marker after each bucket
+	hd::query_result q = hd::query(series, t_begin, t_end, buckets, PLOT_RECT.w);
+	std::span<const t::data_bucket> points{buckets.data(), size_t(q.count)};
 	float d = m.max - m.min;
 	m.min -= d * .125;
 	m.max += d * .125;
 	d = m.max - m.min;
-	std::optional<float> prev{};
-	for (int i: range(PLOT_RECT.w)) {
-		int j = x_offset - (i + 1);
-		if (j >= 0)
-			continue;
-		t::data_time cur = data[j];
-		if (prev) {
-			int x_start = -i + PLOT_RECT.w + PLOT_RECT.x;
-			int x_end = x_start - 1;
-			int y_start = int((1. - (*prev - m.min) / d) * PLOT_RECT.h + PLOT_RECT.y);
-			int y_end = int((1. - (cur.data - m.min) / d) * PLOT_RECT.h + PLOT_RECT.y);
-			draw.line({x_start + x_page_offset, y_start}, {x_end + x_page_offset, y_end});
-		}
-		prev = cur.data;
-	}
-};
+	const auto x = [&](uint32_t time) { return int(PLOT_RECT.x + x_page_offset + int64_t(time - t_begin) * PLOT_RECT.w / (t_end - t_begin)); };
+	const auto y = [&](float v) { return int((1. - (v - m.min) / d) * PLOT_RECT.h + PLOT_RECT.y); };
+	if (q.res != hd::resolution::SECOND) {
+		draw.set_pen(RGB((col.r + 2 * 255) / 3, (col.g + 2 * 255) / 3, (col.b + 2 * 255) / 3).to_rgb565());
+		for (const t::data_bucket &b: points)
+			if (b.n)
+				draw.line({x(b.time), y(b.max)}, {x(b.time), y(b.min) + 1});
+	}
+	draw.set_pen(col.to_rgb565());
+	for (int i = 1; i < int(points.size()); ++i)
+		if (points[i - 1].n && points[i].n)
+			draw.line({x(points[i - 1].time), y(points[i - 1].data)}, {x(points[i].time), y(points[i].data)});
+	return q.res;
+}
 void HistoryPage::draw(Draw &draw, TimeInfo time_info, float x_off) {
 	int x_offset = int(x_off + base_offset);
 	if (x_offset >= 239 ||
 	    x_offset + 239 <= 0)
 		return;
 
-	if (!drag_history_view)
- 		x_history_offseŧ = .65 * x_history_offseŧ; // converges to 0
-
-	// the buttons are only the selectors. The data is set in the main loop according to this->selected_history
-	if (second_button(draw, x_offset)) {
-		selected_history = SelectedHistory::SECOND;
-		for (Button *b: time_buttons)
-			b->style = ButtonStyle::DEFAULT;
-		second_button.style = ButtonStyle::BORDER;
-	}
-	if (minute_button(draw, x_offset)) {
-		selected_history = SelectedHistory::MINUTE;
-		for (Button *b: time_buttons)
-			b->style = ButtonStyle::DEFAULT;
-		minute_button.style = ButtonStyle::BORDER;
-	}
-	if (hour_button(draw, x_offset)) {
-		selected_history = SelectedHistory::HOUR;
-		for (Button *b: time_buttons)
-			b->style = ButtonStyle::DEFAULT;
-		hour_button.style = ButtonStyle::BORDER;
-	}
+	if (zoom_out_button(draw, x_offset))
+		span_idx = std::min(span_idx + 1, int(SPANS_S.size()) - 1);
+	if (zoom_in_button(draw, x_offset))
+		span_idx = std::max(span_idx - 1, 0);
+	if (now_button(draw, x_offset))
+		pan_s = 0;
 	if (net_power_button(draw, x_offset)) {
 		net_power_button.style = net_power_button.is_selected() ? ButtonStyle::DEFAULT: ButtonStyle::BORDER;
 	}
@@ -650,39 +590,29 @@ void HistoryPage::draw(Draw &draw, TimeInfo time_info, float x_off) {
 	for (const Line& l: {RECTE(PLOT_RECT.x, PLOT_RECT.y, PLOT_RECT.w, PLOT_RECT.h, 1)})
 		draw.line(l.start + offset, l.end + offset);
 
-	{ // drawing curves
-		t::locked_data<t::device_data> meter = g::meter_data.access();
-		t::locked_data<std::array<t::id_data, MAX_INVERTERS * 2>> inverter = g::inverter_data.access();
-		t::locked_data<std::array<t::id_data, MAX_INVERTERS>> soc = g::soc_data.access();
+	{ // drawing curves, the newest meter sample is the right end of the plot
+		static std::array<int, hd::MAX_SERIES_SLOTS> inverter_ids{}, soc_ids{};
+		uint32_t newest{};
+		hd::read_series({hd::series_id::METER, METER_ID}, [&](const t::device_data *data) { newest = data ? data->per_second.back().time: 0; });
+		const int inverters = hd::device_ids(hd::series_id::INVERTER, inverter_ids);
+		const int socs = hd::device_ids(hd::series_id::SOC, soc_ids);
+		constexpr std::array<std::string_view, int(hd::resolution::COUNT)> LEVEL_NAMES{"1s", "10s", "1min", "15min", "1h", "1T"};
+		const uint32_t span = SPANS_S[span_idx];
+		const uint32_t t_end = newest + 1 - std::min(uint32_t(pan_s), newest);
+		const uint32_t t_begin = t_end > span ? t_end - span: 0;
 		uint8_t r{100}, g{200}, b{};
-		const auto draw_per_x = [&](auto member) {
-			draw.set_pen(COL_METER);
-			draw_data(draw, meter.data.*member, pow_bounds, x_history_offseŧ, x_offset);
-			for (const t::id_data &id_data: inverter.data) {
-				if (id_data.device_id < 0)
-					continue;
-				draw.set_pen(r, g, b);
-				draw_data(draw, id_data.data.*member, pow_bounds, x_history_offseŧ, x_offset);
+		if (newest) {
+			hd::resolution level = draw_data(draw, {hd::series_id::METER, METER_ID}, t_begin, t_end, pow_bounds, x_offset, RGB(200, 200, 200));
+			draw.set_pen(0);
+			draw.text(static_format<32>("{} / {}", SPAN_NAMES[span_idx], LEVEL_NAMES[int(level)]), {95 + x_offset, 33}, 90, 1);
+			for (int id: std::span{inverter_ids.data(), size_t(inverters)}) {
+				draw_data(draw, {hd::series_id::INVERTER, id}, t_begin, t_end, pow_bounds, x_offset, RGB(r, g, b));
 				r += 30; g += 56; b += 111;
 			}
-			for (const t::id_data &id_data: soc.data) {
-				if (id_data.device_id < 0)
-					continue;
-				draw.set_pen(r, g, b);
-				draw_data(draw, id_data.data.*member, pow_bounds, x_history_offseŧ, x_offset);
+			for (int id: std::span{soc_ids.data(), size_t(socs)}) {
+				draw_data(draw, {hd::series_id::SOC, id}, t_begin, t_end, pow_bounds, x_offset, RGB(r, g, b));
 				r += 30; g += 56; b += 111;
 			}
-		};
-		switch (selected_history) {
-			case SelectedHistory::SECOND:
-				draw_per_x(&t::device_data::per_second);
-				break;
-			case SelectedHistory::MINUTE:
-				draw_per_x(&t::device_data::per_minute);
-				break;
-			case SelectedHistory::HOUR:
-				draw_per_x(&t::device_data::per_hour);
-				break;
 		}
 	}
 
@@ -695,7 +625,8 @@ bool HistoryPage::handle_touch_input(TouchInfo &touch_info, int x_offset) {
 		return true;
 	}
 	if (drag_history_view && touch_info.cur_touch && touch_info.last_touch) {
-		x_history_offseŧ -= touch_info.cur_touch->x - touch_info.last_touch->x;
+		// dragging moves the view by a pixel of the current span, to the right into the past
+		pan_s = std::max(pan_s + float(touch_info.cur_touch->x - touch_info.last_touch->x) * SPANS_S[span_idx] / PLOT_RECT.w, 0.f);
 		return true;
 	}
 	for (Button *b: time_buttons) {
@@ -727,10 +658,15 @@ void EmmPage::draw(Draw &draw, TimeInfo time_info, float x_off, EMM &emm, std::s
 	draw.line({105 + x_offset, 56}, {205 + x_offset, 56});
 	int x_sens = std::lerp(113., 200., emm.filter_alpha) + x_offset;
 	draw.line({x_sens, 50}, {x_sens, 63});
-	if (faster_home_adopt(draw, x_offset))
-		emm.filter_alpha = .9 * emm.filter_alpha;
-	if (stabler_home_adopt(draw, x_offset))
-		emm.filter_alpha = 1. - .9 * (1. - emm.filter_alpha);
+	// the emm takes the filter from the settings each cycle
+	if (faster_home_adopt(draw, x_offset)) {
+		settings::Default().filter_alpha = .9 * emm.filter_alpha;
+		request_settings_store = true;
+	}
+	if (stabler_home_adopt(draw, x_offset)) {
+		settings::Default().filter_alpha = 1. - .9 * (1. - emm.filter_alpha);
+		request_settings_store = true;
+	}
 
 	draw.set_pen(0);
 	std::string_view power = static_format<64>("Verbrauch geglättet: {:.1f}W", emm.home_power);
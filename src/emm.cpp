@@ -1,88 +1,297 @@
 #include "emm.h"
 #include "ranges_util.h"
+#include "fixed_point.h"
+#include <algorithm>
 #include <cmath>
+#include <ranges>
 
-static static_vector<uint8_t, MAX_INVERTERS> full_inverter;
-static static_vector<uint8_t, MAX_INVERTERS> fillable_inverter;
-static static_vector<uint8_t, MAX_INVERTERS> fill_inverter;
-static static_vector<uint8_t, MAX_INVERTERS> fillable_full_inverter;
+// inverter indices grouped by their battery state, kept per call so that sandboxed emms (see what_if.h) can run in other tasks
+struct inverter_sets {
+	static_vector<uint8_t, MAX_INVERTERS> full_inverter;
+	static_vector<uint8_t, MAX_INVERTERS> fillable_inverter;
+	static_vector<uint8_t, MAX_INVERTERS> fill_inverter;
+	static_vector<uint8_t, MAX_INVERTERS> fillable_full_inverter;
+};
 
-void EMM::update_power(float home_new, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, const settings &s) {
-	full_inverter.clear();
-	fillable_inverter.clear();
-	fill_inverter.clear();
-	fillable_full_inverter.clear();
+template<typename T> static void balance_phases(const std::array<T, PHASES> &home_phases, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, std::span<T> req, const settings &s);
+template<typename T> static void distribute_priority(const inverter_sets &sets, T needed_power, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, std::span<T> req, T priority_sum);
+template<typename T> static void distribute_min_wear(const inverter_sets &sets, T needed_power, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, std::span<T> req);
+template<typename T> static void allocate_loads(T home_power, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, std::span<LoadInfo> loads, uint32_t now_s);
+
+// max_exp_pow_avail and max_imp_pow_avail in the number type of the allocator
+template<typename T> static T exp_avail(const InverterGroup &ig, const ControlPowerInfo &c) {
+	T bat_avail = ig.bat_soc > c.min_soc ? T(c.power_max_discha): T(0);
+	return std::min(T(ig.pv.exp_w) + bat_avail, T(c.power_max));
+}
+template<typename T> static T imp_avail(const InverterGroup &ig, const ControlPowerInfo &c) {
+	return ig.bat_soc >= 99 ? T(0): std::max(T(0), T(c.power_max_cha) - T(ig.pv.exp_w));
+}
+
+void EMM::update_power(float home_new, const std::array<float, PHASES> &home_phases_new, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, const settings &s,
+		       std::span<LoadInfo> loads, uint32_t now_s) {
+	uint64_t start_us = time_us_64();
+	update_power_t<emm_number>(home_new, home_phases_new, inverter_powers, inverter_control_values, s, loads, now_s);
+	uint32_t us = time_us_64() - start_us;
+	++cost.calls;
+	cost.last_us = us;
+	cost.max_us = std::max(cost.max_us, us);
+	cost.total_us += us;
+}
+
+// all intermediate values are of type T, the in- and outputs are converted once
+template<typename T>
+void EMM::update_power_t(float home_new, const std::array<float, PHASES> &home_phases_new, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, const settings &s,
+			 std::span<LoadInfo> loads, uint32_t now_s) {
+	using std::lerp;
+	inverter_sets sets{};
+	std::array<T, MAX_INVERTERS> req_storage{};
+	std::span<T> req{req_storage.data(), inverter_powers.size()};
+	for (int i: range(inverter_powers.size()))
+		req[i] = T(inverter_control_values[i].requested_power);
 	// update approximated power
 	if (invert_home)
 		home_new = -home_new;
-	home_power = std::lerp(home_new, home_power, filter_alpha);
-	float needed_power = home_power;
+	T alpha{filter_alpha};
+	T home_power_prev{home_power};
+	T home_power_new = lerp(T(home_new), home_power_prev, alpha);
+	home_power = float(home_power_new);
+	std::array<T, PHASES> home_phase_power_new;
+	for (int p: range(PHASES)) {
+		home_phase_power_new[p] = lerp(T(invert_home ? -home_phases_new[p]: home_phases_new[p]), T(home_phase_power[p]), alpha);
+		home_phase_power[p] = float(home_phase_power_new[p]);
+	}
+	T needed_power = home_power_new + T(loop_gain) * (home_power_new - home_power_prev);
 	// collect inverter extra power they can take up
 	// eg. battery is not full and their pv does not supply full power
 	// this is needed to avoid toggeling all inverters even though 1 inverter still needs power for filling up a battery
-	float inverter_fillable_power{};
-	float priority_sum{};
+	T inverter_fillable_power{};
+	T priority_sum{};
 	for (int i: range(inverter_powers.size())) {
-		float imp_avail = max_imp_pow_avail(inverter_powers[i], inverter_control_values[i]);
-		inverter_fillable_power += imp_avail;
+		T imp = imp_avail<T>(inverter_powers[i], inverter_control_values[i]);
+		inverter_fillable_power += imp;
 		// inverters which are below the min_soc are force charged with full power -> add to home_power (which )
 		if (requires_charge(inverter_powers[i], inverter_control_values[i])) {
-			needed_power += imp_avail;
-			inverter_control_values[i].requested_power = -inverter_control_values[i].power_max_cha;
-			fill_inverter.push(i);
+			needed_power += imp;
+			req[i] = -T(inverter_control_values[i].power_max_cha);
+			sets.fill_inverter.push(i);
 		}
 		else if (inverter_powers[i].bat_soc < 98) { // only inverters which do not need to get charged can be required to export
-			fillable_inverter.push(i);
-			fillable_full_inverter.push(i);
-			priority_sum += 1.f / inverter_control_values[i].bat_priority;
+			sets.fillable_inverter.push(i);
+			sets.fillable_full_inverter.push(i);
+			priority_sum += T(1) / T(inverter_control_values[i].bat_priority);
 		} else {
-			full_inverter.push(i);
-			fillable_full_inverter.push(i);
-			priority_sum += 1.f / inverter_control_values[i].bat_priority;
+			sets.full_inverter.push(i);
+			sets.fillable_full_inverter.push(i);
+			priority_sum += T(1) / T(inverter_control_values[i].bat_priority);
 		}
 	}
 
-	// trying to distribute the needed power to all inverters according to the bat priorities
-	float remaining_power{needed_power};
-	for (int i: fillable_full_inverter) {
-		float prio = 1.f / (inverter_control_values[i].bat_priority * priority_sum);
-		inverter_control_values[i].requested_power = std::min(inverter_control_values[i].power_max, prio * remaining_power);
-		remaining_power -= inverter_powers[i].inverter.exp_w; // use the real export power to account for empty batteries
+	if (s.wear_aware)
+		distribute_min_wear(sets, needed_power, inverter_powers, inverter_control_values, req);
+	else
+		distribute_priority(sets, needed_power, inverter_powers, inverter_control_values, req, priority_sum);
+
+	// surplus goes to the controllable loads first, their consumption is part of the home power in the next cycles
+	// and is then covered by the distribution above, so only the rest ends up in the grid export below
+	allocate_loads(home_power_new, inverter_powers, inverter_control_values, loads, now_s);
+
+	// distributing overpower from full inverters (simply settings the export to max pow of inverter with a power ramp from 98 to 99 soc)
+	T remaining_export{s.max_export};
+	for (int i: sets.full_inverter) {
+		T max{inverter_control_values[i].power_max};
+		T export_power = std::clamp(lerp(T(0), max, T(inverter_powers[i].bat_soc) - T(98)), T(0), max);
+		if (export_power < T(0))
+			continue;
+		// distribute the available power evenly accross other importable inverter
+		if (export_power > T(0)) {
+			T p = std::min(export_power, inverter_fillable_power);
+			if (s.wear_aware) // only move pv which would be curtailed otherwise, never charge a battery from another one
+				p = std::min(p, std::max(T(inverter_powers[i].pv.exp_w) - req[i], T(0)));
+			export_power -= p;
+			for (int j: sets.fillable_inverter)
+				req[j] -= p / T(int(sets.fillable_inverter.size()));
+			req[i] += p;
+		}
+		// export rest to grid
+		if (export_power > T(0)) {
+			T rem = std::min(export_power, remaining_export);
+			req[i] += rem;
+			remaining_export -= rem;
+		}
+	}
+
+	balance_phases(home_phase_power_new, inverter_powers, inverter_control_values, req, s);
+	for (int i: range(inverter_powers.size()))
+		inverter_control_values[i].requested_power = float(req[i]);
+}
+// trying to distribute the needed power to all inverters according to the bat priorities
+template<typename T>
+static void distribute_priority(const inverter_sets &sets, T needed_power, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, std::span<T> req, T priority_sum) {
+	T remaining_power{needed_power};
+	for (int i: sets.fillable_full_inverter) {
+		T prio = T(1) / (T(inverter_control_values[i].bat_priority) * priority_sum);
+		req[i] = std::min(T(inverter_control_values[i].power_max), prio * remaining_power);
+		remaining_power -= T(inverter_powers[i].inverter.exp_w); // use the real export power to account for empty batteries
 	}
 
 	// distributing the rest of the needed power
-	for (int i: fillable_full_inverter) {
-		if (remaining_power <= 0)
+	for (int i: sets.fillable_full_inverter) {
+		if (remaining_power <= T(0))
 			break;
 		// if there is more power available, request more juice
-		float power_avail = max_exp_pow_avail(inverter_powers[i], inverter_control_values[i]) - inverter_control_values[i].requested_power;
+		T power_avail = exp_avail<T>(inverter_powers[i], inverter_control_values[i]) - req[i];
 		power_avail = std::min(remaining_power, power_avail);
-		if (power_avail > 0) {
+		if (power_avail > T(0)) {
 			remaining_power -= power_avail;
-			inverter_control_values[i].requested_power += power_avail;
+			req[i] += power_avail;
 		}
 	}
-	// distributing overpower from full inverters (simply settings the export to max pow of inverter with a power ramp from 98 to 99 soc)
-	float remaining_export = s.max_export;
-	for (int i: full_inverter) {
-		float max = inverter_control_values[i].power_max;
-		float export_power = std::clamp(std::lerp(0.f, max, inverter_powers[i].bat_soc - 98.f), 0.f, max);
-		if (export_power < 0)
+}
+
+// distributes the needed power with the least battery throughput: every inverter first passes its own pv through,
+// a deficit is then discharged from as few batteries as possible starting with the fullest one and a surplus is
+// charged into the emptiest batteries first. No battery is discharged while another one is charged.
+template<typename T>
+static void distribute_min_wear(const inverter_sets &sets, T needed_power, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, std::span<T> req) {
+	static_vector<uint8_t, MAX_INVERTERS> order = sets.fillable_full_inverter;
+	T remaining_power{needed_power};
+	for (int i: order) {
+		req[i] = std::min(T(inverter_powers[i].pv.exp_w), T(inverter_control_values[i].power_max));
+		remaining_power -= req[i];
+	}
+	const auto by_soc = [&](uint8_t a, uint8_t b) { return inverter_powers[a].bat_soc > inverter_powers[b].bat_soc; };
+	std::sort(order.begin(), order.end(), by_soc);
+	if (remaining_power > T(0)) {
+		for (int i: order) {
+			const ControlPowerInfo &c = inverter_control_values[i];
+			if (inverter_powers[i].bat_soc < c.min_soc + EMM::WEAR_MIN_SOC_MARGIN) // would be force charged right after
+				continue;
+			T d = std::clamp(exp_avail<T>(inverter_powers[i], c) - req[i], T(0), remaining_power);
+			req[i] += d;
+			remaining_power -= d;
+		}
+	} else {
+		for (int i: order | std::views::reverse) {
+			// lowest request is charging with full power, partly from the ac side if the own pv is too small
+			T d = std::clamp(req[i] + imp_avail<T>(inverter_powers[i], inverter_control_values[i]), T(0), -remaining_power);
+			req[i] -= d;
+			remaining_power += d;
+		}
+	}
+}
+
+// sets the requested power of the loads in order of their index (lower index has higher priority).
+// The surplus is the pv power (plus the export ramp of full batteries, which covers curtailed pv) minus the home
+// consumption without the loads and minus what the not yet full batteries can still take
+template<typename T>
+static void allocate_loads(T home_power, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, std::span<LoadInfo> loads, uint32_t now_s) {
+	using std::lerp, std::floor;
+	if (loads.empty())
+		return;
+	T surplus = -home_power;
+	for (const LoadInfo &l: loads)
+		surplus += T(l.power.imp_w) - T(l.power.exp_w);
+	for (int i: range(inverter_powers.size())) {
+		const InverterGroup &ig = inverter_powers[i];
+		const ControlPowerInfo &c = inverter_control_values[i];
+		// batteries absorb up to 97 %, in between the ramps make the surplus continuous in the soc
+		T cha{c.power_max_cha}, discha{c.power_max_discha}, soc{ig.bat_soc};
+		T bat_w = ig.bat_soc >= 98 ? std::clamp(lerp(T(0), discha, soc - T(98)), T(0), discha):
+					     std::clamp(lerp(-cha, T(0), soc - T(97)), -cha, T(0));
+		surplus += std::min(T(ig.pv.exp_w) + bat_w, T(c.power_max));
+	}
+
+	for (LoadInfo &l: loads) {
+		if (!l.is_active() || l.power_max <= 0) {
+			l.requested_power = 0;
 			continue;
-		// distribute the available power evenly accross other importable inverter
-		if (export_power > 0) {
-			float p = std::min(export_power, inverter_fillable_power);
-      			export_power -= p;
-			for (int j: fillable_inverter)
-				inverter_control_values[j].requested_power -= p / fillable_inverter.size();
-			inverter_control_values[i].requested_power += p;
 		}
-		// export rest to grid
-		if (export_power > 0) {
-			float rem = std::min(export_power, remaining_export);
-			inverter_control_values[i].requested_power += rem;
-			remaining_export -= rem;
+		bool on = l.requested_power > 0;
+		bool may_switch = now_s - l.last_switch_s >= l.min_switch_s || l.last_switch_s == 0;
+		T threshold = on ? T(l.power_min) - T(EMM::LOAD_HYSTERESIS_W): T(l.power_min) + T(EMM::LOAD_HYSTERESIS_W);
+		T target{};
+		if (surplus >= threshold || (on && !may_switch)) {
+			T step = std::max(T(l.power_step), T(1));
+			target = std::clamp(floor(surplus / step) * step, T(l.power_min), T(l.power_max));
+		}
+		if ((target > T(0)) != on) {
+			if (!may_switch)
+				target = on ? T(l.power_min): T(0);
+			else
+				l.last_switch_s = now_s;
 		}
+		l.requested_power = float(target);
+		surplus -= target;
+	}
+}
+
+// moves requested power between inverters on different phases such that no phase exceeds max_export_phase
+// and the per phase import/export is as even as possible. The overall requested power stays the same for
+// the balancing, only the export limit may reduce it
+template<typename T>
+static void balance_phases(const std::array<T, PHASES> &home_phases, std::span<InverterGroup> inverter_powers, std::span<ControlPowerInfo> inverter_control_values, std::span<T> req, const settings &s) {
+	using std::abs;
+	if (!s.phase_balancing)
+		return;
+	// expected grid power per phase after the requests were applied, positive means import
+	std::array<T, PHASES> grid{home_phases};
+	for (int i: range(inverter_powers.size()))
+		for (int p: range(PHASES))
+			grid[p] -= T(phase_share(inverter_powers[i].phase, p)) * req[i];
+
+	// shifts up to power watts on inverters feeding phase, positive power increases export
+	// returns the shifted amount
+	const auto shift_phase = [&](Phase phase, T power) {
+		T shifted{};
+		for (int i: range(inverter_powers.size())) {
+			if (inverter_powers[i].phase != phase || abs(power - shifted) < T(1))
+				continue;
+			const ControlPowerInfo &c = inverter_control_values[i];
+			T headroom = power > T(0) ?
+				std::max(T(0), exp_avail<T>(inverter_powers[i], c) - req[i]):
+				-std::max(T(0), req[i] + imp_avail<T>(inverter_powers[i], c));
+			T d = power > T(0) ? std::min(power - shifted, headroom): std::max(power - shifted, headroom);
+			req[i] += d;
+			shifted += d;
+		}
+		for (int p: range(PHASES))
+			grid[p] -= T(phase_share(phase, p)) * shifted;
+		return shifted;
+	};
+
+	// per phase export limit, first reduce single phase inverters, then symmetric ones
+	T max_export_phase{s.max_export_phase};
+	if (max_export_phase > T(0)) {
+		for (int p: range(PHASES)) {
+			T excess = -max_export_phase - grid[p];
+			if (excess > T(0))
+				shift_phase(Phase(p + 1), -excess);
+		}
+		T worst_excess{};
+		for (int p: range(PHASES))
+			worst_excess = std::max(worst_excess, -max_export_phase - grid[p]);
+		if (worst_excess > T(0))
+			shift_phase(Phase::ALL, -worst_excess * T(PHASES));
+	}
+
+	// imbalance: move power from the phase with most export to the phase with most import
+	for (int iter = 0; iter < PHASES; ++iter) {
+		int hi = std::max_element(grid.begin(), grid.end()) - grid.begin();
+		int lo = std::min_element(grid.begin(), grid.end()) - grid.begin();
+		T diff = (grid[hi] - grid[lo]) / T(2);
+		if (diff < T(10))
+			break;
+		// never push the high phase over the export limit
+		if (max_export_phase > T(0))
+			diff = std::min(diff, grid[hi] + max_export_phase);
+		T moved = shift_phase(Phase(lo + 1), -diff);
+		T added = shift_phase(Phase(hi + 1), -moved);
+		if (added < -moved - T(1)) // target phase could not take all, give back to keep total power constant
+			shift_phase(Phase(lo + 1), -moved - added);
+		if (abs(added) < T(1))
+			break;
 	}
 }
 
+template void EMM::update_power_t<float>(float, const std::array<float, PHASES>&, std::span<InverterGroup>, std::span<ControlPowerInfo>, const settings&, std::span<LoadInfo>, uint32_t);
+template void EMM::update_power_t<fixed>(float, const std::array<float, PHASES>&, std::span<InverterGroup>, std::span<ControlPowerInfo>, const settings&, std::span<LoadInfo>, uint32_t);
@@ -0,0 +1,143 @@
+#include "energy_counters.h"
+#include "ranges_util.h"
+
+#include <chrono>
+
+using channel = energy_counters_data::channel;
+using namespace std::chrono;
+
+static uint32_t month_start(time_t epoch_s) {
+	year_month_day d{floor<days>(sys_seconds{seconds{epoch_s}})};
+	return uint32_t(sys_seconds{sys_days{d.year() / d.month() / 1}}.time_since_epoch().count());
+}
+static uint32_t year_start(time_t epoch_s) {
+	year_month_day d{floor<days>(sys_seconds{seconds{epoch_s}})};
+	return uint32_t(sys_seconds{sys_days{d.year() / January / 1}}.time_since_epoch().count());
+}
+
+static std::array<float, energy_counters_data::CHANNELS> powers(const PowerFlow &flow) {
+	std::array<float, energy_counters_data::CHANNELS> w{};
+	w[channel::GRID_IMPORT] = flow.meter.imp_w;
+	w[channel::GRID_EXPORT] = flow.meter.exp_w;
+	w[channel::HOME] = flow.home.imp_w;
+	for (const DcFlow &dc: flow.dc) {
+		w[channel::PV] += dc.pv_w;
+		w[channel::BATTERY_CHARGE] += dc.charge_w;
+		w[channel::BATTERY_DISCHARGE] += dc.discharge_w;
+	}
+	return w;
+}
+
+// pushes the running period to the rollups when a later period starts, returns true if it did.
+// Energy counted before the first time is kept in the first period, time going back (ntp correction) is ignored
+template<int N>
+static bool roll(energy_counters_data::running &p, uint32_t start, static_ring_buffer<energy_counters_data::closed, N> &rollups) {
+	if (start <= p.start)
+		return false;
+	if (!p.start) {
+		p.start = start;
+		return false;
+	}
+	energy_counters_data::closed c{.start = p.start, .wh = {}};
+	for (int i: range(energy_counters_data::CHANNELS))
+		c.wh[i] = float(p.wh[i]);
+	rollups.push(c);
+	p = {.start = start, .wh = {}};
+	return true;
+}
+
+// counters of the battery, looked up by device id and otherwise by address (new device id after a reconnect or reboot).
+// A new battery takes a free entry or the entry of a battery not seen since the start, -1 if there is none
+static int find_battery(energy_counters_data &data, std::array<int, MAX_INVERTERS> &battery_ids, int battery_id, const ModbusTcpAddr &addr) {
+	for (int i: range(data.batteries.size()))
+		if (battery_ids[i] == battery_id)
+			return i;
+	if (addr == ModbusTcpAddr{}) // removed from the settings during the cycle
+		return -1;
+	int idx{-1};
+	for (int i: range(data.batteries.size()))
+		if (data.batteries[i].addr == addr)
+			idx = i;
+	if (idx < 0 && data.batteries.push())
+		idx = data.batteries.size() - 1;
+	for (int i: range(data.batteries.size()))
+		if (idx < 0 && battery_ids[i] == 0)
+			idx = i;
+	if (idx < 0)
+		return -1;
+	if (data.batteries[idx].addr != addr)
+		data.batteries[idx] = {.addr = addr, .wear = {}};
+	battery_ids[idx] = battery_id;
+	return idx;
+}
+
+void energy_counters::update(const PowerFlow &flow, const DeviceIds &ids, float tot_imp_wh, float tot_exp_wh, time_t epoch_s) {
+	const std::array<float, energy_counters_data::CHANNELS> w = powers(flow);
+	std::array<double, energy_counters_data::CHANNELS> wh{};
+	const uint32_t dt_ms = flow.time_ms - last_ms;
+	const bool integrated = last_ms && dt_ms <= MAX_GAP_MS;
+	if (integrated)
+		for (int c: range(channel::HOME_FROM_GRID))
+			wh[c] = (last_w[c] + w[c]) / 2. * dt_ms / 3.6e6;
+	// the attribution already is energy of the cycle
+	wh[channel::HOME_FROM_GRID] = flow.bus_wh(BUS_GRID, BUS_HOME);
+	for (int i: range(flow.inverter_groups.size())) {
+		wh[channel::HOME_FROM_INVERTERS] += flow.bus_wh(bus_inverter(i), BUS_HOME);
+		wh[channel::GRID_FROM_INVERTERS] += flow.bus_wh(bus_inverter(i), BUS_GRID);
+		wh[channel::INVERTERS_FROM_GRID] += flow.bus_wh(BUS_GRID, bus_inverter(i));
+	}
+	last_ms = flow.time_ms;
+	last_w = w;
+
+	// the meter registers also cover gaps of the control loop, the deviation is only tracked where both are known
+	std::array<double, 2> deviation_wh{};
+	const auto reconcile = [&](channel c, float reg_wh, float &last_reg_wh, double &deviation) {
+		float step = reg_wh - last_reg_wh;
+		if (reg_wh > 0 && last_reg_wh > 0 && step >= 0 && step <= MAX_METER_STEP_WH) {
+			if (integrated)
+				deviation = wh[c] - step;
+			wh[c] = step;
+		}
+		last_reg_wh = reg_wh;
+	};
+	reconcile(channel::GRID_IMPORT, tot_imp_wh, meter_imp_wh, deviation_wh[0]);
+	reconcile(channel::GRID_EXPORT, tot_exp_wh, meter_exp_wh, deviation_wh[1]);
+
+	bool new_day{};
+	{
+		scoped_lock lock{m};
+		if (epoch_s) {
+			new_day = roll(data.day, uint32_t(epoch_s / 86400 * 86400), data.days);
+			roll(data.month, month_start(epoch_s), data.months);
+			roll(data.year, year_start(epoch_s), data.years);
+		}
+		for (int c: range(energy_counters_data::CHANNELS)) {
+			data.total_wh[c] += wh[c];
+			data.day.wh[c] += wh[c];
+			data.month.wh[c] += wh[c];
+			data.year.wh[c] += wh[c];
+		}
+		deviation_imp_wh += deviation_wh[0];
+		deviation_exp_wh += deviation_wh[1];
+
+		std::array<bool, MAX_INVERTERS> seen{};
+		for (int i: range(std::min(flow.inverter_groups.size(), ids.groups.size()))) {
+			const InverterGroup &ig = flow.inverter_groups[i];
+			int b = ig.battery.device_id > 0 ? find_battery(data, battery_ids, ig.battery.device_id, ids.groups[i].addr): -1;
+			if (b < 0 || ig.bat_soc <= 0) // soc is 0 for disconnected inverters
+				continue;
+			data.batteries[b].wear.update(ig.battery.imp_w, ig.battery.exp_w, ig.bat_soc, flow.cycle_h);
+			seen[b] = true;
+		}
+		for (int i: range(data.batteries.size()))
+			if (!seen[i])
+				data.batteries[i].wear.pause();
+	}
+	uint32_t hour = uint32_t(epoch_s / 3600);
+	if (epoch_s && (new_day || hour >= last_store_hour + STORE_HOURS)) {
+		if (last_store_hour) // nothing new right after the start
+			request_counters_store = true;
+		last_store_hour = hour;
+	}
+}
+
@@ -0,0 +1,49 @@
+#include "energy_profile.h"
+#include "history_data.h"
+#include "ranges_util.h"
+
+// returns the hourly bucket of device id for the given hour, nullopt if there is none (yet)
+static std::optional<float> hour_value(int device_id, uint32_t bucket_time) {
+	std::optional<float> value{};
+	hd::read_series({hd::series_id::INVERTER, device_id}, [&](const t::device_data *data) {
+		const t::per_hour *h = data ? &data->per_hour: nullptr;
+		value = h && !h->empty() && h->back().time == bucket_time ? std::optional<float>{h->back().data}: std::nullopt;
+	});
+	return value;
+}
+
+void energy_profile::update(std::span<const InverterGroup> inverter_groups) {
+	t::data_bucket meter{};
+	if (!hd::read_series({hd::series_id::METER, METER_ID}, [&](const t::device_data *d) { meter = d ? d->per_hour.back(): t::data_bucket{}; }) || meter.time == 0)
+		return;
+	uint32_t bucket_hour = meter.time / 3600;
+	if (bucket_hour == data.last_hour)
+		return;
+
+	// history values are signed with import positive, home is the meter minus what the inverters fed in
+	float home_w = meter.data;
+	float pv_w{};
+	bool complete{true};
+	for (const InverterGroup &ig: inverter_groups) {
+		std::optional<float> inverter = hour_value(ig.inverter.device_id, meter.time);
+		std::optional<float> pv = ig.pv.device_id > 0 ? hour_value(ig.pv.device_id, meter.time): std::optional<float>{0};
+		complete &= inverter && pv;
+		home_w -= inverter.value_or(0);
+		pv_w -= pv.value_or(0);
+	}
+
+	scoped_lock lock{m};
+	data.last_hour = bucket_hour;
+	if (!complete) // inverter history was reset or is not tracked, the hour would be biased
+		return;
+	const auto add = [](energy_profile_data::slot &s, float w) {
+		s.samples = std::min<uint16_t>(s.samples + 1, WINDOW);
+		s.mean_w += (w - s.mean_w) / s.samples;
+	};
+	time_t t = meter.time;
+	add(data.home[weekday(t)][hour(t)], home_w);
+	add(data.pv[weekday(t)][hour(t)], pv_w);
+	if (hour(t) == STORE_HOUR)
+		request_profile_store = true;
+}
+
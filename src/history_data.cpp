@@ -1,101 +1,305 @@
 #include "history_data.h"
 #include "ranges_util.h"
+#include "log_storage.h"
+
+#include <memory>
+#include <optional>
 
 namespace history_data {
 
 static void add_data(t::device_data &locked_data, float value, time_t epoch_time_s);
 
+// calls f with the series of the level res
+template<typename D, typename F>
+static auto with_level(D &data, resolution res, F &&f) {
+	switch (res) {
+		case resolution::SECOND: return f(data.per_second);
+		case resolution::TEN_SECONDS: return f(data.per_ten_seconds);
+		case resolution::MINUTE: return f(data.per_minute);
+		case resolution::QUARTER_HOUR: return f(data.per_quarter_hour);
+		case resolution::HOUR: return f(data.per_hour);
+		default: return f(data.per_day);
+	}
+}
+
+// bump allocation from the arena, nothing is ever freed apart from the reset in init()
+template<typename T>
+static std::span<T> allocate(int n) {
+	uint32_t start = (g::history_arena_used + alignof(T) - 1) / alignof(T) * alignof(T);
+	if (start + n * sizeof(T) > g::history_arena.size())
+		return {};
+	g::history_arena_used = start + n * sizeof(T);
+	T *p = reinterpret_cast<T*>(g::history_arena.data() + start);
+	std::uninitialized_default_construct_n(p, n);
+	return {p, size_t(n)};
+}
+
 void init() {
-	{ g::meter_data.access().data = {}; }
-	{ g::inverter_data.access().data = {}; }
-	{ t::locked_data<std::array<t::id_data, MAX_INVERTERS * 2>> inverter = g::inverter_data.access(); 
-	  for (t::id_data &i: inverter.data)
-		i.device_id = -1;
+	for (t::registered_series &s: std::span{g::history_series.data(), size_t(g::history_series_count)}) {
+		t::locked_data<std::span<t::device_data>> locked_data = s.history.access();
+		s.slots = {};
+		s.index.clear();
+		s.bytes = 0;
 	}
-	{ t::locked_data<std::array<t::id_data, MAX_INVERTERS>> soc = g::soc_data.access(); 
-	  for (t::id_data &i: soc.data)
-		i.device_id = -1;
+	g::history_series_count = 0;
+	g::history_arena_used = 0;
+	register_series({.name = "meter", .unit = "W", .retention_s = DEVICE_RETENTION_S, .slots = 1, .keyed = true});
+	register_series({.name = "inverter", .unit = "W", .retention_s = DEVICE_RETENTION_S, .slots = MAX_HISTORY_INVERTERS * 2, .keyed = true});
+	register_series({.name = "soc", .unit = "%", .retention_s = DEVICE_RETENTION_S, .slots = MAX_HISTORY_INVERTERS, .keyed = true});
+}
+
+int register_series(const series_config &config) {
+	if (g::history_series_count == int(g::history_series.size()) || config.slots < 1 || config.slots > MAX_SERIES_SLOTS || find_series(config.name) >= 0) {
+		LogError("History: series {} can not be registered", config.name);
+		return -1;
+	}
+	const uint32_t arena_start = g::history_arena_used;
+	std::span<t::device_data> slots = allocate<t::device_data>(config.slots);
+	bool ok = !slots.empty();
+	for (t::device_data &d: slots) {
+		for (int r: range(LEVELS)) {
+			with_level(d, resolution(r), [&](auto &series) {
+				using block = std::remove_cvref_t<decltype(series.blocks.storage[0])>;
+				int n = level_blocks(config.retention_s[r], resolution(r));
+				std::span<block> blocks = allocate<block>(n);
+				ok &= blocks.size() == size_t(n);
+				series.assign(blocks);
+			});
+		}
+		d.clear();
 	}
-	{ g::any_data.access().data = {}; }
-}
-
-void write_meter_data(float value, time_t epoch_time_s) {
-	t::locked_data<t::device_data> locked_data = g::meter_data.access();
-	add_data(locked_data.data, value, epoch_time_s);
-}
-void write_inverter_data(int id, float value, time_t epoch_time_s) {
-	t::locked_data<std::array<t::id_data, MAX_INVERTERS * 2>> locked_data = g::inverter_data.access();
-	t::id_data *inverter = locked_data.data | find{&t::id_data::device_id, id};
-	if (!inverter) {
-		inverter = locked_data.data | find{&t::id_data::device_id, -1};
-		if (!inverter) // everything full
-			return;
-		inverter->device_id = id;
-		inverter->data = {};
+	if (!ok) {
+		g::history_arena_used = arena_start;
+		LogError("History: arena too small for series {}, {} of {} kB used", config.name, arena_start / 1024, g::history_arena.size() / 1024);
+		return -1;
 	}
-	add_data(inverter->data, value, epoch_time_s);
-}
-void write_soc_data(int id, float value, time_t epoch_time_s) {
-	t::locked_data<std::array<t::id_data, MAX_INVERTERS>> locked_data = g::soc_data.access();
-	t::id_data *soc = locked_data.data | find{&t::id_data::device_id, id};
-	if (!soc) {
-		soc = locked_data.data | find{&t::id_data::device_id, -1};
-		if (!soc) // everything full
-			return;
-		soc->device_id = id;
-		soc->data = {};
+	int handle = g::history_series_count;
+	t::registered_series &s = g::history_series[handle];
+	{
+		t::locked_data<std::span<t::device_data>> locked_data = s.history.access();
+		s.config = config;
+		s.slots = slots;
+		s.index.clear();
+		s.bytes = g::history_arena_used - arena_start;
 	}
-	add_data(soc->data, value, epoch_time_s);
+	g::history_series_count = handle + 1;
+	return handle;
 }
-void write_any_data(int i, float value, time_t epoch_time_s) {
-	t::locked_data<static_vector<t::device_data, 4>> locked_data = g::any_data.access();
-	add_data(locked_data.data[i], value, epoch_time_s);
+
+int find_series(std::string_view name) {
+	for (int i: range(g::history_series_count))
+		if (g::history_series[i].config.name == name)
+			return i;
+	return -1;
 }
 
-// -------------------------------------------------------------------------------------------
-// Internal implementation functions
-// -------------------------------------------------------------------------------------------
+int slot_of(const t::registered_series &s, int id) {
+	if (s.config.keyed)
+		return id > 0 ? s.index.find(id): -1;
+	return id >= 0 && id < int(s.slots.size()) ? id: -1;
+}
 
-static void add_data(t::device_data &locked_data, float value, time_t epoch_time_s) {
-	bool has_data = locked_data.per_second.size();
-	uint32_t prev_minute = locked_data.per_second[-1].time / 60;
-	std::optional<t::data_time> new_per_minute{};
-	if (has_data && prev_minute != epoch_time_s / 60) { // new minute started
-		// calculate minute average of previous minute
-		float sum{};
-		int n{};
-		for (int i: range(60)) {
-			t::data_time dt = locked_data.per_second[-60 + i];
-			if (dt.time / 60 == prev_minute) {
-				sum += dt.data;
-				n += 1;
-			}
+int device_ids(int series, std::span<int> out) {
+	if (series < 0 || series >= g::history_series_count)
+		return 0;
+	t::registered_series &s = g::history_series[series];
+	int n{};
+	if (!s.history.read([&](const std::span<t::device_data> &) {
+		n = 0;
+		for (int id: s.index.slot_ids)
+			if (id > 0 && n < int(out.size()))
+				out[n++] = id;
+	}))
+		return 0;
+	return n;
+}
+
+void write(series_id series, float value, time_t epoch_time_s) {
+	if (series.series < 0 || series.series >= g::history_series_count)
+		return;
+	t::registered_series &s = g::history_series[series.series];
+	if (s.config.keyed && series.id <= 0)
+		return;
+	t::locked_data<std::span<t::device_data>> locked_data = s.history.access();
+	int slot = slot_of(s, series.id);
+	if (slot < 0 && s.config.keyed) {
+		slot = s.index.insert(series.id, s.slots.size());
+		if (slot >= 0)
+			locked_data.data[slot].clear();
+		else if (!s.unslotted_id) {
+			s.unslotted_id = series.id;
+			LogError("History {}: no free slot for device {}, only {} devices are kept", s.config.name, series.id, s.slots.size());
+		}
+	}
+	if (slot < 0) // everything full or no such slot
+		return;
+	add_data(locked_data.data[slot], value, epoch_time_s);
+}
+
+void retain(int series, std::span<const int> device_ids) {
+	if (series < 0 || series >= g::history_series_count || !g::history_series[series].config.keyed)
+		return;
+	t::registered_series &s = g::history_series[series];
+	t::locked_data<std::span<t::device_data>> locked_data = s.history.access();
+	for (int id: s.index.slot_ids)
+		if (id != -1 && std::ranges::find(device_ids, id) == device_ids.end())
+			s.index.remove(id);
+}
+
+template<typename Series>
+static int read_buckets(const Series &series, uint32_t step, uint32_t t_begin, uint32_t t_end, std::span<t::data_bucket> out, bool mark_gaps = true) {
+	int n{};
+	uint32_t expected{};
+	series.visit(t_begin, t_end, [&](const auto &v) {
+		if (mark_gaps && n && v.time > expected && n < int(out.size()))
+			out[n++] = {.data = NAN, .min = NAN, .max = NAN, .time = expected, .n = 0};
+		if (n == int(out.size()))
+			return false;
+		if constexpr (std::is_same_v<std::remove_cvref_t<decltype(v)>, t::data_time>)
+			out[n++] = {.data = v.data, .min = v.data, .max = v.data, .time = v.time, .n = 1};
+		else
+			out[n++] = v;
+		expected = v.time + step;
+		return n < int(out.size());
+	});
+	return n;
+}
+
+query_result query_data(const t::device_data &locked_data, uint32_t t_begin, uint32_t t_end, std::span<t::data_bucket> out, uint32_t max_buckets) {
+	if (!max_buckets)
+		max_buckets = out.size();
+	uint32_t span = t_end > t_begin ? t_end - t_begin: 0;
+	// levels the series was registered without are never used
+	const auto has_level = [&](int r) { return with_level(locked_data, resolution(r), [](const auto &series) { return series.blocks.capacity() > 0; }); };
+	int res{-1};
+	for (int r: range(LEVELS)) {
+		if (span / RESOLUTION_S[r] > max_buckets || !has_level(r))
+			continue;
+		if (res < 0)
+			res = r;
+		if (with_level(locked_data, resolution(r), [](const auto &series) { return series.front_time(); }) <= t_begin) {
+			res = r;
+			break;
 		}
-		new_per_minute = {sum / n, prev_minute * 60};
 	}
+	if (res < 0) // the coarsest level of the series
+		for (int r: range(LEVELS))
+			if (has_level(r))
+				res = r;
+	if (res < 0)
+		return {resolution::DAY, 0};
+	return {resolution(res), with_level(locked_data, resolution(res), [&](const auto &series) {
+		return read_buckets(series, RESOLUTION_S[res], t_begin, t_end, out);
+	})};
+}
+
+int read(series_id series, resolution res, uint32_t t_begin, uint32_t t_end, std::span<t::data_bucket> out) {
+	int n{-1};
+	if (!read_series(series, [&](const t::device_data *data) {
+		if (!data)
+			n = -1;
+		else
+			n = with_level(*data, res, [&](const auto &level) {
+				return read_buckets(level, RESOLUTION_S[int(res)], t_begin, t_end, out, false);
+			});
+	}))
+		return -1;
+	return n;
+}
 
-	has_data = locked_data.per_minute.size();
-	uint32_t prev_hour = locked_data.per_second[-1].time / 3600;
-	std::optional<t::data_time> new_per_hour{};
-	if (has_data && prev_hour != epoch_time_s / 3600) {
-		float sum{};
-		int n{};
-		for (int i: range(60)) {
-			t::data_time dt = locked_data.per_minute[-60 + i];
-			if (dt.time / 3600 == prev_hour) {
-				sum += dt.data;
-				n += 1;
-			}
+static int restore_hours(t::device_data &locked_data, std::span<const t::data_bucket> hours) {
+	const t::accumulator &minute = locked_data.minute, &hour = locked_data.hour;
+	uint32_t open_hour = hour.n ? hour.start: minute.n ? minute.start / 3600 * 3600: UINT32_MAX;
+	uint32_t open_day = open_hour / 86400 * 86400;
+	t::accumulator day{};
+	int n{};
+	for (const t::data_bucket &h: hours) {
+		if (h.time >= open_hour || (!locked_data.per_hour.empty() && h.time <= locked_data.per_hour.back().time))
+			continue;
+		locked_data.per_hour.push(h);
+		++n;
+		// hours of the running day go to its accumulator, earlier days are pushed when complete
+		uint32_t day_start = h.time / 86400 * 86400;
+		t::accumulator &d = day_start == open_day ? locked_data.day: day;
+		if (d.start != day_start) {
+			if (d.n && (locked_data.per_day.empty() || d.start > locked_data.per_day.back().time))
+				locked_data.per_day.push(d.bucket());
+			d.reset(day_start);
 		}
-		new_per_hour = {sum / n, prev_hour * 3600};
+		d.add(h.data, h.min, h.max);
 	}
+	if (day.n && (locked_data.per_day.empty() || day.start > locked_data.per_day.back().time))
+		locked_data.per_day.push(day.bucket());
+	return n;
+}
+int restore_hours(series_id series, std::span<const t::data_bucket> hours) {
+	if (series.series < 0 || series.series >= g::history_series_count)
+		return -1;
+	t::registered_series &s = g::history_series[series.series];
+	t::locked_data<std::span<t::device_data>> locked_data = s.history.access();
+	int slot = slot_of(s, series.id);
+	return slot >= 0 ? restore_hours(locked_data.data[slot], hours): -1;
+}
+bool has_history(series_id series) {
+	return series.series >= 0 && series.series < g::history_series_count && slot_of(g::history_series[series.series], series.id) >= 0;
+}
 
-	locked_data.per_second.push({value, uint32_t(epoch_time_s)});
-	if (new_per_minute)
-		locked_data.per_minute.push(new_per_minute.value());
-	if (new_per_hour)
-		locked_data.per_hour.push(new_per_hour.value());
+query_result query(series_id series, uint32_t t_begin, uint32_t t_end, std::span<t::data_bucket> out, uint32_t max_buckets) {
+	query_result r{};
+	if (!read_series(series, [&](const t::device_data *data) { r = data ? query_data(*data, t_begin, t_end, out, max_buckets): query_result{}; }))
+		return {};
+	return r;
 }
 
-} // namespace hd
+static_vector<contention_stats, MAX_HISTORY_SERIES> contention() {
+	static_vector<contention_stats, MAX_HISTORY_SERIES> stats{};
+	for (const t::registered_series &s: std::span{g::history_series.data(), size_t(g::history_series_count)})
+		stats.push({s.config.name, s.history.lock_waits.load(), s.history.read_retries.load(), s.history.read_failures.load()});
+	return stats;
+}
 
+// -------------------------------------------------------------------------------------------
+// Internal implementation functions
+// -------------------------------------------------------------------------------------------
+
+// adds a closed bucket of a finer level to the running bucket of length seconds
+static void feed(t::accumulator &acc, const t::accumulator &closed, uint32_t length) {
+	if (acc.start != closed.start / length * length)
+		acc.reset(closed.start / length * length);
+	acc.add(closed.mean(), closed.min, closed.max);
+}
+// when time is in a later bucket the running one is pushed and returned and the bucket of time is started
+template<typename Series>
+static std::optional<t::accumulator> roll(t::accumulator &acc, Series &series, uint32_t time, uint32_t length) {
+	uint32_t start = time / length * length;
+	if (acc.start == start)
+		return {};
+	t::accumulator closed = acc;
+	acc.reset(start);
+	if (!closed.n)
+		return {};
+	series.push(closed.bucket());
+	return closed;
+}
+
+static void add_data(t::device_data &locked_data, float value, time_t epoch_time_s) {
+	uint32_t time = uint32_t(epoch_time_s);
+	t::accumulator &ten_seconds = locked_data.ten_seconds;
+	t::accumulator &minute = locked_data.minute;
+	// buckets are closed by the first sample of a different bucket, so gaps simply leave the missing buckets out.
+	// The seconds feed the 10 s and minute buckets, the minutes the 15 minute and hour buckets, the hours the days
+	roll(ten_seconds, locked_data.per_ten_seconds, time, 10);
+	if (std::optional<t::accumulator> m = roll(minute, locked_data.per_minute, time, 60)) {
+		feed(locked_data.quarter_hour, *m, 900);
+		feed(locked_data.hour, *m, 3600);
+	}
+	roll(locked_data.quarter_hour, locked_data.per_quarter_hour, time, 900);
+	if (std::optional<t::accumulator> h = roll(locked_data.hour, locked_data.per_hour, time, 3600))
+		feed(locked_data.day, *h, 86400);
+	roll(locked_data.day, locked_data.per_day, time, 86400);
+	ten_seconds.add(value);
+	minute.add(value);
+	locked_data.per_second.push({value, time});
+}
+
+} // namespace hd
@@ -0,0 +1,202 @@
+#include "history_log.h"
+#include "power_flow.h"
+#include "ranges_util.h"
+#include "log_storage.h"
+
+#include <cstddef>
+#include <cstring>
+
+extern char __flash_binary_end;
+
+struct flash_op {
+	uint32_t offset;
+	const uint8_t *data;
+};
+static void __no_inline_not_in_flash_func(erase_sector)(void *d) {
+	flash_range_erase(reinterpret_cast<const flash_op*>(d)->offset, FLASH_SECTOR_SIZE);
+}
+static void __no_inline_not_in_flash_func(program_page)(void *d) {
+	const flash_op &op = *reinterpret_cast<const flash_op*>(d);
+	flash_range_program(op.offset, op.data, FLASH_PAGE_SIZE);
+}
+
+uint32_t history_log::record::checksum() const {
+	uint32_t h{2166136261u}; // fnv-1a over everything but the checksum
+	for (int i: range(int(offsetof(record, check))))
+		h = (h ^ reinterpret_cast<const uint8_t*>(this)[i]) * 16777619u;
+	return h;
+}
+
+const history_log::sector& history_log::flash_sector(int i) const {
+	return *reinterpret_cast<const sector*>(flash_begin + BEGIN_OFFSET + i * FLASH_SECTOR_SIZE);
+}
+
+void history_log::init() {
+	valid = uintptr_t(&__flash_binary_end) <= uintptr_t(flash_begin + BEGIN_OFFSET);
+	if (!valid) {
+		LogError("History log: firmware reaches into the log region, the log is disabled");
+		return;
+	}
+	int newest{-1}, used{};
+	for (int i: range(SECTORS)) {
+		const sector_header &h = flash_sector(i).header;
+		if (h.magic != MAGIC)
+			continue;
+		++used;
+		if (newest < 0 || h.sequence > sequence) {
+			newest = i;
+			sequence = h.sequence;
+		}
+	}
+	// the head of the previous boot counts as full, the first hour starts a new sector
+	head = newest < 0 ? SECTORS - 1: newest;
+	records = RECORDS;
+	head_in_buffer = false;
+	LogInfo("History log: {} of {} sectors used", used, SECTORS);
+}
+
+void history_log::update() {
+	if (!valid)
+		return;
+	static DeviceIds devices{};
+	if (!g::device_ids.read(devices))
+		return;
+	// too big for the task stack
+	static std::array<hd::series_id, SERIES> ids{};
+	static std::array<key, SERIES> keys{};
+	const int series = 1 + devices.groups.size() * ROLES;
+	ids[0] = {hd::series_id::METER, devices.meter};
+	keys[0] = {devices.meter_addr, METER};
+	for (int i: range(devices.groups.size())) {
+		const DeviceIds::group &ig = devices.groups[i];
+		ids[series_index(i, INVERTER)] = {hd::series_id::INVERTER, ig.inverter};
+		ids[series_index(i, PV)] = {hd::series_id::INVERTER, ig.pv};
+		ids[series_index(i, BATTERY)] = {hd::series_id::INVERTER, ig.battery};
+		ids[series_index(i, SOC)] = {hd::series_id::SOC, ig.battery};
+		for (role r: {INVERTER, PV, BATTERY, SOC})
+			keys[series_index(i, r)] = {ig.addr, r};
+	}
+	restore(std::span{ids.data(), size_t(series)}, std::span{keys.data(), size_t(series)});
+
+	// only restored series are logged, otherwise the restore would skip the hours before the newest logged one
+	std::array<t::data_bucket, 8> hours;
+	for (int s: range(series)) {
+		if (ids[s].id <= 0 || restored_ids[s] != ids[s].id || restored_keys[s] != keys[s])
+			continue;
+		int n = hd::read(ids[s], hd::resolution::HOUR, logged_time[s] + 1, UINT32_MAX, hours);
+		for (int i: range(std::max(n, 0)))
+			append(s, keys[s], hours[i]);
+	}
+}
+
+// slot of the series a record belongs to, -1 if its device is not configured
+static int slot_of(std::span<const history_log::key> keys, const history_log::key &k) {
+	if (k.r == history_log::METER)
+		return k == keys[0] ? 0: -1;
+	for (int i = history_log::series_index(0, k.r); i < int(keys.size()); i += history_log::ROLES)
+		if (keys[i] == k)
+			return i;
+	return -1;
+}
+
+// single pass over the log for all series whose device is new, oldest sector first
+void history_log::restore(std::span<const hd::series_id> ids, std::span<const key> keys) {
+	std::array<bool, SERIES> pending{};
+	bool any{};
+	for (int s: range(ids.size())) {
+		// the history slot is created with the first sample of the device, until then the restore is retried
+		pending[s] = ids[s].id > 0 && keys[s].addr != ModbusTcpAddr{} && (restored_ids[s] != ids[s].id || restored_keys[s] != keys[s]) &&
+			     hd::has_history(ids[s]);
+		if (pending[s] && restored_keys[s] != keys[s]) {
+			// another device took over the index (an inverter was removed), the hours in the history until now belong to the previous one
+			logged_time[s] = 0;
+			if (restored_keys[s].addr != ModbusTcpAddr{})
+				hd::read_series(ids[s], [&](const t::device_data *data) { logged_time[s] = data && !data->per_hour.empty() ? data->per_hour.back().time: 0; });
+		}
+		any |= pending[s];
+	}
+	if (!any)
+		return;
+	static std::array<t::data_bucket, RECORDS> hours{};
+	for (int i: range(1, SECTORS + 1)) {
+		int si = (head + i) % SECTORS;
+		const sector &sec = si == head && head_in_buffer ? buffer: flash_sector(si);
+		if (sec.header.magic != MAGIC)
+			continue;
+		const int count = si == head && head_in_buffer ? records: RECORDS;
+		std::array<bool, SERIES> present{};
+		for (int r: range(count)) {
+			if (sec.records[r].time == UINT32_MAX)
+				break;
+			if (int s = slot_of(keys, sec.records[r].series()); s >= 0)
+				present[s] = true;
+		}
+		for (int s: range(ids.size())) {
+			if (!pending[s] || !present[s])
+				continue;
+			int n{};
+			for (int r: range(count)) {
+				const record &rec = sec.records[r];
+				if (rec.time == UINT32_MAX)
+					break;
+				if (rec.series() != keys[s] || rec.check != rec.checksum())
+					continue;
+				hours[n++] = {.data = rec.data, .min = rec.min, .max = rec.max, .time = rec.time, .n = rec.n};
+				logged_time[s] = std::max(logged_time[s], rec.time);
+			}
+			restored_hours.fetch_add(std::max(hd::restore_hours(ids[s], std::span{hours.data(), size_t(n)}), 0), std::memory_order_relaxed);
+		}
+	}
+	for (int s: range(ids.size())) {
+		if (pending[s]) {
+			restored_ids[s] = ids[s].id;
+			restored_keys[s] = keys[s];
+		}
+	}
+}
+
+void history_log::append(int series, const key &k, const t::data_bucket &hour) {
+	if (records == RECORDS && !start_sector())
+		return;
+	record &r = buffer.records[records++];
+	r = {.time = hour.time, .data = hour.data, .min = hour.min, .max = hour.max, .n = hour.n, .r = k.r, .modbus_id = k.addr.modbus_id,
+	     .ip = k.addr.ip, .port = k.addr.port, .reserved = 0, .check = 0};
+	r.check = r.checksum();
+	logged_time[series] = hour.time;
+	appended_records.fetch_add(1, std::memory_order_relaxed);
+	program_full_pages();
+}
+
+bool history_log::start_sector() {
+	int next = (head + 1) % SECTORS;
+	flash_op op{.offset = BEGIN_OFFSET + next * FLASH_SECTOR_SIZE, .data = nullptr};
+	if (int err = flash_safe_execute(erase_sector, &op, UINT32_MAX); err != PICO_OK) {
+		flash_errors.fetch_add(1, std::memory_order_relaxed);
+		LogError("History log: erasing sector {} failed ({})", next, err);
+		return false;
+	}
+	erased_sectors.fetch_add(1, std::memory_order_relaxed);
+	head = next;
+	std::memset(&buffer, 0xff, sizeof(buffer));
+	buffer.header = {.magic = MAGIC, .sequence = ++sequence, .reserved = {}};
+	head_in_buffer = true;
+	records = 0;
+	programmed_pages = 0;
+	return true;
+}
+
+// records span page borders, each page is programmed once when all of its bytes are written
+void history_log::program_full_pages() {
+	const uint32_t filled = sizeof(sector_header) + records * sizeof(record);
+	while ((programmed_pages + 1) * FLASH_PAGE_SIZE <= filled) {
+		flash_op op{.offset = BEGIN_OFFSET + head * FLASH_SECTOR_SIZE + programmed_pages * FLASH_PAGE_SIZE,
+			    .data = reinterpret_cast<const uint8_t*>(&buffer) + programmed_pages * FLASH_PAGE_SIZE};
+		if (int err = flash_safe_execute(program_page, &op, UINT32_MAX); err != PICO_OK) {
+			flash_errors.fetch_add(1, std::memory_order_relaxed);
+			LogError("History log: programming page {} of sector {} failed ({})", programmed_pages, head, err);
+			return; // retried with the next record
+		}
+		++programmed_pages;
+	}
+}
+
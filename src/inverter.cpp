@@ -3,6 +3,8 @@
 #include "log_storage.h"
 #include "ranges_util.h"
 #include "inverter_sunspec.h"
+#include "inverter_decode.h"
+#include "psram.h"
 
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
@@ -14,6 +16,7 @@
 #include <lwip/tcp.h>
 
 #include <bitset>
+#include <new>
 
 #define CHECK_INVERTER_CONFIGURED if (!configured_inverters) {LogError("Configured Inverters not set"); return;} parent_task = xTaskGetCurrentTaskHandle()
 #define ASSERT_OK_RETURN(status) {std::string_view s = status; if ((s) != OK) {LogError(s); return;}}
@@ -30,20 +33,6 @@ enum class pcb_state {
 	GET_CONTROLS_INFOS, GET_MPPT_INFOS, GET_STORAGE_INFOS, ENABLE_INVERTER_CONTROL, ENABLE_STORAGE_CONTROL, 
 	WAIT_DATA_RESPONSE, SET_POWER_INVERTER, SET_POWER_STORAGE, SET_MIN_SOC_STORAGE};
 enum class request_type {NONE, SUNS, SUNS_HEADER, IMP_POWER, EXP_POWER, SOC, P_SET};
-struct generic_halfs_registers {
-	constexpr static int OFFSET = 40000;
-	std::array<uint16_t, suns_sizeof(inverter_layout{}) + 100> data;
-};
-struct generic_modbus_layout {
-	generic_halfs_registers halfs_registers{};
-
-	template <typename T>
-	T* get_addr_as(int addr) {
-		if (addr < generic_halfs_registers::OFFSET || addr + suns_sizeof(T{}) > generic_halfs_registers::OFFSET + halfs_registers.data.size())
-			return {};
-		return (T*)(halfs_registers.data.data() + (addr - generic_halfs_registers::OFFSET));
-	};
-};
 constexpr static int NAMEPLATE_REFETCH_S{10 * 60};
 constexpr static int SETTINGS_REFETCH_S{5 * 60};
 constexpr static int STATUS_REFETCH_S{1 * 60};
@@ -73,10 +62,13 @@ struct context_t {
 	int storage_addr{-1};
 	uint32_t storage_fetched_s{}; // refetched all 30 s for up to date 
 	uint16_t tcp_frame{1};
-	modbus_register<generic_modbus_layout> modbus{.addr = 0}; // client always has addr 1
+	modbus_register<generic_modbus_layout> *modbus{}; // register mirror in psram, set up on first discovery
 	int last_modbus_addr{-1};
 };
+// the contexts only hold the small, frequently accessed state machine infos while the
+// full register mirrors (several kB each) are kept in psram
 static static_vector<context_t, MAX_INVERTERS> contexts{};
+static std::array<modbus_register<generic_modbus_layout>, MAX_INVERTERS> modbus_mirrors PSRAM;
 static TaskHandle_t parent_task{};
 
 static void init_pcb(context_t &context);
@@ -91,12 +83,22 @@ void inverter_infos::initiate_discover_inverters(static_vector<ModbusTcpAddr, MA
 	configured_inverters = ivs;
 	CHECK_INVERTER_CONFIGURED;
 	connected_names.resize(configured_inverters->size());
+	if (read_power.size() != configured_inverters->size())
+		++device_generation;
 	read_power.resize(configured_inverters->size());
 	control_infos.resize(configured_inverters->size());
+	if (soc_estimators.size() != configured_inverters->size())
+		for (std::atomic<float> &s: storage_soc)
+			s = -1;
+	soc_estimators.resize(configured_inverters->size());
 	contexts.resize(configured_inverters->size());
 	for(int i: range(connected_names.size())) {
-		if (read_power[i].inverter.device_id == 0)
+		if (read_power[i].inverter.device_id == 0) {
 			read_power[i].inverter.device_id = get_next_device_id();
+			++device_generation;
+		}
+		if (!contexts[i].modbus)
+			contexts[i].modbus = new (&modbus_mirrors[i]) modbus_register<generic_modbus_layout>{.addr = 0}; // client always has addr 1
 		if (!contexts[i].pcb) {
 			cyw43_arch_lwip_begin();
 			init_pcb(contexts[i]);
@@ -118,8 +120,7 @@ void inverter_infos::initiate_discover_inverters(static_vector<ModbusTcpAddr, MA
 void inverter_infos::initiate_retrieve_infos_all() {
 	CHECK_INVERTER_CONFIGURED;
 	// resetting all wait infos
-	for (int i: range(contexts.size()))
-		ulTaskNotifyTakeIndexed(i, pdTRUE, 0);
+	ulTaskNotifyTakeIndexed(INVERTER_NOTIFY_INDEX, pdTRUE, 0);
 	for (int i: range(configured_inverters->size())) {
 		if (connected_names[i].empty() || !contexts[i].connected)
 			continue;
@@ -136,40 +137,47 @@ void inverter_infos::initiate_retrieve_infos_all() {
 }
 void inverter_infos::initiate_send_power_requests_all() {
 	CHECK_INVERTER_CONFIGURED;
-	for (int i: range(configured_inverters->size())) {
-		if (connected_names[i].empty() || !contexts[i].connected || !control_infos[i].is_active())
-			continue;
-		if (contexts[i].state != pcb_state::IDLE) {
-			LogError("Could not send power for {}: {}, retry {}", connected_names[i].sv(), int(contexts[i].state), contexts[i].wait_count);
-			continue;
-		}
-		model_controls *control = contexts[i].modbus.storage.get_addr_as<model_controls>(contexts[i].controls_addr);
-		model_storage *storage = contexts[i].modbus.storage.get_addr_as<model_storage>(contexts[i].storage_addr);
-		// convert requested power to relative values
-		float inv_power_r = std::clamp(control_infos[i].requested_power, .0f, control_infos[i].power_max) / control_infos[i].power_max;
-		control->WMaxLimPct = modbus_swap(from_float(inv_power_r, modbus_swap_i16(control->WMaxLimPct_SF)));
-		bool charge = control_infos[i].requested_power < 0;
-		float bat_min_soc = charge ? 100: 0;
-		float bat_cha_r = charge ? 
-					(-control_infos[i].requested_power + read_power[i].pv.exp_w) / control_infos[i].power_max_cha:
-					100;
-		// battery discharge rate always stays at 100%, discharging is controlled via max inverter power
-		storage->MinRsvPct = modbus_swap(from_float(bat_min_soc, modbus_swap_i16(storage->MinRsvPct_SF)));
-		storage->WChaMax = modbus_swap(from_float(bat_cha_r, modbus_swap_i16(storage->WChaMax_SF)));
-
-		contexts[i].wait_receive = true;
-		contexts[i].state = pcb_state::SET_POWER_INVERTER;
-		cyw43_arch_lwip_begin();
-		advance_context_state(contexts[i]);
-		cyw43_arch_lwip_end();
+	for (int i: range(configured_inverters->size()))
+		initiate_send_power_request(i, control_infos[i].requested_power);
+}
+void inverter_infos::initiate_send_power_request(int i, float requested_power) {
+	CHECK_INVERTER_CONFIGURED;
+	if (i < 0 || i >= configured_inverters->size() || connected_names[i].empty() || !contexts[i].connected || !control_infos[i].is_active())
+		return;
+	if (contexts[i].state != pcb_state::IDLE) {
+		LogError("Could not send power for {}: {}, retry {}", connected_names[i].sv(), int(contexts[i].state), contexts[i].wait_count);
+		return;
 	}
+	model_controls *control = contexts[i].modbus->storage.get_addr_as<model_controls>(contexts[i].controls_addr);
+	model_storage *storage = contexts[i].modbus->storage.get_addr_as<model_storage>(contexts[i].storage_addr);
+	// convert requested power to relative values
+	float inv_power_r = std::clamp(requested_power, .0f, control_infos[i].power_max) / control_infos[i].power_max;
+	control->WMaxLimPct = modbus_swap(from_float(inv_power_r, modbus_swap_i16(control->WMaxLimPct_SF)));
+	bool charge = requested_power < 0;
+	float bat_min_soc = charge ? 100: 0;
+	float bat_cha_r = charge ? 
+				(-requested_power + read_power[i].pv.exp_w) / control_infos[i].power_max_cha:
+				100;
+	// battery discharge rate always stays at 100%, discharging is controlled via max inverter power
+	storage->MinRsvPct = modbus_swap(from_float(bat_min_soc, modbus_swap_i16(storage->MinRsvPct_SF)));
+	storage->WChaMax = modbus_swap(from_float(bat_cha_r, modbus_swap_i16(storage->WChaMax_SF)));
+
+	contexts[i].wait_receive = true;
+	contexts[i].state = pcb_state::SET_POWER_INVERTER;
+	cyw43_arch_lwip_begin();
+	advance_context_state(contexts[i]);
+	cyw43_arch_lwip_end();
 }
 void inverter_infos::wait_all(uint32_t timeout_ms) {
 	CHECK_INVERTER_CONFIGURED;
 	uint32_t end_ms = time_ms() + timeout_ms;
-	for (int i: range(contexts.size()))
-		if (contexts[i].connected && contexts[i].wait_receive)
-			ulTaskNotifyTakeIndexed(i, pdTRUE, pdMS_TO_TICKS(std::max(0, int(end_ms) - int(time_ms()))));
+	// each context gives one notification when it gets back to idle, so wait until no context is waiting anymore
+	const auto waiting = [](const context_t &c) { return c.connected && c.wait_receive; };
+	while (contexts | find{waiting}) {
+		int remaining_ms = int(end_ms) - int(time_ms());
+		if (remaining_ms <= 0 || 0 == ulTaskNotifyTakeIndexed(INVERTER_NOTIFY_INDEX, pdFALSE, pdMS_TO_TICKS(remaining_ms)))
+			break;
+	}
 	for (int i: range(contexts.size())) {
 		if (!control_infos[i].is_active()) {
 			control_infos[i].requested_power = 0;
@@ -177,6 +185,13 @@ void inverter_infos::wait_all(uint32_t timeout_ms) {
 			read_power[i].pv.imp_w = read_power[i].pv.exp_w = 0;
 			read_power[i].battery.imp_w = read_power[i].battery.exp_w = 0;
 			read_power[i].bat_soc = 0;
+			soc_estimators[i] = {};
+			storage_soc[i] = -1;
+		} else if (read_power[i].battery.device_id != 0) {
+			// the estimator is only used by this task, the callback only hands over the read
+			if (float soc = storage_soc[i].exchange(-1); soc >= 0)
+				soc_estimators[i].correct(soc);
+			read_power[i].bat_soc = soc_estimators[i].integrate(read_power[i].battery.imp_w - read_power[i].battery.exp_w, time_us_64());
 		}
 		if (contexts[i].state == pcb_state::IDLE) {
 			contexts[i].wait_count = 0;
@@ -230,7 +245,7 @@ static void advance_context_state(context_t &context, struct pbuf *p) {
 		case pcb_state::CHECK_SUNS: {
 			LogInfo("Checking sunspec id");
 			parse_modbus_frame(context, p);
-			const string<4> *hdr = context.modbus.storage.get_addr_as<string<4>>(context.last_modbus_addr);
+			const string<4> *hdr = context.modbus->storage.get_addr_as<string<4>>(context.last_modbus_addr);
 			LogInfo("Got id: {}, at addr {}", to_sv(*hdr), context.last_modbus_addr);
 			if (!hdr || to_sv(*hdr) != "SunS") {
 				LogError("Invalid sunspec inverter, removing");
@@ -244,7 +259,7 @@ static void advance_context_state(context_t &context, struct pbuf *p) {
 		case pcb_state::FIND_COMMON_HDR: {
 			LogInfo("Searching common header");
 			parse_modbus_frame(context, p);
-			const suns_hdr *hdr = context.modbus.storage.get_addr_as<suns_hdr>(context.last_modbus_addr);
+			const suns_hdr *hdr = context.modbus->storage.get_addr_as<suns_hdr>(context.last_modbus_addr);
 			if (!hdr) {
 				LogError("Could not get header, overflow");
 				context.request_close = true;
@@ -262,7 +277,7 @@ static void advance_context_state(context_t &context, struct pbuf *p) {
 		case pcb_state::GET_COMMON_INFOS: {
 			LogInfo("Reading common info");
 			parse_modbus_frame(context, p);
-			const string<32> *common = context.modbus.storage.get_addr_as<string<32>>(context.last_modbus_addr);
+			const string<32> *common = context.modbus->storage.get_addr_as<string<32>>(context.last_modbus_addr);
 			if (!common) {
 				LogError("Could not get model common registers");
 				context.request_close = true;
@@ -276,7 +291,7 @@ static void advance_context_state(context_t &context, struct pbuf *p) {
 		}
 		case pcb_state::FIND_DATA_HDR: {
 			parse_modbus_frame(context, p);
-			const suns_hdr *hdr = context.modbus.storage.get_addr_as<suns_hdr>(context.last_modbus_addr);
+			const suns_hdr *hdr = context.modbus->storage.get_addr_as<suns_hdr>(context.last_modbus_addr);
 			if (!hdr) {
 				LogError("Could not get header, overflow");
 				context.request_close = true;
@@ -309,7 +324,7 @@ static void advance_context_state(context_t &context, struct pbuf *p) {
 				context.request_close = true;
 				break;
 			}
-			model_storage *storage = context.modbus.storage.get_addr_as<model_storage>(context.storage_addr);
+			model_storage *storage = context.modbus->storage.get_addr_as<model_storage>(context.storage_addr);
 			storage->StorCtl_Mod = modbus_swap(1 | 2); //  Bit0 enable charge power override, Bit1 enable discharge override
 			context.state = pcb_state::ENABLE_INVERTER_CONTROL;
 			request_modbus_registers_write(context, context.storage_addr + suns_offsetof(&model_storage::StorCtl_Mod), suns_sizeof<decltype(model_storage::StorCtl_Mod)>());
@@ -322,7 +337,7 @@ static void advance_context_state(context_t &context, struct pbuf *p) {
 				context.request_close = true;
 				break;
 			}
-			model_controls *controls = context.modbus.storage.get_addr_as<model_controls>(context.controls_addr);
+			model_controls *controls = context.modbus->storage.get_addr_as<model_controls>(context.controls_addr);
 			controls->WMaxLim_Ena = modbus_swap(1);
 			context.state = pcb_state::WAIT_DATA_RESPONSE;
 			request_modbus_registers_write(context, context.controls_addr + suns_offsetof(&model_controls::WMaxLim_Ena), suns_sizeof<decltype(model_controls::WMaxLim_Ena)>());
@@ -432,15 +447,15 @@ static void advance_context_state(context_t &context, struct pbuf *p) {
 	if (context.state == pcb_state::IDLE)
 		context.wait_receive = false;
 	if (context.state == pcb_state::IDLE && prev_state != pcb_state::IDLE) // wakeup main task
-		xTaskNotifyGiveIndexed(parent_task, i);
+		xTaskNotifyGiveIndexed(parent_task, INVERTER_NOTIFY_INDEX);
 }
 static void request_modbus_registers(context_t &context, int offset, int register_count) {
 	// LogInfo("Getting registers {}-{}", offset, offset + register_count);
 	int i = &context - contexts.begin();
-	context.modbus.switch_to_request();
+	context.modbus->switch_to_request();
 	context.last_modbus_addr = offset;
-	ASSERT_OK_RETURN(context.modbus.start_tcp_frame(context.tcp_frame++, inverters().configured_inverters[0][i].modbus_id));
-	auto [res, err] = context.modbus.get_frame_read(libmodbus_static::register_t::HALFS, offset, register_count);
+	ASSERT_OK_RETURN(context.modbus->start_tcp_frame(context.tcp_frame++, inverters().configured_inverters[0][i].modbus_id));
+	auto [res, err] = context.modbus->get_frame_read(libmodbus_static::register_t::HALFS, offset, register_count);
 	ASSERT_OK_RETURN(err);
 	err_t error = tcp_write(context.pcb, res.data(), res.size(), 0);
 	if (error != ERR_OK) {
@@ -453,12 +468,12 @@ static void request_modbus_registers(context_t &context, int offset, int registe
 }
 static void request_modbus_registers_write(context_t &context, int offset, int register_count) {
 	int i = &context - contexts.begin();
-	context.modbus.switch_to_request();
+	context.modbus->switch_to_request();
 	context.last_modbus_addr = offset;
-	uint16_t* data_start = context.modbus.storage.halfs_registers.data.data() + offset - generic_halfs_registers::OFFSET;
+	uint16_t* data_start = context.modbus->storage.halfs_registers.data.data() + offset - generic_halfs_registers::OFFSET;
 	std::span<uint8_t> data{(uint8_t*)data_start, (uint8_t*)(data_start + register_count)};
-	ASSERT_OK_RETURN(context.modbus.start_tcp_frame(context.tcp_frame++, inverters().configured_inverters[0][i].modbus_id));
-	auto [res, err] = context.modbus.get_frame_write(libmodbus_static::register_t::HALFS_WRITE, offset, data);
+	ASSERT_OK_RETURN(context.modbus->start_tcp_frame(context.tcp_frame++, inverters().configured_inverters[0][i].modbus_id));
+	auto [res, err] = context.modbus->get_frame_write(libmodbus_static::register_t::HALFS_WRITE, offset, data);
 	ASSERT_OK_RETURN(err);
 	err_t error = tcp_write(context.pcb, res.data(), res.size(), 0);
 	if (error != ERR_OK)
@@ -469,10 +484,10 @@ static void parse_modbus_frame(context_t &context, struct pbuf *&p) {
 		LogError("Cant parse modbus frame because its empty");
 	}
 	if (p->tot_len > 0) {
-		context.modbus.switch_to_response();
+		context.modbus->switch_to_response();
 		for (int i: range(p->tot_len)) {
 			// LogInfo("Res byte: {:x}", pbuf_get_at(p, i));
-			std::string_view r = context.modbus.process_tcp(pbuf_get_at(p, i)).err;
+			std::string_view r = context.modbus->process_tcp(pbuf_get_at(p, i)).err;
 			if (r == IN_PROGRESS)
 				continue;
 			if (r != OK) {
@@ -487,15 +502,10 @@ static void parse_modbus_frame(context_t &context, struct pbuf *&p) {
 	int i = &context - contexts.begin();
 	inverters().control_infos[i].last_connection_s = time_s();
 	if (context.last_modbus_addr == context.inverter_addr) {
-		const model_inverter *inverter = context.modbus.storage.get_addr_as<model_inverter>(context.inverter_addr);
-		float w = modbus_swap_f(inverter->W);
-		inverters().read_power[i].inverter.imp_w = inverters().read_power[i].inverter.exp_w = 0;
-		if (w < 0)
-			inverters().read_power[i].inverter.imp_w = -w;
-		else
-			inverters().read_power[i].inverter.exp_w = w;
+		const model_inverter *inverter = context.modbus->storage.get_addr_as<model_inverter>(context.inverter_addr);
+		inverter_decode::ac_power(*inverter, inverters().read_power[i].inverter);
 	} else if (context.last_modbus_addr == context.nameplate_addr) {
-		const model_nameplate *nameplate = context.modbus.storage.get_addr_as<model_nameplate>(context.nameplate_addr);
+		const model_nameplate *nameplate = context.modbus->storage.get_addr_as<model_nameplate>(context.nameplate_addr);
 		float max_pow = to_float(modbus_swap(nameplate->WRtg), modbus_swap_i16(nameplate->WRtg_SF));
 		float max_pow_bat_cha = to_float(modbus_swap(nameplate->MaxChaRte), modbus_swap_i16(nameplate->MaxChaRte_SF));
 		float max_pow_bat_discha = to_float(modbus_swap(nameplate->MaxDisChaRte), modbus_swap_i16(nameplate->MaxDisChaRte_SF));
@@ -504,43 +514,33 @@ static void parse_modbus_frame(context_t &context, struct pbuf *&p) {
 		pi.power_max_cha = max_pow_bat_cha;
 		pi.power_max_discha = max_pow_bat_discha;
 	} else if (context.last_modbus_addr == context.settings_addr) {
-		const model_settings *settings = context.modbus.storage.get_addr_as<model_settings>(context.settings_addr);
+		const model_settings *settings = context.modbus->storage.get_addr_as<model_settings>(context.settings_addr);
 		float max_w = to_float(modbus_swap(settings->WMax), modbus_swap_i16(settings->WMax_SF));
 		inverters().control_infos[i].power_max = max_w;
 	} else if (context.last_modbus_addr == context.status_addr) {
-		const model_status *status = context.modbus.storage.get_addr_as<model_status>(context.status_addr);
+		const model_status *status = context.modbus->storage.get_addr_as<model_status>(context.status_addr);
 		bitfield16 pv_status = modbus_swap(status->PVConn);
 		bitfield16 bat_status = modbus_swap(status->StorConn);
-		if (pv_status > 0 && inverters().read_power[i].pv.device_id == 0)
-			inverters().read_power[i].pv.device_id = get_next_device_id();
-		if (pv_status == 0 && inverters().read_power[i].pv.device_id != 0)
-			inverters().read_power[i].pv.device_id = 0;
-		if (bat_status > 0 && inverters().read_power[i].battery.device_id == 0)
-			inverters().read_power[i].battery.device_id = get_next_device_id();
-		if (bat_status == 0 && inverters().read_power[i].battery.device_id != 0)
-			inverters().read_power[i].battery.device_id = 0;
+		int &pv_id = inverters().read_power[i].pv.device_id;
+		int &battery_id = inverters().read_power[i].battery.device_id;
+		if ((pv_status > 0) != (pv_id != 0) || (bat_status > 0) != (battery_id != 0))
+			++inverters().device_generation;
+		if (pv_status > 0 && pv_id == 0)
+			pv_id = get_next_device_id();
+		if (pv_status == 0 && pv_id != 0)
+			pv_id = 0;
+		if (bat_status > 0 && battery_id == 0)
+			battery_id = get_next_device_id();
+		if (bat_status == 0 && battery_id != 0)
+			battery_id = 0;
 	} else if (context.last_modbus_addr == context.mppt_addr) {
-		constexpr uint16_t mppt_hdr_size = suns_sizeof(model_mppt{}) - 4 * suns_sizeof(mppt_infos{});
-		static_assert(mppt_hdr_size == 10);
-		const model_mppt *mppt = context.modbus.storage.get_addr_as<model_mppt>(context.mppt_addr);
-		int mppt_count = modbus_swap(mppt->N);
-		const mppt_infos *mppts = (const mppt_infos*)(((const uint16_t*)mppt) + mppt_hdr_size);
+		const model_mppt *mppt = context.modbus->storage.get_addr_as<model_mppt>(context.mppt_addr);
 		// if battery is enabled it is expected to have the last 2 entries of the mppt infos being battery charge and discharge
-		int bat_count = inverters().read_power[i].battery.device_id == 0 ? 0: 2;
-		inverters().read_power[i].pv.exp_w = 0;
-		int pv_count = mppt_count - bat_count;
-		int16_t pf = modbus_swap_i16(mppt->DCW_SF);
-		for (int j: range(pv_count))
-			inverters().read_power[i].pv.exp_w += to_float(modbus_swap(mppts[j].module_DCW), pf);
-		if (bat_count > 0) {
-			// charging
-			inverters().read_power[i].battery.imp_w = to_float(modbus_swap(mppts[mppt_count - 2].module_DCW), pf);
-			// discharging
-			inverters().read_power[i].battery.exp_w = to_float(modbus_swap(mppts[mppt_count - 1].module_DCW), pf);
-		}
+		InverterGroup &ig = inverters().read_power[i];
+		inverter_decode::dc_power(*mppt, ig.battery.device_id != 0, ig.pv, ig.battery);
 	} else if (context.last_modbus_addr == context.storage_addr) {
-		const model_storage *storage = context.modbus.storage.get_addr_as<model_storage>(context.storage_addr);
-		inverters().read_power[i].bat_soc = to_float(modbus_swap(storage->ChaState), modbus_swap_i16(storage->ChaState_SF));
+		const model_storage *storage = context.modbus->storage.get_addr_as<model_storage>(context.storage_addr);
+		inverters().storage_soc[i] = std::max(to_float(modbus_swap(storage->ChaState), modbus_swap_i16(storage->ChaState_SF)), 0.f);
 		inverters().control_infos[i].power_max_cha = to_float(modbus_swap(storage->WChaMax), modbus_swap_i16(storage->WChaMax_SF));
 		inverters().control_infos[i].power_max_discha = inverters().control_infos[i].power_max_cha;
 	}
@@ -598,5 +598,5 @@ static void tcp_err_cb(void *arg, err_t err) {
 	self.pcb = {};
 	self.connected = false;
 	self.state = pcb_state::IDLE;
-	xTaskNotifyGiveIndexed(parent_task, &self - contexts.begin());
+	xTaskNotifyGiveIndexed(parent_task, INVERTER_NOTIFY_INDEX);
 }
@@ -0,0 +1,337 @@
+#include "load.h"
+#include "modbus-register.h"
+#include "log_storage.h"
+#include "ranges_util.h"
+#include "psram.h"
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include <lwip/pbuf.h>
+#include <lwip/tcp.h>
+
+#include <new>
+
+#define CHECK_LOADS_CONFIGURED if (!configured_loads) {LogError("Configured loads not set"); return;} parent_task = xTaskGetCurrentTaskHandle()
+#define ASSERT_OK_RETURN(status) {std::string_view s = status; if ((s) != OK) {LogError(s); return;}}
+
+using namespace libmodbus_static;
+using namespace g;
+constexpr uint32_t time_ms() { return time_us_64() / 1000; }
+constexpr uint32_t time_s() { return time_us_64() / 1000000; }
+
+namespace e {
+enum class load_state {IDLE, CONNECTING, FETCH_POWER, WAIT_POWER_RESPONSE, WAIT_SETPOINT_RESPONSE};
+}
+
+// loads have no self describing register layout, so only a fixed window starting at 0 is mirrored
+struct load_halfs_registers {
+	constexpr static int OFFSET = 0;
+	std::array<uint16_t, 2048> data;
+};
+struct load_modbus_layout {
+	load_halfs_registers halfs_registers{};
+};
+struct load_context {
+	struct tcp_pcb *pcb{};
+	bool connected{};
+	bool wait_receive{};
+	bool request_close{};
+	e::load_state state{e::load_state::IDLE};
+	int wait_count{};
+	uint16_t tcp_frame{1};
+	uint16_t written_setpoint{0xffff}; // last setpoint sent to the load, 0xffff forces a write
+	uint32_t written_s{};
+	modbus_register<load_modbus_layout> *modbus{}; // register mirror in psram, set up on first discovery
+};
+static static_vector<load_context, MAX_LOADS> contexts{};
+static std::array<modbus_register<load_modbus_layout>, MAX_LOADS> modbus_mirrors PSRAM;
+static TaskHandle_t parent_task{};
+
+static void init_pcb(load_context &context);
+static void tcp_err_cb(void *arg, err_t err);
+static err_t tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
+static err_t tcp_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len);
+static err_t tcp_connect_cb(void *arg, struct tcp_pcb *tpcb, err_t err);
+static err_t tcp_pcb_close(tcp_pcb *pcb);
+static void advance_context_state(load_context &context, struct pbuf *p = {});
+
+static bool registers_valid(const LoadConfig &c) {
+	return c.power_reg < load_halfs_registers{}.data.size() && c.setpoint_reg < load_halfs_registers{}.data.size();
+}
+// register value for the requested power, current in A for wallboxes and on/off for sg ready
+static uint16_t to_setpoint(const LoadConfig &c, float requested_w) {
+	if (c.type == LoadType::SG_READY)
+		return requested_w > 0;
+	return uint16_t(std::round(requested_w / (load_infos::WALLBOX_VOLTAGE * c.phases)));
+}
+
+void load_infos::initiate_discover_loads(const static_vector<LoadConfig, MAX_LOADS> *ls) {
+	configured_loads = ls;
+	CHECK_LOADS_CONFIGURED;
+	connected_names.resize(configured_loads->size());
+	loads.resize(configured_loads->size());
+	contexts.resize(configured_loads->size());
+	for (int i: range(loads.size())) {
+		const LoadConfig &c = configured_loads[0][i];
+		LoadInfo &l = loads[i];
+		// constraints are always taken from the config to directly apply changed settings
+		if (c.type == LoadType::WALLBOX) {
+			float amps_to_w = WALLBOX_VOLTAGE * c.phases;
+			l.power_min = WALLBOX_MIN_CURRENT * amps_to_w;
+			l.power_max = std::max(c.power_max, WALLBOX_MIN_CURRENT) * amps_to_w;
+			l.power_step = amps_to_w;
+			l.min_switch_s = WALLBOX_SWITCH_S;
+		} else {
+			l.power_min = l.power_max = l.power_step = c.power_max;
+			l.min_switch_s = SG_READY_SWITCH_S;
+		}
+		if (l.power.device_id == 0)
+			l.power.device_id = get_next_device_id();
+		if (!registers_valid(c)) {
+			if (connected_names[i].empty())
+				LogError("Load {} registers not supported, have to be below {}", i, load_halfs_registers{}.data.size());
+			connected_names[i].fill(NOT_CONNECTED);
+			continue;
+		}
+		if (!contexts[i].modbus)
+			contexts[i].modbus = new (&modbus_mirrors[i]) modbus_register<load_modbus_layout>{.addr = 0}; // client always has addr 1
+		if (!contexts[i].pcb) {
+			cyw43_arch_lwip_begin();
+			init_pcb(contexts[i]);
+			cyw43_arch_lwip_end();
+		}
+		if (!contexts[i].pcb)
+			continue;
+		ip_addr_t ip{.addr = PP_HTONL(c.addr.ip)};
+		if (!contexts[i].connected) {
+			LogInfo("Tcp connect load {}", i);
+			contexts[i].state = e::load_state::CONNECTING;
+			contexts[i].wait_receive = true;
+			cyw43_arch_lwip_begin();
+			tcp_connect(contexts[i].pcb, &ip, c.addr.port, tcp_connect_cb);
+			cyw43_arch_lwip_end();
+		}
+	}
+}
+void load_infos::initiate_update_all() {
+	CHECK_LOADS_CONFIGURED;
+	ulTaskNotifyTakeIndexed(LOAD_NOTIFY_INDEX, pdTRUE, 0);
+	for (int i: range(contexts.size())) {
+		if (!contexts[i].connected)
+			continue;
+		if (contexts[i].state != e::load_state::IDLE) {
+			LogError("Start update failed load {}: {}, retry {}", i, int(contexts[i].state), contexts[i].wait_count);
+			continue;
+		}
+		contexts[i].wait_receive = true;
+		contexts[i].state = e::load_state::FETCH_POWER;
+		cyw43_arch_lwip_begin();
+		advance_context_state(contexts[i]);
+		cyw43_arch_lwip_end();
+	}
+}
+void load_infos::wait_all(uint32_t timeout_ms) {
+	CHECK_LOADS_CONFIGURED;
+	uint32_t end_ms = time_ms() + timeout_ms;
+	const auto waiting = [](const load_context &c) { return c.connected && c.wait_receive; };
+	while (contexts | find{waiting}) {
+		int remaining_ms = int(end_ms) - int(time_ms());
+		if (remaining_ms <= 0 || 0 == ulTaskNotifyTakeIndexed(LOAD_NOTIFY_INDEX, pdFALSE, pdMS_TO_TICKS(remaining_ms)))
+			break;
+	}
+	for (int i: range(contexts.size())) {
+		if (!loads[i].is_active()) {
+			loads[i].power.imp_w = loads[i].power.exp_w = 0;
+			loads[i].requested_power = 0;
+			contexts[i].written_setpoint = 0xffff;
+		}
+		if (contexts[i].state == e::load_state::IDLE) {
+			contexts[i].wait_count = 0;
+			contexts[i].wait_receive = false;
+		}
+		bool timeout = ++contexts[i].wait_count > 3;
+		if (timeout) {
+			contexts[i].wait_count = 0;
+			LogInfo("Load wait expired, initiate reconnection");
+		}
+		if (contexts[i].request_close || timeout) {
+			cyw43_arch_lwip_begin();
+			tcp_pcb_close(contexts[i].pcb); // only close the pcb, dont reorder
+			cyw43_arch_lwip_end();
+			contexts[i].pcb = {};
+			contexts[i].connected = false;
+			contexts[i].request_close = false;
+			if (!timeout)
+				connected_names[i].fill(CONNECTING);
+		}
+	}
+}
+
+// private implementations
+
+// modbus logic functions ------------------------------------------------------------------------------
+static void request_modbus_registers(load_context &context, int offset, int register_count);
+static void request_modbus_registers_write(load_context &context, int offset, int register_count);
+static void parse_modbus_frame(load_context &context, struct pbuf *&p);
+static void advance_context_state(load_context &context, struct pbuf *p) {
+	int i = &context - contexts.begin();
+	const LoadConfig &c = loads().configured_loads[0][i];
+	LoadInfo &l = loads().loads[i];
+	e::load_state prev_state = context.state;
+	switch(context.state) {
+		case e::load_state::IDLE:
+			context.wait_count = 0;
+			break;
+		case e::load_state::CONNECTING:
+			context.connected = true;
+			context.written_setpoint = 0xffff;
+			loads().connected_names[i].fill(c.type == LoadType::WALLBOX ? "Wallbox": "Wärmepumpe");
+			LogInfo("Load {} connected", i);
+			context.state = e::load_state::IDLE;
+			break;
+		case e::load_state::FETCH_POWER:
+			context.state = e::load_state::WAIT_POWER_RESPONSE;
+			request_modbus_registers(context, c.power_reg, 1);
+			break;
+		case e::load_state::WAIT_POWER_RESPONSE: {
+			if (p)
+				parse_modbus_frame(context, p);
+			float w = int16_t(modbus_swap(context.modbus->storage.halfs_registers.data[c.power_reg]));
+			l.power.imp_w = std::max(w, .0f);
+			l.power.exp_w = -std::min(w, .0f);
+			l.last_connection_s = time_s();
+			// setpoint is only written on change and regularly for devices which fall back without updates
+			uint16_t setpoint = to_setpoint(c, l.requested_power);
+			if (setpoint == context.written_setpoint && time_s() - context.written_s < load_infos::SETPOINT_REFRESH_S) {
+				context.state = e::load_state::IDLE;
+				break;
+			}
+			context.modbus->storage.halfs_registers.data[c.setpoint_reg] = modbus_swap(setpoint);
+			context.written_setpoint = setpoint;
+			context.written_s = time_s();
+			context.state = e::load_state::WAIT_SETPOINT_RESPONSE;
+			request_modbus_registers_write(context, c.setpoint_reg, 1);
+			break;
+		}
+		case e::load_state::WAIT_SETPOINT_RESPONSE:
+			if (p)
+				parse_modbus_frame(context, p);
+			context.state = e::load_state::IDLE;
+			break;
+	}
+	if (context.state == e::load_state::IDLE)
+		context.wait_receive = false;
+	if (context.state == e::load_state::IDLE && prev_state != e::load_state::IDLE) // wakeup main task
+		xTaskNotifyGiveIndexed(parent_task, LOAD_NOTIFY_INDEX);
+}
+static void request_modbus_registers(load_context &context, int offset, int register_count) {
+	int i = &context - contexts.begin();
+	context.modbus->switch_to_request();
+	ASSERT_OK_RETURN(context.modbus->start_tcp_frame(context.tcp_frame++, loads().configured_loads[0][i].addr.modbus_id));
+	auto [res, err] = context.modbus->get_frame_read(libmodbus_static::register_t::HALFS, offset, register_count);
+	ASSERT_OK_RETURN(err);
+	err_t error = tcp_write(context.pcb, res.data(), res.size(), 0);
+	if (error != ERR_OK) {
+		LogError("Error sending modbus read frame {}", error);
+		return;
+	}
+	error = tcp_output(context.pcb);
+	if (error != ERR_OK)
+		LogError("Error output modbus read frame {}", error);
+}
+static void request_modbus_registers_write(load_context &context, int offset, int register_count) {
+	int i = &context - contexts.begin();
+	context.modbus->switch_to_request();
+	uint16_t* data_start = context.modbus->storage.halfs_registers.data.data() + offset - load_halfs_registers::OFFSET;
+	std::span<uint8_t> data{(uint8_t*)data_start, (uint8_t*)(data_start + register_count)};
+	ASSERT_OK_RETURN(context.modbus->start_tcp_frame(context.tcp_frame++, loads().configured_loads[0][i].addr.modbus_id));
+	auto [res, err] = context.modbus->get_frame_write(libmodbus_static::register_t::HALFS_WRITE, offset, data);
+	ASSERT_OK_RETURN(err);
+	err_t error = tcp_write(context.pcb, res.data(), res.size(), 0);
+	if (error != ERR_OK) {
+		LogError("Error sending modbus write frame {}", error);
+		return;
+	}
+	error = tcp_output(context.pcb);
+	if (error != ERR_OK)
+		LogError("Error output modbus write frame {}", error);
+}
+static void parse_modbus_frame(load_context &context, struct pbuf *&p) {
+	if (!p) {
+		LogError("Cant parse modbus frame because its empty");
+		return;
+	}
+	if (p->tot_len > 0) {
+		context.modbus->switch_to_response();
+		for (int i: range(p->tot_len)) {
+			std::string_view r = context.modbus->process_tcp(pbuf_get_at(p, i)).err;
+			if (r == IN_PROGRESS)
+				continue;
+			if (r != OK) {
+				LogError("Modbus parsing failed with {}", r);
+				continue;
+			}
+		}
+	}
+	pbuf_free(p);
+	p = nullptr;
+}
+
+// pcb handle functions --------------------------------------------------------------------------------
+static void init_pcb(load_context &context) {
+	struct tcp_pcb* &pcb = context.pcb;
+	pcb = tcp_new();
+	if (!pcb) {
+		LogError("Failed to create load pcb");
+		return;
+	}
+
+	tcp_arg(pcb, &context);
+	tcp_err(pcb, tcp_err_cb);
+	tcp_recv(pcb, tcp_recv_cb);
+	tcp_sent(pcb, tcp_sent_cb);
+}
+static err_t tcp_pcb_close(tcp_pcb *pcb) {
+	LogInfo("close load tcp_pcb");
+	err_t err = ERR_OK;
+	if (pcb) {
+		tcp_arg(pcb, NULL);
+		tcp_poll(pcb, NULL, 0);
+		tcp_sent(pcb, NULL);
+		tcp_recv(pcb, NULL);
+		tcp_err(pcb, NULL);
+		if (tcp_close(pcb) != ERR_OK) {
+			LogError("Close failed on pcb, calling abort");
+			tcp_abort(pcb);
+			err = ERR_ABRT;
+		}
+	};
+	return err;
+}
+static err_t tcp_connect_cb(void *arg, struct tcp_pcb *tpcb, err_t err) {
+	load_context &self = (*(load_context*)arg);
+	self.pcb = tpcb;
+	self.pcb->so_options |= SOF_KEEPALIVE;
+	advance_context_state(self);
+	return ERR_OK;
+}
+static err_t tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
+	load_context &self = (*(load_context*)arg);
+	advance_context_state(self, p);
+	return ERR_OK;
+}
+static err_t tcp_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+	return ERR_OK;
+}
+static void tcp_err_cb(void *arg, err_t err) {
+	LogInfo("Load error callback: {}", err);
+	load_context &self = (*(load_context*)arg);
+	self.pcb = {};
+	self.connected = false;
+	self.state = e::load_state::IDLE;
+	xTaskNotifyGiveIndexed(parent_task, LOAD_NOTIFY_INDEX);
+}
@@ -36,10 +36,24 @@
 #include "inverter.h"
 #include "meter.h"
 #include "history_data.h"
+#include "history_log.h"
 #include "emm.h"
+#include "load.h"
+#include "control_trace.h"
+#include "power_flow.h"
+#include "energy_profile.h"
+#include "energy_counters.h"
+#include "auto_tune.h"
+#include "what_if.h"
+#include "control_timing.h"
+#include "inverter_decode.h"
 
 #include <chrono>
 
+// the linker checks the whole psram section, this gives the reason early for the largest parts
+static_assert(sizeof(g::history_arena) + sizeof(g::trace_frames_psram) + MAX_INVERTERS * sizeof(generic_modbus_layout) <= PSRAM_SIZE,
+	      "history arena, trace and inverter register mirrors exceed the psram, reduce HISTORY_ARENA_KB, TRACE_KB or MAX_INVERTERS");
+
 #define TEST_TASK_PRIORITY ( tskIDLE_PRIORITY + 1UL )
 
 constexpr UBaseType_t STANDARD_TASK_PRIORITY = tskIDLE_PRIORITY + 1ul;
@@ -91,16 +105,7 @@ static Touchscreen& touchscreen() {
 }
 
 static std::atomic<float> page_offset;
-
-static PowerInfo home_power {.device_id = HOME_ID, .imp_w = 2700, .exp_w = 0};
-void update_home_power() {
-	float int_power{};
-	for (const InverterGroup &pi: g::inverters().read_power)
-		int_power += pi.inverter.exp_w - pi.inverter.imp_w;
-	int_power += -g::meter().power_info.exp_w + g::meter().power_info.imp_w;
-	home_power.imp_w = std::max(int_power, 0.f);
-	home_power.exp_w = -std::min(int_power, 0.f);
-}
+static int meter_phase_series{-1}; // history of the meter power per phase, registered before the tasks start
 
 std::array<std::string_view, 4> texts{"Hello darkness", "my old friend,", "shall peace and glory", "thy remove"};
 void display_task(void *) {
@@ -117,6 +122,8 @@ void display_task(void *) {
 	float dms{};
 	float cur_page_offset = page_offset;
 	float fps{};
+	static PowerFlow power_flow{}; // too big for the task stack
+	uint32_t power_flow_version{};
 	for (;;) {
 		uint32_t ms = time_ms();
 
@@ -125,14 +132,28 @@ void display_task(void *) {
 			screen().wait_for_vsync();
 			persistent_storage_t::Default().write(settings::Default(), &persistent_storage_layout::persistent_settings);
 		}
-		if (request_settings_load)
+		if (request_settings_load) {
 			persistent_storage_t::Default().read(&persistent_storage_layout::persistent_settings, settings::Default());
+			settings::Default().sanitize();
+		}
 		if (request_store_wifi) {
 			screen().wait_for_vsync();
 			persistent_storage_t::Default().write(wifi_storage::Default().ssid_wifi, &persistent_storage_layout::ssid_wifi);
 			persistent_storage_t::Default().write(wifi_storage::Default().pwd_wifi, &persistent_storage_layout::pwd_wifi);
 		}
-		request_settings_store = request_settings_load = request_store_wifi = false;
+		if (request_profile_store) {
+			static energy_profile_data profile{}; // copy to not block the control task during the flash write
+			{ scoped_lock lock{energy_profile::Default().m}; profile = energy_profile::Default().data; }
+			screen().wait_for_vsync();
+			persistent_storage_t::Default().write(profile, &persistent_storage_layout::persistent_profile);
+		}
+		if (request_counters_store) {
+			static energy_counters_data counters{};
+			{ scoped_lock lock{energy_counters::Default().m}; counters = energy_counters::Default().data; }
+			screen().wait_for_vsync();
+			persistent_storage_t::Default().write(counters, &persistent_storage_layout::persistent_counters);
+		}
+		request_settings_store = request_settings_load = request_store_wifi = request_profile_store = request_counters_store = false;
 
 		uint32_t delta_ms = ms - last_ms;
 		last_ms = ms;
@@ -153,8 +174,9 @@ void display_task(void *) {
 		draw_ctx().draw.text(fps_string, {210, 1}, 40, 1);
 		fps_string = static_format<64>("{0:%d}.{0:%m}.{0:%y}\n{0:%R}", epoch_t);
 		draw_ctx().draw.text(fps_string, {5, 1}, 80, 1);
-		update_home_power();
-		overview_page().draw(draw_ctx().draw, {ms, delta_ms}, cur_page_offset, g::inverters().read_power.to_span(), home_power, g::meter().power_info);
+		if (uint32_t v = g::power_flow.version(); v != power_flow_version && g::power_flow.read(power_flow))
+			power_flow_version = v;
+		overview_page().draw(draw_ctx().draw, {ms, delta_ms}, cur_page_offset, power_flow);
 		history_page().draw(draw_ctx().draw, {ms, delta_ms}, cur_page_offset);
 		emm_page().draw(draw_ctx().draw, {ms, delta_ms}, cur_page_offset, emm(), g::inverters().control_infos.to_span());
 		settings_page().draw(draw_ctx().draw, {ms, delta_ms}, cur_page_offset, settings::Default(), runtime_state::Default());
@@ -207,62 +229,129 @@ void touchscreen_task(void *) {
 }
 void modbus_task(void *) {
 	LogInfo("Modbus/control/history thread started");
+	static PowerFlow power_flow{}; // too big for the task stack
+	static DeviceIds device_ids{};
+	control_timing &timing = control_timing::Default();
+	TickType_t last_wake = xTaskGetTickCount();
+	uint32_t history_generation{UINT32_MAX}; // device generation of the inverters the histories were last cleaned for
 	for (;;) {
 		if (!wifi_storage::Default().wifi_connected) {
-			vTaskDelay(pdMS_TO_TICKS(1000));
+			vTaskDelay(pdMS_TO_TICKS(control_timing::PERIOD_MS));
+			timing.pause();
+			last_wake = xTaskGetTickCount();
 			continue;
 		}
+		timing.begin_cycle();
 		uint32_t start_ms = time_ms();
 		time_t epoch_s = ntp_client::Default().synched() ? ntp_client::Default().get_time_since_epoch(): 0;
 		if (settings::Default().configured_meter != ModbusTcpAddr{})
 			g::meter().initiate_discover(settings::Default().configured_meter);
 		g::inverters().initiate_discover_inverters(&settings::Default().configured_inverters);
+		g::loads().initiate_discover_loads(&settings::Default().configured_loads);
+		timing.phase_done(control_timing::DISCOVER);
 
 		g::meter().initiate_retrieve_infos();
 		g::inverters().initiate_retrieve_infos_all();
+		g::loads().initiate_update_all(); // also writes the load setpoints of the previous cycle
+		timing.phase_done(control_timing::RETRIEVE);
 
 		g::meter().wait_requests(1000);
-		int remaining_time = std::max(1000 - int(time_ms() - start_ms), 0);
+		int remaining_time = std::max(int(control_timing::PERIOD_MS) - int(time_ms() - start_ms), 0);
 		g::inverters().wait_all(remaining_time);
+		remaining_time = std::max(int(control_timing::PERIOD_MS) - int(time_ms() - start_ms), 0);
+		g::loads().wait_all(remaining_time);
+		timing.phase_done(control_timing::WAIT);
 
 		// update requested power
-		update_home_power();
-		emm().update_power(home_power.imp_w - home_power.exp_w, g::inverters().read_power, g::inverters().control_infos, settings::Default());
+		for (int i: range(std::min(g::inverters().read_power.size(), settings::Default().inverter_phase.size())))
+			g::inverters().read_power[i].phase = Phase(settings::Default().inverter_phase[i]);
+		for (int i: range(std::min(g::inverters().control_infos.size(), settings::Default().inverter_bat_prio.size())))
+			g::inverters().control_infos[i].bat_priority = std::max(settings::Default().inverter_bat_prio[i], 1);
+		update_power_flow(power_flow, g::meter().power_info, g::inverters().read_power.to_span(), start_ms);
+		g::power_flow.write(power_flow);
+		update_device_ids(device_ids, power_flow, settings::Default().configured_meter, settings::Default().configured_inverters.to_span());
+		g::device_ids.write(device_ids);
+		g::control_snapshot.write(g::inverters().control_infos);
+		energy_counters::Default().update(power_flow, device_ids, g::meter().tot_imp_wh, g::meter().tot_exp_wh, epoch_s);
+		// the parameters of this cycle, the trace frame records them
+		emm().filter_alpha = settings::Default().filter_alpha;
+		emm().loop_gain = settings::Default().loop_gain;
+		bool record_trace = control_trace::Default().enabled;
+		if (record_trace)
+			trace::encode_inputs(control_trace::Default().cur, start_ms, epoch_s, emm(), power_flow.home, power_flow.meter,
+					     g::inverters().read_power.to_span(), g::inverters().control_infos.to_span(), g::loads().loads.to_span(), settings::Default());
+		emm().update_power(power_flow.home.imp_w - power_flow.home.exp_w, power_flow.home.phase_w, g::inverters().read_power, g::inverters().control_infos, settings::Default(),
+				   g::loads().loads, start_ms / 1000);
+		if (record_trace) {
+			trace::encode_outputs(control_trace::Default().cur, g::inverters().control_infos.to_span(), g::loads().loads.to_span());
+			control_trace::Default().commit();
+		}
+		// the trace keeps the emm output, the tuning step is not part of a replay
+		const auto_tune &tune = auto_tune::Default();
+		const bool tune_finished = auto_tune::Default().update(power_flow.inverter_groups.to_span(), g::inverters().control_infos.to_span(),
+								      power_flow.home.imp_w - power_flow.home.exp_w);
+		// the emm requests are not sent yet (see below), so the tuned inverter gets its setpoint here: the steps while
+		// the run is active and full power (as without control) when it finished
+		if ((tune.running() || tune_finished) && tune.inverter >= 0 && tune.inverter < g::inverters().control_infos.size()) {
+			const ControlPowerInfo &c = g::inverters().control_infos[tune.inverter];
+			g::inverters().initiate_send_power_request(tune.inverter, tune.running() ? c.requested_power: c.power_max);
+			g::inverters().wait_all(std::max(int(control_timing::PERIOD_MS) - int(time_ms() - start_ms), 0));
+		}
+		if (tune_finished) {
+			const auto_tune &t = tune;
+			if (t.cur_state == auto_tune::state::DONE) {
+				LogInfo("Auto tune done: dead time {:.1f}s, time constant {:.1f}s, alpha {:.2f}, gain {:.2f}", t.dead_time_s, t.time_constant_s, t.filter_alpha, t.loop_gain);
+				settings::Default().filter_alpha = t.filter_alpha;
+				settings::Default().loop_gain = t.loop_gain;
+				request_settings_store = true;
+			} else {
+				LogError("Auto tune failed: {}", t.error);
+			}
+		}
 		// g::inverters().initiate_send_power_requests_all();
-		// remaining_time = std::max(1000 - int(time_ms() - start_ms), 0);
+		// remaining_time = std::max(int(control_timing::PERIOD_MS) - int(time_ms() - start_ms), 0);
 		// g::inverters().wait_all(remaining_time);
+		timing.phase_done(control_timing::EMM);
 
 		// history data update
 		if (epoch_s) {
-			hd::write_meter_data(g::meter().power_info.imp_w - g::meter().power_info.exp_w, epoch_s);
-			for (const InverterGroup &ig: g::inverters().read_power) {
-				hd::write_inverter_data(ig.inverter.device_id, ig.inverter.imp_w - ig.inverter.exp_w, epoch_s);
+			hd::write({hd::series_id::METER, power_flow.meter.device_id}, power_flow.meter.imp_w - power_flow.meter.exp_w, epoch_s);
+			for (int p: range(PHASES))
+				hd::write({meter_phase_series, p}, power_flow.meter.phase_w[p], epoch_s);
+			for (const InverterGroup &ig: power_flow.inverter_groups) {
+				hd::write({hd::series_id::INVERTER, ig.inverter.device_id}, ig.inverter.imp_w - ig.inverter.exp_w, epoch_s);
 				if (ig.pv.device_id > 0)
-					hd::write_inverter_data(ig.pv.device_id, ig.pv.imp_w - ig.pv.exp_w, epoch_s);
+					hd::write({hd::series_id::INVERTER, ig.pv.device_id}, ig.pv.imp_w - ig.pv.exp_w, epoch_s);
 				if (ig.battery.device_id > 0) {
-					hd::write_inverter_data(ig.battery.device_id, ig.battery.imp_w - ig.battery.exp_w, epoch_s);
-					hd::write_soc_data(ig.battery.device_id, ig.bat_soc, epoch_s);
+					hd::write({hd::series_id::INVERTER, ig.battery.device_id}, ig.battery.imp_w - ig.battery.exp_w, epoch_s);
+					hd::write({hd::series_id::SOC, ig.battery.device_id}, ig.bat_soc, epoch_s);
 				}
 			}
+			energy_profile::Default().update(power_flow.inverter_groups.to_span());
 		}
-		// remove stale histories
-		{	// stale inverter data
-			t::locked_data<std::array<t::id_data, MAX_INVERTERS * 2>> locked_data = g::inverter_data.access();
-			for (t::id_data &d: locked_data.data)
-				if (d.device_id != -1 &&  // reset history data for disconnected devices
-					!(g::inverters().read_power | find{[&d](const InverterGroup &g){ return g.inverter.device_id == d.device_id || g.pv.device_id == d.device_id || g.battery.device_id == d.device_id; }}))
-					d.device_id = -1;
-		}
-		{	// stale soc data
-			t::locked_data<std::array<t::id_data, MAX_INVERTERS>> locked_data = g::soc_data.access();
-			for (t::id_data &d: locked_data.data)
-				if (d.device_id != -1 && 
-					!(g::inverters().read_power | find{[&d](const InverterGroup &g){ return g.battery.device_id == d.device_id; }}))
-					d.device_id = -1;
+		timing.phase_done(control_timing::HISTORY);
+		// remove stale histories, only needed after device ids of the inverters changed
+		if (uint32_t generation = g::inverters().device_generation; generation != history_generation) {
+			history_generation = generation;
+			static_vector<int, MAX_INVERTERS * 3> live_ids{};
+			static_vector<int, MAX_INVERTERS> battery_ids{};
+			live_ids.clear();
+			battery_ids.clear();
+			for (const InverterGroup &ig: g::inverters().read_power) {
+				live_ids.push(ig.inverter.device_id);
+				live_ids.push(ig.pv.device_id);
+				live_ids.push(ig.battery.device_id);
+				battery_ids.push(ig.battery.device_id);
+			}
+			hd::retain(hd::series_id::INVERTER, live_ids.to_span());
+			hd::retain(hd::series_id::SOC, battery_ids.to_span());
 		}
+		timing.phase_done(control_timing::STALE);
+		timing.end_cycle();
 
-		remaining_time = std::max(1000 - int(time_ms() - start_ms), 0);
-		vTaskDelay(pdMS_TO_TICKS(remaining_time));
+		// absolute schedule, after an overrun the missed periods are skipped instead of running them back to back
+		if (!xTaskDelayUntil(&last_wake, pdMS_TO_TICKS(control_timing::PERIOD_MS)))
+			last_wake = xTaskGetTickCount();
 	}
 
 }
@@ -308,6 +397,25 @@ void wifi_search_task(void *) {
 }
 
 
+// runs requested what if replays, lowest priority so that the replay only uses idle time
+void what_if_task(void *) {
+	LogInfo("What if task started");
+	for (;;) {
+		what_if::Default().run();
+		vTaskDelay(pdMS_TO_TICKS(1000));
+	}
+}
+
+// appends the closed hours to the flash log and restores the logged hours of newly discovered devices, lowest
+// priority as erasing a sector pauses the other core
+void history_log_task(void *) {
+	LogInfo("History log task started");
+	for (;;) {
+		history_log::Default().update();
+		vTaskDelay(pdMS_TO_TICKS(10000));
+	}
+}
+
 // task to initailize everything and only after initialization startin all other threads
 // cyw43 init has to be done in freertos task because it utilizes freertos synchronization variables
 void startup_task(void *) {
@@ -324,11 +432,20 @@ void startup_task(void *) {
 	cyw43_wifi_pm(&cyw43_state, CYW43_NONE_PM);
 	persistent_storage_t::Default().read(&persistent_storage_layout::persistent_settings, settings::Default());
 	settings::Default().sanitize();
+	persistent_storage_t::Default().read(&persistent_storage_layout::persistent_profile, energy_profile::Default().data);
+	energy_profile::Default().data.sanitize();
+	persistent_storage_t::Default().read(&persistent_storage_layout::persistent_counters, energy_counters::Default().data);
+	energy_counters::Default().data.sanitize();
 	wifi_storage::Default().update_hostname();
 	Webserver().start();
 	g::meter();
 	g::inverters();
+	g::loads();
 	history_data::init();
+	meter_phase_series = history_data::register_series({.name = "meter_phase", .unit = "W",
+		.retention_s = {0, 0, 6 * 86400, 50 * 86400, 500 * 86400, 0}, .slots = PHASES, .keyed = false});
+	history_log::Default().init();
+	control_trace::Default().clear();
 	LogInfo("Ready, running http at {}", ip4addr_ntoa(netif_ip4_addr(netif_list)));
 	LogInfo("Initialization done");
 	std::cout << "Initialization done, get all further info via the commands shown in 'help'\n";
@@ -339,6 +456,8 @@ void startup_task(void *) {
 	xTaskCreate(display_task, "DisplayThread", 1024, NULL, 1, NULL);
 	xTaskCreate(touchscreen_task, "TouchscreenThread", 512, NULL, 1, NULL);
 	xTaskCreate(modbus_task, "ModbusThread", 512, NULL, 1, NULL);
+	xTaskCreate(what_if_task, "WhatIfThread", 512, NULL, tskIDLE_PRIORITY, NULL);
+	xTaskCreate(history_log_task, "HistoryLogThread", 512, NULL, tskIDLE_PRIORITY, NULL);
 	cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 0);
 	vTaskDelete(NULL); // remove this task for efficiency reasions
 }
@@ -71,7 +71,7 @@ void meter_info::initiate_discover(ModbusTcpAddr address) {
 	}
 }
 void meter_info::initiate_retrieve_infos() {
-	ulTaskNotifyTakeIndexed(MAX_INVERTERS, pdTRUE, 0);
+	ulTaskNotifyTakeIndexed(METER_NOTIFY_INDEX, pdTRUE, 0);
 	if (!context.connected)
 		return;
 	if (context.state != e::state::IDLE) {
@@ -87,7 +87,7 @@ void meter_info::initiate_retrieve_infos() {
 void meter_info::wait_requests(uint32_t timeout_ms) {
 	if (!context.connected)
 		return;
-	ulTaskNotifyTakeIndexed(MAX_INVERTERS, pdTRUE, pdMS_TO_TICKS(timeout_ms));
+	ulTaskNotifyTakeIndexed(METER_NOTIFY_INDEX, pdTRUE, pdMS_TO_TICKS(timeout_ms));
 	if (context.state == e::state::IDLE) {
 		context.wait_count = 0;
 		context.wait_receive = false;
@@ -184,6 +184,11 @@ static void advance_context_state(t::context &context, struct pbuf *p) {
 			float w = context.modbus.read(&meter_registers::W);
 			meter().power_info.imp_w = std::max(w, .0f);
 			meter().power_info.exp_w = -std::min(w, .0f);
+			meter().power_info.phase_w = {context.modbus.read(&meter_registers::WphA),
+						      context.modbus.read(&meter_registers::WphB),
+						      context.modbus.read(&meter_registers::WphC)};
+			meter().tot_imp_wh = context.modbus.read(&meter_registers::TotWhImp);
+			meter().tot_exp_wh = context.modbus.read(&meter_registers::TotWhExp);
 			LogInfo("Meter back to idle at: {}ms, {}W", time_ms(), w);
 			context.state = e::state::IDLE;
 			break;
@@ -191,7 +196,7 @@ static void advance_context_state(t::context &context, struct pbuf *p) {
 	if (context.state == e::state::IDLE)
 		context.wait_receive = false;
 	if (context.state == e::state::IDLE && prev_state != e::state::IDLE) // wakeup main task
-		xTaskNotifyGiveIndexed(parent_task, MAX_INVERTERS);
+		xTaskNotifyGiveIndexed(parent_task, METER_NOTIFY_INDEX);
 }
 static void request_modbus_registers(t::context &context, int offset, int register_count) {
 	// LogInfo("Getting registers {}-{}", offset, offset + register_count);
@@ -284,5 +289,5 @@ static void tcp_err_cb(void *arg, err_t err) {
 	self.pcb = {};
 	self.connected = false;
 	self.state = e::state::IDLE;
-	xTaskNotifyGiveIndexed(parent_task, MAX_INVERTERS);
+	xTaskNotifyGiveIndexed(parent_task, METER_NOTIFY_INDEX);
 }
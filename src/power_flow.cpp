@@ -0,0 +1,53 @@
+#include "power_flow.h"
+#include "ranges_util.h"
+
+void update_power_flow(PowerFlow &flow, const PowerInfo &meter, std::span<const InverterGroup> inverter_groups, uint32_t time_ms) {
+	float dt_h = flow.time_ms ? (time_ms - flow.time_ms) / 1000.f / 60 / 60: 0;
+	flow.cycle_h = flow.time_ms && time_ms - flow.time_ms <= FLOW_MAX_GAP_MS ? dt_h: 0;
+	flow.time_ms = time_ms;
+	flow.meter = meter;
+
+	// home is everything the meter sees which is not coming from the inverters
+	float home_w = meter.imp_w - meter.exp_w;
+	flow.home.phase_w = meter.phase_w;
+	flow.inverter_groups.resize(inverter_groups.size());
+	flow.dc.resize(inverter_groups.size());
+	for (int i: range(inverter_groups.size())) {
+		const InverterGroup &ig = inverter_groups[i];
+		float inverter_w = ig.inverter.exp_w - ig.inverter.imp_w;
+		home_w += inverter_w;
+		for (int p: range(PHASES))
+			flow.home.phase_w[p] += phase_share(ig.phase, p) * inverter_w;
+		flow.inverter_groups[i] = ig;
+		flow.dc[i] = DcFlow{.pv_w = ig.pv.exp_w, .discharge_w = ig.battery.exp_w, .charge_w = ig.battery.imp_w};
+	}
+	flow.home.imp_w = std::max(home_w, 0.f);
+	flow.home.exp_w = -std::min(home_w, 0.f);
+
+	// proportional sharing of all sources on the ac bus
+	std::array<float, BUS_NODES> &source_w = flow.source_w;
+	std::array<float, BUS_NODES> &sink_w = flow.sink_w;
+	source_w = sink_w = {};
+	source_w[BUS_HOME] = flow.home.exp_w;
+	sink_w[BUS_HOME] = flow.home.imp_w;
+	source_w[BUS_GRID] = meter.imp_w;
+	sink_w[BUS_GRID] = meter.exp_w;
+	for (int i: range(inverter_groups.size())) {
+		source_w[bus_inverter(i)] = inverter_groups[i].inverter.exp_w;
+		sink_w[bus_inverter(i)] = inverter_groups[i].inverter.imp_w;
+	}
+	flow.sink_sum = 0;
+	for (float w: sink_w)
+		flow.sink_sum += w;
+}
+
+void update_device_ids(DeviceIds &ids, const PowerFlow &flow, const ModbusTcpAddr &meter_addr, std::span<const ModbusTcpAddr> inverter_addrs) {
+	ids.meter = flow.meter.device_id;
+	ids.meter_addr = meter_addr;
+	ids.groups.resize(flow.inverter_groups.size());
+	for (int i: range(flow.inverter_groups.size())) {
+		const InverterGroup &ig = flow.inverter_groups[i];
+		ids.groups[i] = {.inverter = ig.inverter.device_id, .pv = ig.pv.device_id, .battery = ig.battery.device_id,
+				 .addr = i < int(inverter_addrs.size()) ? inverter_addrs[i]: ModbusTcpAddr{}};
+	}
+}
@@ -0,0 +1,248 @@
+#include "what_if.h"
+#include "history_data.h"
+#include "inverter.h"
+#include "ntp_client.h"
+#include "power_flow.h"
+#include "ranges_util.h"
+#include "log_storage.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <string>
+
+// simulated inverter, follows the emm request instantly within the limits of pv, battery and soc
+struct plant_inverter {
+	float soc;
+	float capacity_wh;	// 0 if the inverter has no battery
+	float pv_w;		// produced, lower than the available pv if it had to be curtailed
+	float battery_w;	// positive is discharging
+};
+
+struct sandbox {
+	EMM emm;
+	settings s;
+	static_vector<InverterGroup, MAX_INVERTERS> groups;
+	static_vector<ControlPowerInfo, MAX_INVERTERS> controls;
+	static_vector<plant_inverter, MAX_INVERTERS> plant;
+	what_if::kpis kpis;
+};
+
+static sandbox boxes[2]{};
+
+// history of one replayed minute, import - export as in the history, NAN for missing values
+struct minute_input {
+	float meter_w;
+	std::array<float, MAX_INVERTERS> inverter_w;
+	std::array<float, MAX_INVERTERS> pv_w;
+	std::array<float, MAX_INVERTERS> battery_w;
+	std::array<float, MAX_INVERTERS> soc;
+};
+
+// mean of the minute starting at time_s, the blocks are found by a binary search
+static float minute_value(const t::per_minute &src, uint32_t time_s) {
+	t::data_bucket b;
+	return src.read(time_s, time_s + 1, std::span{&b, 1}) ? b.data: NAN;
+}
+
+// NAN if the device has no history or it was written during every try
+static float device_minute(hd::series_id series, uint32_t time_s) {
+	float value{NAN};
+	if (!hd::read_series(series, [&](const t::device_data *data) { value = data ? minute_value(data->per_minute, time_s): NAN; }))
+		return NAN;
+	return value;
+}
+
+// each device is read on its own without blocking the history writer
+static void read_minute(const DeviceIds &devices, uint32_t time_s, minute_input &in) {
+	in.meter_w = device_minute({hd::series_id::METER, devices.meter}, time_s);
+	for (int i: range(devices.groups.size())) {
+		const DeviceIds::group &ig = devices.groups[i];
+		in.inverter_w[i] = device_minute({hd::series_id::INVERTER, ig.inverter}, time_s);
+		in.pv_w[i] = ig.pv > 0 ? -device_minute({hd::series_id::INVERTER, ig.pv}, time_s): 0;
+		in.battery_w[i] = device_minute({hd::series_id::INVERTER, ig.battery}, time_s);
+		in.soc[i] = device_minute({hd::series_id::SOC, ig.battery}, time_s);
+	}
+}
+
+static void step(sandbox &b, float home_w, std::span<const float> pv_avail_w) {
+	constexpr float DT_H{1.f / 3600};
+	for (int i: range(b.groups.size())) {
+		InverterGroup &ig = b.groups[i];
+		const plant_inverter &p = b.plant[i];
+		float ac_w = p.pv_w + p.battery_w;
+		ig.inverter.imp_w = std::max(-ac_w, 0.f);
+		ig.inverter.exp_w = std::max(ac_w, 0.f);
+		ig.pv.imp_w = 0;
+		ig.pv.exp_w = pv_avail_w[i];
+		ig.battery.imp_w = std::max(-p.battery_w, 0.f);
+		ig.battery.exp_w = std::max(p.battery_w, 0.f);
+		ig.bat_soc = p.soc;
+	}
+	std::array<float, PHASES> home_phase_w;
+	home_phase_w.fill(home_w / PHASES);
+	b.emm.update_power(home_w, home_phase_w, b.groups.to_span(), b.controls.to_span(), b.s);
+
+	float grid_w = home_w;
+	for (int i: range(b.groups.size())) {
+		const ControlPowerInfo &c = b.controls[i];
+		plant_inverter &p = b.plant[i];
+		float ac_w = std::clamp(c.requested_power, -c.power_max, c.power_max);
+		float max_cha_w = p.capacity_wh > 0 && p.soc < 100 ? c.power_max_cha: 0;
+		float max_discha_w = p.capacity_wh > 0 && p.soc > 0 ? c.power_max_discha: 0;
+		p.battery_w = std::clamp(ac_w - pv_avail_w[i], -max_cha_w, max_discha_w);
+		p.pv_w = std::clamp(ac_w - p.battery_w, 0.f, pv_avail_w[i]); // curtailed if the battery can not take it
+		if (p.capacity_wh > 0)
+			p.soc = std::clamp(p.soc - p.battery_w * DT_H / p.capacity_wh * 100, 0.f, 100.f);
+		grid_w -= p.pv_w + p.battery_w;
+		b.kpis.charge_wh += std::max(-p.battery_w, 0.f) * DT_H;
+		b.kpis.discharge_wh += std::max(p.battery_w, 0.f) * DT_H;
+	}
+	b.kpis.import_wh += std::max(grid_w, 0.f) * DT_H;
+	b.kpis.export_wh += std::max(-grid_w, 0.f) * DT_H;
+}
+
+bool what_if::request(std::string_view changes) {
+	if (requested || cur_state == state::RUNNING)
+		return false;
+	proposed = settings::Default();
+	std::istringstream lines{std::string{changes}};
+	for (std::string line; std::getline(lines, line);) {
+		if (line.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+		std::istringstream is{line};
+		if (!(is >> proposed))
+			return false;
+	}
+	proposed.sanitize();
+	requested = true;
+	return true;
+}
+
+void what_if::run() {
+	if (!requested)
+		return;
+	cur_state = state::RUNNING;
+	requested = false;
+	const auto fail = [this](const char *e) {
+		LogError("What if: {}", e);
+		scoped_lock lock{m};
+		error = e;
+		cur_state = state::FAILED;
+	};
+	{
+		scoped_lock lock{m};
+		minutes_done = 0;
+		minutes_valid = 0;
+		recorded = current = changed = {};
+		capacity_wh.clear();
+		error = nullptr;
+	}
+
+	if (!ntp_client::Default().synched())
+		return fail("Keine Uhrzeit");
+	static DeviceIds devices{};
+	if (!g::device_ids.read(devices) || devices.groups.empty())
+		return fail("Keine Wechselrichter");
+	static static_vector<ControlPowerInfo, MAX_INVERTERS> live_controls{};
+	if (!g::control_snapshot.read(live_controls) || live_controls.size() < devices.groups.size())
+		return fail("Wechselrichter nicht verbunden");
+	for (int i: range(devices.groups.size()))
+		if (!(live_controls[i].power_max > 0))
+			return fail("Leistungsgrenzen unbekannt");
+
+	// first pass for the start soc and the battery capacity: charged energy per soc percent over all minutes where
+	// battery power and both soc values are known
+	const uint32_t start_s = uint32_t(ntp_client::Default().get_time_since_epoch() / 60 - MINUTES) * 60;
+	const int inverters = devices.groups.size();
+	static minute_input in{};
+	std::array<float, MAX_INVERTERS> first_soc, prev_soc, prev_battery_w, throughput_wh{}, soc_change{};
+	first_soc.fill(NAN);
+	prev_soc.fill(NAN);
+	prev_battery_w.fill(NAN);
+	for (int minute: range(MINUTES)) {
+		read_minute(devices, start_s + minute * 60, in);
+		for (int i: range(inverters)) {
+			if (std::isnan(first_soc[i]))
+				first_soc[i] = in.soc[i];
+			if (!std::isnan(prev_battery_w[i]) && !std::isnan(prev_soc[i]) && !std::isnan(in.soc[i])) {
+				throughput_wh[i] += std::abs(prev_battery_w[i]) / 60;
+				soc_change[i] += std::abs(in.soc[i] - prev_soc[i]);
+			}
+			prev_soc[i] = in.soc[i];
+			prev_battery_w[i] = in.battery_w[i];
+		}
+	}
+
+	// both sandboxes start from the same plant, the first recorded soc is the start soc
+	static_vector<float, MAX_INVERTERS> used_capacity_wh{};
+	{
+		scoped_lock lock{m};
+		for (int i: range(inverters)) {
+			bool has_battery = devices.groups[i].battery > 0;
+			float c = has_battery && soc_change[i] >= 5 ? std::clamp(throughput_wh[i] / soc_change[i] * 100, 500.f, 100000.f): 0;
+			capacity_wh.push(c);
+			used_capacity_wh.push(has_battery && c == 0 ? DEFAULT_CAPACITY_WH: c);
+		}
+	}
+	const settings *box_settings[2]{&settings::Default(), &proposed};
+	for (int b: range(2)) {
+		sandbox &box = boxes[b];
+		box.s = *box_settings[b];
+		box.emm = EMM{};
+		box.emm.filter_alpha = box.s.filter_alpha;
+		box.emm.loop_gain = box.s.loop_gain;
+		box.groups.resize(inverters);
+		box.controls.resize(inverters);
+		box.plant.resize(inverters);
+		for (int i: range(inverters)) {
+			const DeviceIds::group &ids = devices.groups[i];
+			box.groups[i] = InverterGroup{.inverter = {.device_id = ids.inverter}, .pv = {.device_id = ids.pv}, .battery = {.device_id = ids.battery}};
+			box.controls[i] = live_controls[i];
+			box.controls[i].requested_power = 0;
+			box.controls[i].bat_priority = i < box.s.inverter_bat_prio.size() ? std::max(box.s.inverter_bat_prio[i], 1): 1;
+			if (i < box.s.inverter_phase.size())
+				box.groups[i].phase = Phase(box.s.inverter_phase[i]);
+			box.plant[i] = plant_inverter{.soc = std::isnan(first_soc[i]) ? 50: first_soc[i], .capacity_wh = used_capacity_wh[i], .pv_w = 0, .battery_w = 0};
+		}
+		box.kpis = {};
+	}
+
+	kpis rec{};
+	int valid{};
+	std::array<float, MAX_INVERTERS> pv_avail_w{};
+	for (int minute: range(MINUTES)) {
+		// minutes without complete history are skipped, the plant keeps its state
+		read_minute(devices, start_s + minute * 60, in);
+		float home_w = in.meter_w;
+		bool complete = !std::isnan(home_w);
+		for (int i: range(inverters)) {
+			complete &= !std::isnan(in.inverter_w[i]) && !std::isnan(in.pv_w[i]);
+			home_w -= in.inverter_w[i];
+			pv_avail_w[i] = std::max(in.pv_w[i], 0.f);
+		}
+		if (complete) {
+			++valid;
+			rec.import_wh += std::max(in.meter_w, 0.f) / 60;
+			rec.export_wh += std::max(-in.meter_w, 0.f) / 60;
+			for (int i: range(inverters)) {
+				if (std::isnan(in.battery_w[i]))
+					continue;
+				rec.charge_wh += std::max(in.battery_w[i], 0.f) / 60;
+				rec.discharge_wh += std::max(-in.battery_w[i], 0.f) / 60;
+			}
+			for (int s [[maybe_unused]]: range(STEPS_PER_MINUTE))
+				for (sandbox &box: boxes)
+					step(box, home_w, std::span<const float>{pv_avail_w.data(), size_t(inverters)});
+		}
+		scoped_lock lock{m};
+		minutes_done = minute + 1;
+		minutes_valid = valid;
+		recorded = rec;
+		current = boxes[0].kpis;
+		changed = boxes[1].kpis;
+	}
+	LogInfo("What if: {} of {} minutes replayed", valid, int(MINUTES));
+	cur_state = state::DONE;
+}
+
@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2026 Josef Stumpfegger josefstumpfegger@outlook.de
+ */
+
+// Compares the float and the fixed point allocation of EMM::update_power_t on random control cycles.
+// Reports the time per call of both number types and how far the fixed point requests are off the float ones.
+// The time per call on the device is shown by the usb command 'status' for the number type the firmware was built with.
+//
+// usage: emm_bench [--cycles N] [--repeat N] [--inverters N] [--phase-balancing] [--max-export-phase W] [--wear-aware] [--seed S]
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "emm.h"
+
+struct cycle_input {
+	float home_w;
+	std::array<float, PHASES> home_phase_w;
+	static_vector<InverterGroup, MAX_INVERTERS> groups;
+	static_vector<ControlPowerInfo, MAX_INVERTERS> controls;
+};
+
+struct bench_result {
+	double ns_per_call{};
+	std::vector<float> requests{}; // requested power of all inverters of all cycles of the first repetition
+};
+
+template<typename T>
+static bench_result run(const std::vector<cycle_input> &cycles, const settings &s, int repeat) {
+	bench_result res{};
+	EMM emm{};
+	static_vector<InverterGroup, MAX_INVERTERS> groups{};
+	static_vector<ControlPowerInfo, MAX_INVERTERS> controls{};
+	double total_ns{};
+	for (int r: range(repeat)) {
+		for (const cycle_input &c: cycles) {
+			groups = c.groups;
+			controls = c.controls;
+			auto start = std::chrono::steady_clock::now();
+			emm.update_power_t<T>(c.home_w, c.home_phase_w, groups.to_span(), controls.to_span(), s);
+			total_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+			if (r == 0)
+				for (const ControlPowerInfo &ci: controls)
+					res.requests.push_back(ci.requested_power);
+		}
+	}
+	res.ns_per_call = total_ns / std::max<size_t>(cycles.size() * repeat, 1);
+	return res;
+}
+
+int main(int argc, char **argv) {
+	int cycle_count{10000};
+	int repeat{20};
+	int inverters{3};
+	uint32_t seed{1};
+	settings s{.enable_emm = true};
+	for (int i = 1; i < argc; ++i) {
+		const auto next = [&]() { return i + 1 < argc ? std::atof(argv[++i]): 0.; };
+		if (std::strcmp(argv[i], "--cycles") == 0) cycle_count = std::max(int(next()), 1);
+		else if (std::strcmp(argv[i], "--repeat") == 0) repeat = std::max(int(next()), 1);
+		else if (std::strcmp(argv[i], "--inverters") == 0) inverters = std::clamp(int(next()), 1, MAX_INVERTERS);
+		else if (std::strcmp(argv[i], "--phase-balancing") == 0) s.phase_balancing = true;
+		else if (std::strcmp(argv[i], "--max-export-phase") == 0) s.max_export_phase = next();
+		else if (std::strcmp(argv[i], "--wear-aware") == 0) s.wear_aware = true;
+		else if (std::strcmp(argv[i], "--seed") == 0) seed = next();
+		else {
+			std::cerr << "Unknown argument " << argv[i] << ", see the head of tools/emm_bench.cpp for the usage\n";
+			return 1;
+		}
+	}
+
+	// the filter is not part of the comparison, every cycle starts from the same emm state
+	std::mt19937 rng{seed};
+	const auto uniform = [&rng](float a, float b) { return std::uniform_real_distribution<float>{a, b}(rng); };
+	std::vector<cycle_input> cycles(cycle_count);
+	for (cycle_input &c: cycles) {
+		c.home_w = 0;
+		for (float &w: c.home_phase_w) {
+			w = uniform(-2000, 3000);
+			c.home_w += w;
+		}
+		for (int i: range(inverters)) {
+			float ac = uniform(-2500, 5000);
+			c.groups.push(InverterGroup{
+				.inverter = {.device_id = METER_ID + 1 + 3 * i, .imp_w = std::max(-ac, 0.f), .exp_w = std::max(ac, 0.f)},
+				.pv = {.device_id = METER_ID + 2 + 3 * i, .imp_w = 0, .exp_w = uniform(0, 5000)},
+				.battery = {.device_id = METER_ID + 3 + 3 * i},
+				.bat_soc = uniform(0, 100),
+				.phase = s.phase_balancing ? Phase(1 + i % PHASES): Phase::ALL,
+			});
+			c.controls.push(ControlPowerInfo{.min_soc = 10, .power_max = 5000, .power_max_cha = 2500, .power_max_discha = 2500,
+							 .requested_power = 0, .bat_priority = 1 + int(rng() % 3), .last_connection_s = 0});
+		}
+	}
+
+	bench_result f = run<float>(cycles, s, repeat);
+	bench_result x = run<fixed>(cycles, s, repeat);
+	float max_deviation{};
+	int deviating{};
+	for (int i: range(f.requests.size())) {
+		float d = std::abs(f.requests[i] - x.requests[i]);
+		max_deviation = std::max(max_deviation, d);
+		deviating += d > 1;
+	}
+	std::cout << "float  " << f.ns_per_call << " ns per call\n";
+	std::cout << "fixed  " << x.ns_per_call << " ns per call (" << x.ns_per_call / std::max(f.ns_per_call, 1e-9) << "x float)\n";
+	std::cout << deviating << " of " << f.requests.size() << " requests differ by more than 1 W, max " << max_deviation << " W\n";
+	return 0;
+}
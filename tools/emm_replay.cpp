@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2026 Josef Stumpfegger josefstumpfegger@outlook.de
+ */
+
+// Replays a control loop trace recorded on the device (http GET /trace) through EMM::update_power.
+// The emm outputs are written as csv, so the behaviour of two builds can be compared with a simple diff.
+// Traces of a fixed point firmware (EMM_FIXED_POINT) are replayed in fixed point and have to match exactly.
+//
+// usage: emm_replay trace.bin [--continuous] [--repeat N] [--out results.csv]
+//   --continuous  keep the emm filter state between cycles instead of restoring the recorded state
+//   --repeat N    replay the trace N times and report the time needed per cycle
+//   --out file    write the csv to file instead of stdout
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "trace_format.h"
+
+static bool read_trace(const char *path, std::vector<trace::frame> &frames) {
+	std::ifstream in(path, std::ios::binary);
+	trace::file_header header{};
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+		std::cerr << "Failed to read trace header from " << path << '\n';
+		return false;
+	}
+	if (header.magic != trace::MAGIC || header.version != trace::VERSION) {
+		std::cerr << "Unknown trace format (magic " << std::hex << header.magic << std::dec << ", version " << header.version << ")\n";
+		return false;
+	}
+	if (header.max_inverters != MAX_INVERTERS || header.frame_size != sizeof(trace::frame)) {
+		std::cerr << "Trace was recorded with MAX_INVERTERS=" << header.max_inverters << ", rebuild the tools with -DMAX_INVERTERS=" << header.max_inverters << '\n';
+		return false;
+	}
+	frames.resize(header.frame_count);
+	if (!in.read(reinterpret_cast<char*>(frames.data()), frames.size() * sizeof(trace::frame))) {
+		std::cerr << "Trace is truncated, expected " << header.frame_count << " frames\n";
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	const char *trace_path{};
+	const char *out_path{};
+	bool continuous{};
+	int repeat{1};
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--continuous") == 0)
+			continuous = true;
+		else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+			repeat = std::max(std::atoi(argv[++i]), 1);
+		else if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+			out_path = argv[++i];
+		else
+			trace_path = argv[i];
+	}
+	if (!trace_path) {
+		std::cerr << "usage: " << argv[0] << " trace.bin [--continuous] [--repeat N] [--out results.csv]\n";
+		return 1;
+	}
+
+	std::vector<trace::frame> frames;
+	if (!read_trace(trace_path, frames))
+		return 1;
+
+	std::ofstream out_file;
+	if (out_path)
+		out_file.open(out_path);
+	std::ostream &out = out_path ? out_file: std::cout;
+
+	EMM emm{};
+	settings s{};
+	PowerInfo home{};
+	static_vector<InverterGroup, MAX_INVERTERS> groups{};
+	static_vector<ControlPowerInfo, MAX_INVERTERS> controls{};
+	static_vector<LoadInfo, MAX_LOADS> loads{};
+	float max_deviation{};
+	int deviating_cycles{};
+	auto start = std::chrono::steady_clock::now();
+	for (int r: range(repeat)) {
+		for (const trace::frame &f: frames) {
+			if (continuous && &f != &frames.front()) {
+				// keep the emm filter state of the previous cycle
+				float home_power = emm.home_power;
+				std::array<float, PHASES> home_phase_power = emm.home_phase_power;
+				trace::decode_inputs(f, emm, home, groups, controls, loads, s);
+				emm.home_power = home_power;
+				emm.home_phase_power = home_phase_power;
+			} else {
+				trace::decode_inputs(f, emm, home, groups, controls, loads, s);
+			}
+			// use the arithmetic of the recording device, fixed point traces then replay bit exact
+			if (f.flags & trace::FLAG_FIXED_POINT)
+				emm.update_power_t<fixed>(home.imp_w - home.exp_w, home.phase_w, groups.to_span(), controls.to_span(), s, loads.to_span(), f.time_ms / 1000);
+			else
+				emm.update_power_t<float>(home.imp_w - home.exp_w, home.phase_w, groups.to_span(), controls.to_span(), s, loads.to_span(), f.time_ms / 1000);
+
+			if (r != 0)
+				continue;
+			out << f.time_ms << ',' << f.epoch_s << ',' << f.home_w << ',' << emm.home_power;
+			bool deviates{};
+			for (int i: range(f.inverter_count)) {
+				float deviation = std::abs(controls[i].requested_power - f.inverters[i].requested_w);
+				max_deviation = std::max(max_deviation, deviation);
+				deviates |= f.flags & trace::FLAG_FIXED_POINT ? controls[i].requested_power != f.inverters[i].requested_w: deviation > 1;
+				out << ',' << controls[i].requested_power;
+			}
+			for (int i: range(f.load_count)) {
+				float deviation = std::abs(loads[i].requested_power - f.loads[i].requested_w);
+				max_deviation = std::max(max_deviation, deviation);
+				deviates |= f.flags & trace::FLAG_FIXED_POINT ? loads[i].requested_power != f.loads[i].requested_w: deviation > 1;
+				out << ',' << loads[i].requested_power;
+			}
+			deviating_cycles += deviates;
+			out << '\n';
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	double us_per_cycle = std::chrono::duration<double, std::micro>(end - start).count() / std::max<size_t>(frames.size() * repeat, 1);
+	std::cerr << "Replayed " << frames.size() << " cycles, " << deviating_cycles << " deviate from the recording (max " << max_deviation << " W), "
+		<< us_per_cycle << " us per cycle\n";
+	return 0;
+}
@@ -0,0 +1,367 @@
+/**
+ * Copyright (c) 2026 Josef Stumpfegger josefstumpfegger@outlook.de
+ */
+
+// Closed loop simulation of a household driven by EMM::update_power.
+// The plant consists of a synthetic load profile, pv curves following the season, inverters with batteries
+// which follow the emm requests with a delay and a ramp, and the grid meter. The emm sees the plant only through
+// the same InverterGroup/ControlPowerInfo interfaces as on the device, so allocator or filter changes can be
+// compared on a full year of data before flashing.
+//
+// usage: emm_sim [--days N] [--seed S] [--inverters N] [--pv-kwp X] [--battery-kwh X] [--power-max W]
+//                [--max-export W] [--max-export-phase W] [--phase-balancing] [--alpha F] [--delay S] [--ramp W/s]
+//                [--storage-refetch S] [--no-soc-estimate] [--wallbox A] [--wear-aware] [--loop-gain F] [--auto-tune]
+//                [--daily file.csv]
+//   --wallbox A   adds a three phase wallbox with max current A and an always connected car which is fed with surplus
+//   --wear-aware  uses the wear aware battery allocation and additionally runs the default allocation to report the saved cycles
+//   --auto-tune   runs the auto tune on the first inverter at noon of the first day and continues with the found alpha and gain
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <numbers>
+#include <random>
+
+#include "emm.h"
+#include "soc_estimator.h"
+#include "battery_wear.h"
+#include "auto_tune.h"
+
+constexpr float DT_S{1}; // control cycle of the firmware
+constexpr float S_PER_H{3600};
+
+struct sim_config {
+	int days{365};
+	uint32_t seed{1};
+	int inverters{2};
+	float pv_kwp{5};		// per inverter
+	float battery_kwh{5};		// per inverter
+	float power_max{5000};
+	float power_max_cha{2500};
+	float power_max_discha{2500};
+	float min_soc{10};
+	float max_export{};
+	float max_export_phase{};
+	bool phase_balancing{};
+	float filter_alpha{.1f};
+	float loop_gain{};
+	bool auto_tune{};
+	int delay_s{2};			// time until a power request reaches the inverter
+	float ramp_w_s{500};		// maximum change of the inverter power per second
+	int storage_refetch_s{30};	// soc is read as whole percent every storage_refetch_s like on the device, 0 for exact soc each cycle
+	bool soc_estimate{true};	// use the soc_estimator between the storage reads
+	float wallbox_a{};		// max current of the surplus wallbox, 0 for none
+	bool wear_aware{};
+	const char *daily_csv{};
+};
+
+struct sim_result {
+	double load_wh{}, pv_wh{}, import_wh{}, export_wh{}, battery_charge_wh{}, battery_discharge_wh{}, wallbox_wh{};
+	int wallbox_switches{};
+	std::array<battery_wear, MAX_INVERTERS> wear{};
+	int inverters{};
+	float cycles() const { float c{}; for (int i: range(inverters)) c += wear[i].cycles; return c; }
+	int half_cycles() const { int c{}; for (int i: range(inverters)) c += wear[i].half_cycles; return c; }
+	int export_violations_s{}, phase_violations_s{}, request_violations{};
+	double soc_error_sum{};	// deviation of the soc seen by the emm from the real soc
+	int64_t soc_samples{};
+	void print(std::ostream &out, double battery_capacity_wh) const {
+		out << "load            " << load_wh / 1000 << " kWh\n";
+		out << "pv              " << pv_wh / 1000 << " kWh\n";
+		out << "grid import     " << import_wh / 1000 << " kWh\n";
+		out << "grid export     " << export_wh / 1000 << " kWh\n";
+		out << "self consumption " << (pv_wh > 0 ? 100 * (1 - export_wh / pv_wh): 0) << " %\n";
+		out << "autarky         " << (load_wh > 0 ? 100 * (1 - import_wh / load_wh): 0) << " %\n";
+		out << "battery charge  " << battery_charge_wh / 1000 << " kWh, discharge " << battery_discharge_wh / 1000 << " kWh\n";
+		out << "battery cycles  " << (battery_capacity_wh > 0 ? battery_discharge_wh / battery_capacity_wh: 0) << '\n';
+		out << "soc cycles      " << cycles() << " full, " << half_cycles() << " half cycles, depth histogram";
+		for (int b: range(battery_wear::DOD_EDGES.size() + 1)) {
+			uint32_t n{};
+			for (int i: range(inverters))
+				n += wear[i].dod_histogram[b];
+			out << (b ? "/": " ") << n;
+		}
+		out << '\n';
+		out << "export limit violated " << export_violations_s << " s, phase limit violated " << phase_violations_s << " s\n";
+		out << "requests outside of the inverter limits " << request_violations << '\n';
+		out << "mean soc error seen by the emm " << (soc_samples ? soc_error_sum / soc_samples: 0) << " %\n";
+		out << "wallbox         " << wallbox_wh / 1000 << " kWh, " << wallbox_switches << " switches\n";
+	}
+};
+
+// synthetic household load, base load with morning and evening peaks plus random appliances
+struct load_model {
+	struct appliance { float w; int phase; int remaining_s; };
+	std::mt19937 &rng;
+	std::deque<appliance> running{};
+	std::array<float, PHASES> phase_w{};
+
+	float step(int day, float hour) {
+		float season = 1 + .25f * std::cos(2 * std::numbers::pi_v<float> * day / 365); // more consumption in winter
+		float base = 250 * season;
+		if (hour >= 6 && hour < 8)
+			base += 400 * season;
+		if (hour >= 17 && hour < 22)
+			base += 700 * season;
+		if (std::uniform_real_distribution<float>{}(rng) < 1.f / 7200)
+			running.push_back(appliance{std::uniform_real_distribution<float>{500, 3000}(rng), int(rng() % PHASES), int(60 + rng() % 1800)});
+		phase_w.fill(base / PHASES);
+		for (appliance &a: running) {
+			phase_w[a.phase] += a.w;
+			--a.remaining_s;
+		}
+		std::erase_if(running, [](const appliance &a){ return a.remaining_s <= 0; });
+		return phase_w[0] + phase_w[1] + phase_w[2];
+	}
+};
+
+// clear sky pv curve scaled by the season and a per day clearness with short cloud drops
+struct pv_model {
+	std::mt19937 &rng;
+	int cur_day{-1};
+	float clearness{1};
+	float cloud{1};
+
+	float step(int day, float hour, float kwp) {
+		if (day != cur_day) {
+			cur_day = day;
+			clearness = std::uniform_real_distribution<float>{.15f, 1}(rng);
+		}
+		float summer = std::cos(2 * std::numbers::pi_v<float> * (day - 172) / 365);
+		float day_length = 12 + 4 * summer;
+		float sunrise = 12 - day_length / 2;
+		float elevation = std::sin(std::numbers::pi_v<float> * (hour - sunrise) / day_length);
+		if (elevation <= 0)
+			return 0;
+		cloud = std::clamp(cloud + std::normal_distribution<float>{0, .02f}(rng), clearness * .5f, 1.f);
+		return kwp * 1000 * .85f * std::pow(elevation, 1.3f) * (.65f + .35f * summer) * clearness * cloud;
+	}
+};
+
+// inverter with battery which follows the requested power after a delay and with limited ramp
+struct inverter_model {
+	float capacity_wh{};
+	float soc{50};
+	float ac_w{};			// positive is export
+	float pv_w{};			// actually used pv power (can be curtailed)
+	float battery_w{};		// positive is discharge
+	std::deque<float> requests{};
+
+	void step(float requested, float pv_avail, const ControlPowerInfo &c, int delay_s, float ramp) {
+		requests.push_back(requested);
+		float target = ac_w;
+		if (int(requests.size()) > delay_s) {
+			target = requests.front();
+			requests.pop_front();
+		}
+		target = std::clamp(target, -c.power_max, c.power_max);
+		ac_w = std::clamp(target, ac_w - ramp * DT_S, ac_w + ramp * DT_S);
+		// the battery takes the difference between pv and ac, limited by its power and soc
+		float max_discha = soc > 0 ? c.power_max_discha: 0;
+		float max_cha = soc < 100 ? c.power_max_cha: 0;
+		battery_w = std::clamp(ac_w - pv_avail, -max_cha, max_discha);
+		pv_w = pv_avail;
+		if (ac_w - pv_avail < -max_cha) // battery full, curtail pv
+			pv_w = ac_w + max_cha;
+		ac_w = pv_w + battery_w;
+		soc = std::clamp(soc - battery_w * DT_S / S_PER_H / capacity_wh * 100, 0.f, 100.f);
+	}
+};
+
+static float parse_float(int &i, int argc, char **argv) { return i + 1 < argc ? std::atof(argv[++i]): 0; }
+
+static sim_result simulate(const sim_config &cfg);
+
+int main(int argc, char **argv) {
+	sim_config cfg{};
+	for (int i = 1; i < argc; ++i) {
+		std::string_view a{argv[i]};
+		if (a == "--days") cfg.days = parse_float(i, argc, argv);
+		else if (a == "--seed") cfg.seed = parse_float(i, argc, argv);
+		else if (a == "--inverters") cfg.inverters = std::clamp(int(parse_float(i, argc, argv)), 1, MAX_INVERTERS);
+		else if (a == "--pv-kwp") cfg.pv_kwp = parse_float(i, argc, argv);
+		else if (a == "--battery-kwh") cfg.battery_kwh = parse_float(i, argc, argv);
+		else if (a == "--power-max") cfg.power_max = parse_float(i, argc, argv);
+		else if (a == "--max-export") cfg.max_export = parse_float(i, argc, argv);
+		else if (a == "--max-export-phase") cfg.max_export_phase = parse_float(i, argc, argv);
+		else if (a == "--phase-balancing") cfg.phase_balancing = true;
+		else if (a == "--alpha") cfg.filter_alpha = parse_float(i, argc, argv);
+		else if (a == "--loop-gain") cfg.loop_gain = parse_float(i, argc, argv);
+		else if (a == "--auto-tune") cfg.auto_tune = true;
+		else if (a == "--delay") cfg.delay_s = parse_float(i, argc, argv);
+		else if (a == "--ramp") cfg.ramp_w_s = parse_float(i, argc, argv);
+		else if (a == "--storage-refetch") cfg.storage_refetch_s = parse_float(i, argc, argv);
+		else if (a == "--no-soc-estimate") cfg.soc_estimate = false;
+		else if (a == "--wallbox") cfg.wallbox_a = parse_float(i, argc, argv);
+		else if (a == "--wear-aware") cfg.wear_aware = true;
+		else if (a == "--daily" && i + 1 < argc) cfg.daily_csv = argv[++i];
+		else {
+			std::cerr << "Unknown argument " << a << ", see the head of tools/emm_sim.cpp for the usage\n";
+			return 1;
+		}
+	}
+
+	if (cfg.wear_aware) {
+		sim_config baseline_cfg = cfg;
+		baseline_cfg.wear_aware = false;
+		baseline_cfg.daily_csv = nullptr;
+		sim_result baseline = simulate(baseline_cfg);
+		sim_result res = simulate(cfg);
+		res.print(std::cout, cfg.inverters * cfg.battery_kwh * 1000.);
+		std::cout << "wear aware allocation saves " << baseline.cycles() - res.cycles() << " full cycles ("
+			<< 100 * (1 - res.cycles() / std::max(baseline.cycles(), 1e-3f)) << " %) and "
+			<< baseline.half_cycles() - res.half_cycles() << " half cycles, "
+			<< (baseline.battery_discharge_wh - res.battery_discharge_wh) / 1000 << " kWh less discharge\n";
+		return 0;
+	}
+	simulate(cfg).print(std::cout, cfg.inverters * cfg.battery_kwh * 1000.);
+	return 0;
+}
+
+static sim_result simulate(const sim_config &cfg) {
+	std::mt19937 rng{cfg.seed};
+	load_model load{rng};
+	pv_model pv{rng};
+	std::array<inverter_model, MAX_INVERTERS> plant{};
+	std::array<soc_estimator, MAX_INVERTERS> soc_estimators{};
+	EMM emm{.filter_alpha = cfg.filter_alpha, .loop_gain = cfg.loop_gain};
+	auto_tune tune{};
+	settings s{.enable_emm = true, .max_export = cfg.max_export};
+	s.phase_balancing = cfg.phase_balancing;
+	s.max_export_phase = cfg.max_export_phase;
+	s.wear_aware = cfg.wear_aware;
+	static_vector<InverterGroup, MAX_INVERTERS> groups{};
+	static_vector<ControlPowerInfo, MAX_INVERTERS> controls{};
+	for (int i: range(cfg.inverters)) {
+		plant[i].capacity_wh = cfg.battery_kwh * 1000;
+		groups.push(InverterGroup{
+			.inverter = {.device_id = METER_ID + 1 + 3 * i},
+			.pv = {.device_id = METER_ID + 2 + 3 * i},
+			.battery = {.device_id = METER_ID + 3 + 3 * i},
+			.bat_soc = plant[i].soc,
+			.phase = cfg.phase_balancing ? Phase(1 + i % PHASES): Phase::ALL,
+		});
+		controls.push(ControlPowerInfo{
+			.min_soc = cfg.min_soc,
+			.power_max = cfg.power_max,
+			.power_max_cha = cfg.power_max_cha,
+			.power_max_discha = cfg.power_max_discha,
+			.requested_power = 0,
+			.bat_priority = 1,
+			.last_connection_s = 0,
+		});
+	}
+
+	// the wallbox constraints match the ones load_infos sets for a three phase wallbox
+	static_vector<LoadInfo, MAX_LOADS> loads{};
+	if (cfg.wallbox_a > 0)
+		loads.push(LoadInfo{.power = {.device_id = METER_ID + 1 + 3 * cfg.inverters}, .power_min = 6 * 230 * 3, .power_max = std::max(cfg.wallbox_a, 6.f) * 230 * 3,
+				    .power_step = 230 * 3, .requested_power = 0, .min_switch_s = 5 * 60, .last_switch_s = 0, .last_connection_s = 0});
+
+	std::ofstream daily;
+	if (cfg.daily_csv) {
+		daily.open(cfg.daily_csv);
+		daily << "day,load_wh,pv_wh,import_wh,export_wh,soc_end\n";
+	}
+	sim_result res{.inverters = cfg.inverters}, day_res{};
+	const auto to_wh = [](float w) { return w * DT_S / S_PER_H; };
+	auto start = std::chrono::steady_clock::now();
+	const int steps_per_day = int(24 * S_PER_H / DT_S);
+	for (int day: range(cfg.days)) {
+		for (int step: range(steps_per_day)) {
+			float hour = step * DT_S / S_PER_H;
+			uint64_t now_us = uint64_t((int64_t(day) * steps_per_day + step) * int64_t(DT_S * 1'000'000));
+			bool storage_read = cfg.storage_refetch_s <= 0 || step % cfg.storage_refetch_s == 0;
+			float load_w = load.step(day, hour);
+			float pv_kwp_w = pv.step(day, hour, cfg.pv_kwp);
+
+			// plant follows the last requests, the wallbox applies the setpoint of the previous cycle
+			std::array<float, PHASES> grid_phase = load.phase_w;
+			for (LoadInfo &l: loads) {
+				res.wallbox_switches += (l.requested_power > 0) != (l.power.imp_w > 0);
+				l.power.imp_w = l.requested_power;
+				l.last_connection_s = time_us_64() / 1000000;
+				load_w += l.power.imp_w;
+				for (float &w: grid_phase)
+					w += l.power.imp_w / PHASES;
+				day_res.wallbox_wh += to_wh(l.power.imp_w);
+			}
+			float inverters_w{};
+			for (int i: range(cfg.inverters)) {
+				inverter_model &inv = plant[i];
+				inv.step(controls[i].requested_power, pv_kwp_w, controls[i], cfg.delay_s, cfg.ramp_w_s);
+				controls[i].last_connection_s = time_us_64() / 1000000;
+				inverters_w += inv.ac_w;
+				for (int p: range(PHASES))
+					grid_phase[p] -= phase_share(groups[i].phase, p) * inv.ac_w;
+				day_res.pv_wh += to_wh(inv.pv_w);
+				day_res.battery_charge_wh += to_wh(std::max(-inv.battery_w, 0.f));
+				day_res.battery_discharge_wh += to_wh(std::max(inv.battery_w, 0.f));
+				res.wear[i].update(std::max(-inv.battery_w, 0.f), std::max(inv.battery_w, 0.f), inv.soc, DT_S / S_PER_H);
+			}
+			float grid_w = load_w - inverters_w;
+			day_res.load_wh += to_wh(load_w);
+			day_res.import_wh += to_wh(std::max(grid_w, 0.f));
+			day_res.export_wh += to_wh(std::max(-grid_w, 0.f));
+			day_res.export_violations_s += cfg.max_export > 0 && -grid_w > cfg.max_export + 50;
+			if (cfg.max_export_phase > 0)
+				day_res.phase_violations_s += std::any_of(grid_phase.begin(), grid_phase.end(), [&](float w){ return -w > cfg.max_export_phase + 50; });
+
+			// measurements as the firmware sees them (see update_home_power in main.cpp)
+			std::array<float, PHASES> home_phase = grid_phase;
+			for (int i: range(cfg.inverters)) {
+				const inverter_model &inv = plant[i];
+				groups[i].inverter.exp_w = std::max(inv.ac_w, 0.f);
+				groups[i].inverter.imp_w = std::max(-inv.ac_w, 0.f);
+				groups[i].pv.exp_w = inv.pv_w;
+				groups[i].battery.exp_w = std::max(inv.battery_w, 0.f);
+				groups[i].battery.imp_w = std::max(-inv.battery_w, 0.f);
+				if (cfg.storage_refetch_s <= 0)
+					groups[i].bat_soc = inv.soc;
+				else if (storage_read)
+					groups[i].bat_soc = soc_estimators[i].correct(std::round(inv.soc));
+				else if (cfg.soc_estimate)
+					groups[i].bat_soc = soc_estimators[i].integrate(-inv.battery_w, now_us);
+				res.soc_error_sum += std::abs(groups[i].bat_soc - inv.soc);
+				++res.soc_samples;
+				for (int p: range(PHASES))
+					home_phase[p] += phase_share(groups[i].phase, p) * inv.ac_w;
+			}
+			emm.update_power(grid_w + inverters_w, home_phase, groups.to_span(), controls.to_span(), s, loads.to_span(), uint32_t(now_us / 1000000));
+			if (cfg.auto_tune && day == 0 && step == int(12 * S_PER_H / DT_S))
+				tune.request(0);
+			if (tune.update(groups.to_span(), controls.to_span(), grid_w + inverters_w)) {
+				if (tune.cur_state == auto_tune::state::DONE) {
+					std::cerr << "auto tune: dead time " << tune.dead_time_s << " s, time constant " << tune.time_constant_s << " s, disturbance "
+						<< tune.disturbance << " -> alpha " << tune.filter_alpha << ", loop gain " << tune.loop_gain << '\n';
+					emm.filter_alpha = tune.filter_alpha;
+					emm.loop_gain = tune.loop_gain;
+				} else {
+					std::cerr << "auto tune failed: " << tune.error << '\n';
+				}
+			}
+			for (int i: range(cfg.inverters))
+				res.request_violations += std::abs(controls[i].requested_power) > controls[i].power_max + 1 || std::isnan(controls[i].requested_power);
+		}
+		if (daily.is_open())
+			daily << day << ',' << day_res.load_wh << ',' << day_res.pv_wh << ',' << day_res.import_wh << ',' << day_res.export_wh << ',' << plant[0].soc << '\n';
+		res.load_wh += day_res.load_wh;
+		res.pv_wh += day_res.pv_wh;
+		res.import_wh += day_res.import_wh;
+		res.export_wh += day_res.export_wh;
+		res.battery_charge_wh += day_res.battery_charge_wh;
+		res.battery_discharge_wh += day_res.battery_discharge_wh;
+		res.wallbox_wh += day_res.wallbox_wh;
+		res.export_violations_s += day_res.export_violations_s;
+		res.phase_violations_s += day_res.phase_violations_s;
+		day_res = {};
+	}
+	auto end = std::chrono::steady_clock::now();
+	double sim_s = std::chrono::duration<double>(end - start).count();
+
+	std::cerr << "simulated " << cfg.days << " days in " << sim_s << " s (" << cfg.days * 24 * S_PER_H / std::max(sim_s, 1e-9) << "x realtime)\n";
+	return res;
+}
@@ -0,0 +1,217 @@
+/**
+ * Copyright (c) 2026 Josef Stumpfegger josefstumpfegger@outlook.de
+ */
+
+// Compresses per second power series with the gorilla codec of the per second history and reports the
+// compression ratio against the uncompressed t::data_time samples and the encode/decode throughput.
+// The series are also aggregated to minute and hour buckets (mean, min, max, count) like in history_data and
+// compressed with the codec of the per minute and per hour history.
+// The series are taken from recorded control loop traces (http GET /trace, all meter, home and inverter powers
+// and the soc) or, without a trace, from synthetic days of a household with pv and battery in whole watts.
+// Every series is decoded again and compared bit exact.
+//
+// usage: gorilla_bench [trace.bin ...] [--days N] [--repeat N] [--seed S]
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "history_data.h"
+#include "trace_format.h"
+
+using series = gorilla::series<t::data_time, 1 << 17>;
+using bucket_series = gorilla::series<t::data_bucket, 1 << 12>;
+static series compressed{};
+static bucket_series compressed_buckets{};
+
+// psram of a level of the device histories
+static size_t level_bytes(hd::resolution res) { return hd::level_blocks(hd::DEVICE_RETENTION_S[int(res)], res) * gorilla::block::BYTES; }
+
+static bool read_trace(const char *path, std::vector<std::vector<t::data_time>> &out) {
+	std::ifstream in(path, std::ios::binary);
+	trace::file_header header{};
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != trace::MAGIC || header.version != trace::VERSION ||
+	    header.max_inverters != MAX_INVERTERS || header.frame_size != sizeof(trace::frame)) {
+		std::cerr << "Failed to read the trace " << path << " (see tools/emm_replay for the format checks)\n";
+		return false;
+	}
+	std::vector<trace::frame> frames(header.frame_count);
+	if (!in.read(reinterpret_cast<char*>(frames.data()), frames.size() * sizeof(trace::frame))) {
+		std::cerr << "Trace " << path << " is truncated\n";
+		return false;
+	}
+	std::vector<t::data_time> meter, home;
+	std::array<std::vector<t::data_time>, MAX_INVERTERS * 4> inverters;
+	for (const trace::frame &f: frames) {
+		meter.push_back({f.meter_w, f.epoch_s});
+		home.push_back({f.home_w, f.epoch_s});
+		for (int i: range(f.inverter_count)) {
+			const trace::inverter_sample &s = f.inverters[i];
+			inverters[4 * i + 0].push_back({s.inverter_w, f.epoch_s});
+			inverters[4 * i + 1].push_back({s.pv_w, f.epoch_s});
+			inverters[4 * i + 2].push_back({s.battery_w, f.epoch_s});
+			inverters[4 * i + 3].push_back({s.bat_soc, f.epoch_s});
+		}
+	}
+	out.push_back(std::move(meter));
+	out.push_back(std::move(home));
+	for (std::vector<t::data_time> &v: inverters)
+		if (v.size())
+			out.push_back(std::move(v));
+	return true;
+}
+
+// days of pv with clouds, a noisy home load with appliance spikes and the battery covering the difference up to
+// the control error of the emm
+static void synthetic_days(int days, uint32_t seed, std::vector<std::vector<t::data_time>> &out) {
+	std::mt19937 rng{seed};
+	std::normal_distribution<float> noise{0, 1};
+	std::uniform_real_distribution<float> chance{0, 1};
+	std::vector<t::data_time> meter, pv, battery, soc;
+	const uint32_t start_s{1'750'000'000 / 86400 * 86400};
+	float cloud{1}, base{300}, spike{}, soc_pct{50};
+	for (uint32_t s: range(86400 * days)) {
+		uint32_t time = start_s + s;
+		float sun = std::max(std::sin((float(s % 86400) / 86400 - .25f) * 2 * float(M_PI)), 0.f);
+		cloud = std::clamp(cloud + .01f * noise(rng), .2f, 1.f);
+		base = std::clamp(base + 2 * noise(rng), 150.f, 600.f);
+		if (chance(rng) < .001f)
+			spike = spike ? 0: 2000 * chance(rng);
+		float pv_w = std::round(6000 * sun * cloud + 5 * noise(rng) * (sun > 0));
+		float home_w = std::round(base + spike + 10 * noise(rng));
+		float battery_w = std::clamp(std::round(home_w - pv_w), soc_pct > 5 ? -3000.f: 0.f, soc_pct < 100 ? 3000.f: 0.f);
+		soc_pct = std::clamp(soc_pct - battery_w / 3600 / 10000 * 100, 0.f, 100.f);
+		meter.push_back({home_w - pv_w - battery_w + std::round(15 * noise(rng)), time}); // control error of the emm
+		pv.push_back({-pv_w, time});
+		battery.push_back({-battery_w, time});
+		soc.push_back({std::round(soc_pct * 100) / 100, time});
+	}
+	out = {meter, pv, battery, soc};
+}
+
+// minute and hour buckets as aggregated by history_data
+static void aggregate(const std::vector<t::data_time> &values, std::vector<t::data_bucket> &minutes, std::vector<t::data_bucket> &hours) {
+	minutes.clear();
+	hours.clear();
+	t::accumulator minute{}, hour{};
+	for (const t::data_time &v: values) {
+		if (minute.n && minute.start != v.time / 60 * 60) {
+			minutes.push_back(minute.bucket());
+			if (hour.start != minute.start / 3600 * 3600)
+				hour.reset(minute.start / 3600 * 3600);
+			hour.add(minute.mean(), minute.min, minute.max);
+		}
+		if (hour.n && hour.start != v.time / 3600 * 3600) {
+			hours.push_back(hour.bucket());
+			hour.reset(v.time / 3600 * 3600);
+		}
+		if (minute.start != v.time / 60 * 60)
+			minute.reset(v.time / 60 * 60);
+		minute.add(v.data);
+	}
+}
+
+struct bucket_stats {
+	size_t buckets{};
+	size_t blocks{};
+	size_t bits{};
+	double bytes_per_bucket() const { return double(blocks * gorilla::block::BYTES) / std::max(buckets, size_t(1)); }
+};
+
+// returns false if the decoded buckets differ
+static bool compress_buckets(const std::vector<t::data_bucket> &buckets, bucket_stats &stats) {
+	static std::vector<t::data_bucket> decoded;
+	compressed_buckets.clear();
+	for (const t::data_bucket &b: buckets)
+		compressed_buckets.push(b);
+	decoded.resize(buckets.size());
+	int n = compressed_buckets.read(0, UINT32_MAX, decoded);
+	if (n != int(buckets.size()))
+		return false;
+	for (int i: range(n)) {
+		const t::data_bucket &a = buckets[i], &b = decoded[i];
+		if (a.time != b.time || a.n != b.n || std::memcmp(&a, &b, 3 * sizeof(float)) != 0)
+			return false;
+	}
+	stats.buckets += buckets.size();
+	stats.blocks += compressed_buckets.blocks.size();
+	for (const gorilla::block &b: compressed_buckets.blocks)
+		stats.bits += gorilla::block::HEADER_BYTES * 8 + b.bits;
+	return true;
+}
+
+int main(int argc, char **argv) {
+	std::vector<std::vector<t::data_time>> all_series;
+	int repeat{10};
+	int days{1};
+	uint32_t seed{1};
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+			repeat = std::max(std::atoi(argv[++i]), 1);
+		else if (std::strcmp(argv[i], "--days") == 0 && i + 1 < argc)
+			days = std::max(std::atoi(argv[++i]), 1);
+		else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = std::atoi(argv[++i]);
+		else if (!read_trace(argv[i], all_series))
+			return 1;
+	}
+	if (all_series.empty())
+		synthetic_days(days, seed, all_series);
+
+	size_t samples{}, bits{}, blocks{};
+	double encode_ns{}, decode_ns{};
+	std::vector<t::data_time> decoded;
+	std::vector<t::data_bucket> minutes, hours;
+	bucket_stats minute_stats{}, hour_stats{};
+	for (const std::vector<t::data_time> &values: all_series) {
+		aggregate(values, minutes, hours);
+		if (!compress_buckets(minutes, minute_stats) || !compress_buckets(hours, hour_stats)) {
+			std::cerr << "Decoded buckets differ from the input\n";
+			return 1;
+		}
+		if (values.size() > size_t(compressed.blocks.storage.size()) * 24) { // 24 samples fit a block in the worst case
+			std::cerr << "Series too long for the benchmark\n";
+			return 1;
+		}
+		decoded.resize(values.size());
+		for (int r: range(repeat)) {
+			auto t0 = std::chrono::steady_clock::now();
+			compressed.clear();
+			for (const t::data_time &v: values)
+				compressed.push(v);
+			auto t1 = std::chrono::steady_clock::now();
+			int n = compressed.read(0, UINT32_MAX, decoded);
+			auto t2 = std::chrono::steady_clock::now();
+			encode_ns += std::chrono::duration<double, std::nano>(t1 - t0).count();
+			decode_ns += std::chrono::duration<double, std::nano>(t2 - t1).count();
+			if (r)
+				continue;
+			if (n != int(values.size()) || std::memcmp(decoded.data(), values.data(), values.size() * sizeof(t::data_time)) != 0) {
+				std::cerr << "Decoded series differs from the input\n";
+				return 1;
+			}
+			samples += values.size();
+			blocks += compressed.blocks.size();
+			for (const gorilla::block &b: compressed.blocks)
+				bits += gorilla::block::HEADER_BYTES * 8 + b.bits;
+		}
+	}
+	double bytes_per_sample = double(blocks * gorilla::block::BYTES) / samples;
+	std::cout << all_series.size() << " series, " << samples << " samples\n";
+	std::cout << "payload " << bits / 8. / samples << " bytes per sample, with block padding " << bytes_per_sample << " bytes per sample\n";
+	std::cout << "compression " << sizeof(t::data_time) / bytes_per_sample << "x against " << sizeof(t::data_time) << " byte samples, "
+		  << "the per second history holds " << level_bytes(hd::resolution::SECOND) / bytes_per_sample / 3600 << " hours\n";
+	const auto print_buckets = [](const char *name, const bucket_stats &stats, size_t storage_bytes, double bucket_s) {
+		std::cout << name << " buckets: " << stats.buckets << ", payload " << stats.bits / 8. / std::max(stats.buckets, size_t(1))
+			  << " bytes per bucket, with block padding " << stats.bytes_per_bucket() << " bytes per bucket against "
+			  << sizeof(t::data_bucket) << " uncompressed, the history holds " << storage_bytes / stats.bytes_per_bucket() * bucket_s / 86400 << " days\n";
+	};
+	print_buckets("minute", minute_stats, level_bytes(hd::resolution::MINUTE), 60);
+	print_buckets("hour", hour_stats, level_bytes(hd::resolution::HOUR), 3600);
+	std::cout << "encode " << encode_ns / (samples * repeat) << " ns per sample, decode " << decode_ns / (samples * repeat) << " ns per sample\n";
+	return 0;
+}
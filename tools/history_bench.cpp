@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) 2026 Josef Stumpfegger josefstumpfegger@outlook.de
+ */
+
+// Feeds a random per second series with gaps into history_data and into the previous rescanning aggregation.
+// Reports the time per write (which is the time the history lock is held) and compares the minute and hour means,
+// the compressed buckets are decoded for the comparison.
+// The previous aggregation left the last minute of each hour out of the hour mean, those hours are reported as differing.
+//
+// usage: history_bench [--days N] [--gap-probability P] [--seed S]
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include "emm_structs.h"
+#include "history_data.h"
+#include "ranges_util.h"
+
+// history as it was before the running accumulators and the compressed samples and buckets
+struct rescanned_data {
+	static_ring_buffer<t::data_time, 3600 * 2> per_second;
+	static_ring_buffer<t::data_time, 60 * 24 * 7> per_minute;
+	static_ring_buffer<t::data_time, 24 * 366 * 2> per_hour;
+};
+// aggregation as it was before the running accumulators, rescans the last 60 entries on each rollover
+static void add_data_rescan(rescanned_data &locked_data, float value, time_t epoch_time_s) {
+	bool has_data = locked_data.per_second.size();
+	uint32_t prev_minute = locked_data.per_second[-1].time / 60;
+	std::optional<t::data_time> new_per_minute{};
+	if (has_data && prev_minute != epoch_time_s / 60) {
+		float sum{};
+		int n{};
+		for (int i: range(60)) {
+			t::data_time dt = locked_data.per_second[-60 + i];
+			if (dt.time / 60 == prev_minute) {
+				sum += dt.data;
+				n += 1;
+			}
+		}
+		new_per_minute = {sum / n, prev_minute * 60};
+	}
+
+	has_data = locked_data.per_minute.size();
+	uint32_t prev_hour = locked_data.per_second[-1].time / 3600;
+	std::optional<t::data_time> new_per_hour{};
+	if (has_data && prev_hour != epoch_time_s / 3600) {
+		float sum{};
+		int n{};
+		for (int i: range(60)) {
+			t::data_time dt = locked_data.per_minute[-60 + i];
+			if (dt.time / 3600 == prev_hour) {
+				sum += dt.data;
+				n += 1;
+			}
+		}
+		new_per_hour = {sum / n, prev_hour * 3600};
+	}
+
+	locked_data.per_second.push({value, uint32_t(epoch_time_s)});
+	if (new_per_minute)
+		locked_data.per_minute.push(new_per_minute.value());
+	if (new_per_hour)
+		locked_data.per_hour.push(new_per_hour.value());
+}
+
+struct timing {
+	double total_ns{};
+	double max_ns{};
+	int n{};
+	void add(double ns) { total_ns += ns; max_ns = std::max(max_ns, ns); ++n; }
+	double mean() const { return total_ns / std::max(n, 1); }
+};
+
+// compares the newest buckets which are in both histories
+template<int N>
+static int count_differing(const std::vector<t::data_bucket> &a, const static_ring_buffer<t::data_time, N> &b) {
+	int differing{};
+	for (int i = 1; i <= std::min(int(a.size()), int(b.size())); ++i)
+		differing += a[a.size() - i].time != b[-i].time || a[a.size() - i].data != b[-i].data;
+	return differing;
+}
+
+static std::vector<t::data_bucket> decode(const auto &series) {
+	std::vector<t::data_bucket> buckets(series.size());
+	buckets.resize(series.read(0, UINT32_MAX, buckets));
+	return buckets;
+}
+
+static rescanned_data rescanned;
+
+int main(int argc, char **argv) {
+	int days{2};
+	float gap_probability{.001f};
+	uint32_t seed{1};
+	for (int i = 1; i < argc; ++i) {
+		const auto next = [&]() { return i + 1 < argc ? std::atof(argv[++i]): 0.; };
+		if (std::strcmp(argv[i], "--days") == 0) days = std::max(int(next()), 1);
+		else if (std::strcmp(argv[i], "--gap-probability") == 0) gap_probability = next();
+		else if (std::strcmp(argv[i], "--seed") == 0) seed = next();
+		else {
+			std::cerr << "Unknown argument " << argv[i] << ", see the head of tools/history_bench.cpp for the usage\n";
+			return 1;
+		}
+	}
+
+	std::mt19937 rng{seed};
+	std::uniform_real_distribution<float> power{-5000, 5000};
+	std::uniform_real_distribution<float> chance{0, 1};
+	std::uniform_int_distribution<uint32_t> gap{2, 600};
+	hd::init();
+	rescanned = {};
+	timing incremental{}, rescan{}, incremental_rollover{}, rescan_rollover{};
+	int samples{};
+	uint32_t prev_time{};
+	const uint32_t start_s{1'750'000'000};
+	for (uint32_t time = start_s; time < start_s + days * 24 * 3600; ++time) {
+		if (chance(rng) < gap_probability)
+			time += gap(rng); // modbus timeouts or no ntp time
+		float value = power(rng);
+		auto t0 = std::chrono::steady_clock::now();
+		hd::write({hd::series_id::METER, METER_ID}, value, time);
+		auto t1 = std::chrono::steady_clock::now();
+		add_data_rescan(rescanned, value, time);
+		auto t2 = std::chrono::steady_clock::now();
+		incremental.add(std::chrono::duration<double, std::nano>(t1 - t0).count());
+		rescan.add(std::chrono::duration<double, std::nano>(t2 - t1).count());
+		if (time / 60 != prev_time / 60) {
+			incremental_rollover.add(std::chrono::duration<double, std::nano>(t1 - t0).count());
+			rescan_rollover.add(std::chrono::duration<double, std::nano>(t2 - t1).count());
+		}
+		prev_time = time;
+		++samples;
+	}
+
+	const t::device_data &data = g::history_series[hd::series_id::METER].slots[0];
+	std::vector<t::data_bucket> minutes = decode(data.per_minute), hours = decode(data.per_hour);
+	std::cout << samples << " samples, " << minutes.size() << " minutes, " << hours.size() << " hours\n";
+	std::cout << "incremental " << incremental.mean() << " ns mean, " << incremental_rollover.mean() << " ns mean on minute rollover, " << incremental.max_ns << " ns max per write\n";
+	std::cout << "rescan      " << rescan.mean() << " ns mean, " << rescan_rollover.mean() << " ns mean on minute rollover, " << rescan.max_ns << " ns max per write\n";
+	std::cout << count_differing(minutes, rescanned.per_minute) << " minutes differ from the rescan\n";
+	std::cout << count_differing(hours, rescanned.per_hour) << " hours differ from the rescan (it missed the last minute of each hour)\n";
+	int hours_off{}, envelopes_off{};
+	for (const t::data_bucket &h: hours) {
+		if (h.time < minutes[0].time) // minutes already dropped from the history
+			continue;
+		float sum{}, min{INFINITY}, max{-INFINITY};
+		int n{};
+		for (const t::data_bucket &m: minutes) {
+			if (m.time / 3600 * 3600 != h.time)
+				continue;
+			sum += m.data;
+			min = std::min(min, m.min);
+			max = std::max(max, m.max);
+			++n;
+		}
+		hours_off += !n || sum / n != h.data || n != h.n;
+		envelopes_off += min != h.min || max != h.max;
+	}
+	std::cout << hours_off << " hours differ from the mean of their minutes, " << envelopes_off << " from the min and max of their minutes\n";
+	return 0;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+
+// host replacement of the FreeRTOS types used by the headers in include/, the tools are single threaded
+using BaseType_t = long;
+using TickType_t = uint32_t;
+constexpr BaseType_t pdTRUE{1};
+constexpr BaseType_t pdFALSE{0};
+constexpr TickType_t portMAX_DELAY{0xffffffff};
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// host replacement of the pico sdk timer for the tools in this folder
+inline uint64_t time_us_64() { return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
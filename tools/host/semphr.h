@@ -0,0 +1,12 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+// host replacement of the FreeRTOS semaphores, locking always succeeds as the tools are single threaded
+using SemaphoreHandle_t = void*;
+inline SemaphoreHandle_t xSemaphoreCreateBinary() { static int dummy; return &dummy; }
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { static int dummy; return &dummy; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline BaseType_t uxSemaphoreGetCount(SemaphoreHandle_t) { return 1; }
+inline void vSemaphoreDelete(SemaphoreHandle_t) {}
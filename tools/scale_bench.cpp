@@ -0,0 +1,155 @@
+/**
+ * Copyright (c) 2026 Josef Stumpfegger josefstumpfegger@outlook.de
+ */
+
+// Measures the per cycle cost of the control loop for 8, 32 and 64 inverters (built with MAX_INVERTERS=64):
+// the register decoding of the inverter poller (inverter_decode.h, the values the modbus parse writes into the
+// register mirrors are decoded into read_power and the soc estimators are integrated) and EMM::update_power_t in
+// float and fixed point. Also prints the sram of the per device control state and the psram of the register mirrors.
+// The mirrors are the generic_modbus_layout of the poller, the models are looked up in them by address as the poller
+// does. modbus_register of libmodbus-static adds the slave address to each mirror.
+// The tcp and modbus handling of the poller (lwip, libmodbus-static) is not part of the host build, on the device
+// the usb command 'timing' shows the retrieve and wait phases of the poller.
+//
+// usage: scale_bench [--cycles N] [--repeat N] [--seed S]
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "emm.h"
+#include "inverter_decode.h"
+#include "soc_estimator.h"
+
+static_assert(MAX_INVERTERS >= 64);
+
+// register addresses of the models as the poller finds them in a device with the default sunspec layout
+template<typename T>
+static int model_addr() {
+	static const inverter_registers regs{};
+	return generic_halfs_registers::OFFSET + int((const uint16_t*)static_cast<const T*>(&regs) - (const uint16_t*)&regs);
+}
+
+struct cycle_input {
+	float home_w;
+	std::array<float, PHASES> home_phase_w;
+	std::vector<float> ac_w, pv_w, charge_w;
+};
+
+struct devices {
+	std::vector<generic_modbus_layout> mirrors;
+	static_vector<InverterGroup, MAX_INVERTERS> groups{};
+	static_vector<ControlPowerInfo, MAX_INVERTERS> controls{};
+	static_vector<soc_estimator, MAX_INVERTERS> socs{};
+};
+
+static double ns_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+// writes the registers of the cycle as the modbus parse does and decodes them, returns the ns per cycle
+static double poll(devices &d, const std::vector<cycle_input> &cycles, int repeat) {
+	double total_ns{};
+	uint64_t now_us{};
+	for (int r [[maybe_unused]]: range(repeat)) {
+		for (const cycle_input &c: cycles) {
+			now_us += 1000000;
+			auto start = std::chrono::steady_clock::now();
+			for (int i: range(d.groups.size())) {
+				generic_modbus_layout &m = d.mirrors[i];
+				model_inverter *inverter = m.get_addr_as<model_inverter>(model_addr<model_inverter>());
+				model_mppt *mppt = m.get_addr_as<model_mppt>(model_addr<model_mppt>());
+				inverter->W = modbus_swap_f(c.ac_w[i]);
+				mppt->module_1_DCW = modbus_swap(uint16_t(c.pv_w[i] / 2));
+				mppt->module_2_DCW = modbus_swap(uint16_t(c.pv_w[i] / 2));
+				mppt->module_3_DCW = modbus_swap(uint16_t(std::max(c.charge_w[i], 0.f)));
+				mppt->module_4_DCW = modbus_swap(uint16_t(std::max(-c.charge_w[i], 0.f)));
+				InverterGroup &ig = d.groups[i];
+				inverter_decode::ac_power(*inverter, ig.inverter);
+				inverter_decode::dc_power(*mppt, true, ig.pv, ig.battery);
+				ig.bat_soc = d.socs[i].integrate(ig.battery.imp_w - ig.battery.exp_w, now_us);
+			}
+			total_ns += ns_since(start);
+		}
+	}
+	return total_ns / (cycles.size() * repeat);
+}
+
+template<typename T>
+static double allocate(devices &d, const std::vector<cycle_input> &cycles, const settings &s, int repeat) {
+	EMM emm{};
+	double total_ns{};
+	for (int r [[maybe_unused]]: range(repeat)) {
+		for (const cycle_input &c: cycles) {
+			for (int i: range(d.groups.size())) {
+				d.groups[i].inverter = {.device_id = d.groups[i].inverter.device_id, .imp_w = std::max(-c.ac_w[i], 0.f), .exp_w = std::max(c.ac_w[i], 0.f)};
+				d.groups[i].pv.exp_w = c.pv_w[i];
+			}
+			auto start = std::chrono::steady_clock::now();
+			emm.update_power_t<T>(c.home_w, c.home_phase_w, d.groups.to_span(), d.controls.to_span(), s);
+			total_ns += ns_since(start);
+		}
+	}
+	return total_ns / (cycles.size() * repeat);
+}
+
+int main(int argc, char **argv) {
+	int cycle_count{2000};
+	int repeat{10};
+	uint32_t seed{1};
+	for (int i = 1; i < argc; ++i) {
+		const auto next = [&]() { return i + 1 < argc ? std::atof(argv[++i]): 0.; };
+		if (std::strcmp(argv[i], "--cycles") == 0) cycle_count = std::max(int(next()), 1);
+		else if (std::strcmp(argv[i], "--repeat") == 0) repeat = std::max(int(next()), 1);
+		else if (std::strcmp(argv[i], "--seed") == 0) seed = next();
+		else {
+			std::cerr << "Unknown argument " << argv[i] << ", see the head of tools/scale_bench.cpp for the usage\n";
+			return 1;
+		}
+	}
+
+	const settings s{.enable_emm = true};
+	std::mt19937 rng{seed};
+	const auto uniform = [&rng](float a, float b) { return std::uniform_real_distribution<float>{a, b}(rng); };
+	constexpr size_t DEVICE_SRAM{sizeof(InverterGroup) + sizeof(ControlPowerInfo) + sizeof(soc_estimator)};
+	std::cout << "sram per device " << DEVICE_SRAM << " bytes (read_power, control_infos, soc_estimators), psram per register mirror "
+		  << sizeof(generic_modbus_layout) << " bytes\n";
+	for (int count: {8, 32, 64}) {
+		std::vector<cycle_input> cycles(cycle_count);
+		for (cycle_input &c: cycles) {
+			c.home_w = 0;
+			for (float &w: c.home_phase_w) {
+				w = uniform(-2000, 3000);
+				c.home_w += w;
+			}
+			for (int i [[maybe_unused]]: range(count)) {
+				c.ac_w.push_back(uniform(-2500, 5000));
+				c.pv_w.push_back(uniform(0, 5000));
+				c.charge_w.push_back(uniform(-2500, 2500));
+			}
+		}
+		devices d{.mirrors = std::vector<generic_modbus_layout>(count)};
+		for (generic_modbus_layout &m: d.mirrors) {
+			const inverter_registers regs{};
+			std::memcpy(m.halfs_registers.data.data(), &regs, sizeof(regs));
+		}
+		for (int i: range(count)) {
+			d.groups.push(InverterGroup{.inverter = {.device_id = METER_ID + 1 + 3 * i}, .pv = {.device_id = METER_ID + 2 + 3 * i},
+						    .battery = {.device_id = METER_ID + 3 + 3 * i}, .bat_soc = 50});
+			d.controls.push(ControlPowerInfo{.min_soc = 10, .power_max = 5000, .power_max_cha = 2500, .power_max_discha = 2500,
+							 .requested_power = 0, .bat_priority = 1 + int(rng() % 3), .last_connection_s = 0});
+			d.socs.push(soc_estimator{});
+			d.socs[i].correct(50);
+			d.socs[i].capacity_wh = 10000;
+		}
+		double poll_ns = poll(d, cycles, repeat);
+		double float_ns = allocate<float>(d, cycles, s, repeat);
+		double fixed_ns = allocate<fixed>(d, cycles, s, repeat);
+		std::cout << count << " inverters: poller decode " << poll_ns / 1000 << " us per cycle (" << poll_ns / count << " ns per device), emm float "
+			  << float_ns / 1000 << " us, fixed " << fixed_ns / 1000 << " us per cycle, sram " << count * DEVICE_SRAM << " bytes, psram "
+			  << count * sizeof(generic_modbus_layout) << " bytes\n";
+	}
+	return 0;
+}
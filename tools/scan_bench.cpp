@@ -0,0 +1,165 @@
+/**
+ * Copyright (c) 2026 Josef Stumpfegger josefstumpfegger@outlook.de
+ */
+
+// Compares the two history layouts on the same series: the gorilla compression (gorilla.h, default) and the dense
+// blocks with implicit timestamps (dense.h, HISTORY_DENSE). For the per second samples and the minute and hour
+// buckets it reports the block bytes per sample (the psram read by a scan), the time span the psram of the history
+// holds, the time of a scan over the whole series and of reads of 448 samples as done by the history plot.
+// Both layouts are checked to return the same samples.
+//
+// usage: scan_bench [--days N] [--gap-probability P] [--repeat N] [--seed S]
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "history_data.h"
+
+constexpr int PLOT_SAMPLES{448};	// buffer of draw_data
+static volatile float sink{};		// keeps the scans from being optimized away
+
+// psram of a level of the device histories
+static size_t level_bytes(hd::resolution res) { return hd::level_blocks(hd::DEVICE_RETENTION_S[int(res)], res) * gorilla::block::BYTES; }
+
+struct result {
+	double bytes_per_sample;
+	double scan_ns;		// per sample
+	double window_us;	// per read of PLOT_SAMPLES
+};
+
+template<typename Series, typename Sample>
+static result measure(Series &series, const std::vector<Sample> &values, int repeat, std::mt19937 &rng, std::vector<Sample> &decoded) {
+	series.clear();
+	for (const Sample &v: values)
+		series.push(v);
+	result r{.bytes_per_sample = double(series.blocks.size()) * sizeof(series.blocks.storage[0]) / values.size(), .scan_ns = 0, .window_us = 0};
+
+	auto t0 = std::chrono::steady_clock::now();
+	for (int i [[maybe_unused]]: range(repeat)) {
+		float sum{};
+		series.visit(0, UINT32_MAX, [&](const Sample &v) { sum += v.channel(0); return true; });
+		sink = sum;
+	}
+	auto t1 = std::chrono::steady_clock::now();
+	r.scan_ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / (double(repeat) * values.size());
+
+	const uint32_t step = values.size() > 1 ? values[1].time - values[0].time: 1;
+	std::uniform_int_distribution<uint32_t> start{values.front().time, values.back().time};
+	std::array<Sample, PLOT_SAMPLES> window;
+	const int windows = repeat * 100;
+	t0 = std::chrono::steady_clock::now();
+	for (int i [[maybe_unused]]: range(windows)) {
+		uint32_t t_begin = start(rng);
+		sink = series.read(t_begin, t_begin + PLOT_SAMPLES * step, window);
+	}
+	t1 = std::chrono::steady_clock::now();
+	r.window_us = std::chrono::duration<double, std::micro>(t1 - t0).count() / windows;
+
+	decoded.resize(values.size());
+	decoded.resize(series.read(0, UINT32_MAX, decoded));
+	return r;
+}
+
+template<typename Gorilla, typename Dense, typename Sample>
+static bool compare(const char *name, const std::vector<Sample> &values, size_t psram_bytes, double sample_s, int repeat, std::mt19937 &rng) {
+	static Gorilla gorilla{};
+	static Dense dense{};
+	std::vector<Sample> from_gorilla, from_dense;
+	result g = measure(gorilla, values, repeat, rng, from_gorilla);
+	result d = measure(dense, values, repeat, rng, from_dense);
+	const auto same = [](const std::vector<Sample> &a, const std::vector<Sample> &b) {
+		if (a.size() != b.size())
+			return false;
+		for (int i: range(a.size()))
+			for (int c: range(Sample::CHANNELS))
+				if (a[i].time != b[i].time || std::bit_cast<uint32_t>(a[i].channel(c)) != std::bit_cast<uint32_t>(b[i].channel(c)))
+					return false;
+		return true;
+	};
+	if (!same(from_gorilla, values) || !same(from_dense, values)) {
+		std::cerr << name << ": decoded samples differ from the input\n";
+		return false;
+	}
+	const auto print = [&](const char *layout, const result &r) {
+		std::cout << "  " << layout << r.bytes_per_sample << " bytes per sample (history holds " << psram_bytes / r.bytes_per_sample * sample_s / 3600
+			  << " hours), scan " << r.scan_ns << " ns per sample, " << PLOT_SAMPLES << " sample read " << r.window_us << " us\n";
+	};
+	std::cout << name << ": " << values.size() << " samples\n";
+	print("gorilla ", g);
+	print("dense   ", d);
+	return true;
+}
+
+// whole watt power with noise and load steps, gaps of up to 10 minutes (modbus timeouts or no ntp time)
+static std::vector<t::data_time> seconds(int days, float gap_probability, std::mt19937 &rng) {
+	std::normal_distribution<float> noise{0, 1};
+	std::uniform_real_distribution<float> chance{0, 1};
+	std::uniform_int_distribution<uint32_t> gap{2, 600};
+	std::vector<t::data_time> values;
+	float base{300};
+	const uint32_t start_s{1'750'000'000 / 86400 * 86400};
+	for (uint32_t time = start_s; time < start_s + days * 86400; ++time) {
+		if (chance(rng) < gap_probability)
+			time += gap(rng);
+		if (chance(rng) < .001f)
+			base = 3000 * chance(rng) - 1500;
+		values.push_back({std::round(base + 15 * noise(rng)), time});
+	}
+	return values;
+}
+
+// minute and hour buckets as aggregated by history_data
+static void aggregate(const std::vector<t::data_time> &values, std::vector<t::data_bucket> &minutes, std::vector<t::data_bucket> &hours) {
+	t::accumulator minute{}, hour{};
+	for (const t::data_time &v: values) {
+		if (minute.n && minute.start != v.time / 60 * 60) {
+			minutes.push_back(minute.bucket());
+			if (hour.start != minute.start / 3600 * 3600)
+				hour.reset(minute.start / 3600 * 3600);
+			hour.add(minute.mean(), minute.min, minute.max);
+		}
+		if (hour.n && hour.start != v.time / 3600 * 3600) {
+			hours.push_back(hour.bucket());
+			hour.reset(v.time / 3600 * 3600);
+		}
+		if (minute.start != v.time / 60 * 60)
+			minute.reset(v.time / 60 * 60);
+		minute.add(v.data);
+	}
+}
+
+int main(int argc, char **argv) {
+	int days{7};
+	float gap_probability{.0001f};
+	int repeat{10};
+	uint32_t seed{1};
+	for (int i = 1; i < argc; ++i) {
+		const auto next = [&]() { return i + 1 < argc ? std::atof(argv[++i]): 0.; };
+		if (std::strcmp(argv[i], "--days") == 0) days = std::clamp(int(next()), 1, 40);
+		else if (std::strcmp(argv[i], "--gap-probability") == 0) gap_probability = next();
+		else if (std::strcmp(argv[i], "--repeat") == 0) repeat = std::max(int(next()), 1);
+		else if (std::strcmp(argv[i], "--seed") == 0) seed = next();
+		else {
+			std::cerr << "Unknown argument " << argv[i] << ", see the head of tools/scan_bench.cpp for the usage\n";
+			return 1;
+		}
+	}
+
+	std::mt19937 rng{seed};
+	std::vector<t::data_time> per_second = seconds(days, gap_probability, rng);
+	std::vector<t::data_bucket> minutes, hours;
+	aggregate(per_second, minutes, hours);
+	// block counts large enough for 40 days, so no block is dropped
+	bool ok = compare<gorilla::series<t::data_time, 1 << 16>, dense::series<t::data_time, 1 << 16, 1>>(
+			"second", per_second, level_bytes(hd::resolution::SECOND), 1, repeat, rng);
+	ok &= compare<gorilla::series<t::data_bucket, 1 << 12>, dense::series<t::data_bucket, 1 << 12, 60>>(
+			"minute", minutes, level_bytes(hd::resolution::MINUTE), 60, repeat, rng);
+	ok &= compare<gorilla::series<t::data_bucket, 1 << 10>, dense::series<t::data_bucket, 1 << 10, 3600>>(
+			"hour", hours, level_bytes(hd::resolution::HOUR), 3600, repeat * 10, rng);
+	return ok ? 0: 1;
+}
+